@@ -31,6 +31,8 @@
 #define NAME_0_FREE_ENTRY 0xE5
 #define NAME_0_END_OF_DIR 0x00
 
+#define FAT32_MQUEUE_MAX_LENGTH 64
+
 typedef struct BPB {
     u8 jump[3];
     u8 oem_name[8];
@@ -1306,7 +1308,8 @@ void main(void) {
     if (err)
         return;
     handle_t mqueue;
-    err = mqueue_create(&mqueue);
+    // The queue receives requests for every open file, so it's made deeper than the default
+    err = mqueue_create(&mqueue, FAT32_MQUEUE_MAX_LENGTH, MQUEUE_DEFAULT_MAX_DATA_SIZE);
     if (err)
         return;
     err = mqueue_add_channel_resource(mqueue, &resource_name("file/stat_r"), (MessageTag){TAG_STAT, 0});
@@ -1327,11 +1330,15 @@ void main(void) {
     err = mqueue_add_channel_resource(mqueue, &resource_name("file/open_r"), (MessageTag){TAG_OPEN, 0});
     if (err)
         return;
+    handle_t msg;
+    MessageTag tag;
+    // Set if the next message was already received together with the reply to the previous one
+    bool msg_received = false;
     while (1) {
         // Get message from queue
-        handle_t msg;
-        MessageTag tag;
-        mqueue_receive(mqueue, &tag, &msg, TIMEOUT_NONE, 0);
+        if (!msg_received)
+            mqueue_receive(mqueue, &tag, &msg, TIMEOUT_NONE, 0);
+        msg_received = false;
         // Read message
         u8 *msg_data;
         size_t msg_length;
@@ -1346,7 +1353,7 @@ void main(void) {
                 goto loop_fail;
             FileMetadata stat;
             stat_from_entry(&entry, &stat);
-            message_reply(msg, &(SendMessage){1, &(SendMessageData){sizeof(FileMetadata), &stat}, 0, NULL}, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            msg_received = !message_reply_receive(msg, &(SendMessage){1, &(SendMessageData){sizeof(FileMetadata), &stat}, 0, NULL}, mqueue, &tag, &msg, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
             break;
         }
         case TAG_LIST: {
@@ -1369,7 +1376,7 @@ void main(void) {
                 free(file_list);
                 goto loop_fail;
             }
-            message_reply(msg, &(SendMessage){1, &(SendMessageData){file_list_length, file_list}, 0, NULL}, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            msg_received = !message_reply_receive(msg, &(SendMessage){1, &(SendMessageData){file_list_length, file_list}, 0, NULL}, mqueue, &tag, &msg, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
             free(file_list);
             break;
         }
@@ -1421,7 +1428,7 @@ void main(void) {
             err = write_back_entry(&parent_entry, parent_entry_location.main_entry_offset, UPDATE_WRITE);
             if (err)
                 goto loop_fail;
-            message_reply(msg, NULL, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            msg_received = !message_reply_receive(msg, NULL, mqueue, &tag, &msg, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
             break;
         }
         case TAG_DELETE: {
@@ -1450,7 +1457,7 @@ void main(void) {
             err = write_back_entry(&parent_entry, parent_entry_location.main_entry_offset, UPDATE_WRITE);
             if (err)
                 goto loop_fail;
-            message_reply(msg, NULL, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            msg_received = !message_reply_receive(msg, NULL, mqueue, &tag, &msg, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
             break;
         }
         case TAG_MOVE: {
@@ -1520,7 +1527,7 @@ void main(void) {
             err = write_back_entry(&dest_parent_entry, dest_parent_entry_location.main_entry_offset, UPDATE_WRITE);
             if (err)
                 goto loop_fail;
-            message_reply(msg, NULL, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            msg_received = !message_reply_receive(msg, NULL, mqueue, &tag, &msg, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
             break;
         }
         case TAG_OPEN: {
@@ -1556,7 +1563,7 @@ void main(void) {
             mqueue_add_channel(mqueue, file_write_out, (MessageTag){TAG_WRITE, (uintptr_t)open_file});
             mqueue_add_channel(mqueue, file_get_size_out, (MessageTag){TAG_GET_SIZE, (uintptr_t)open_file});
             mqueue_add_channel(mqueue, file_resize_out, (MessageTag){TAG_RESIZE, (uintptr_t)open_file});
-            message_reply(msg, &(SendMessage){0, NULL, 1, &(SendMessageHandles){4, (SendAttachedHandle[]){{0, file_read_in}, {0, file_write_in}, {0, file_get_size_in}, {0, file_resize_in}}}}, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            msg_received = !message_reply_receive(msg, &(SendMessage){0, NULL, 1, &(SendMessageHandles){4, (SendAttachedHandle[]){{0, file_read_in}, {0, file_write_in}, {0, file_get_size_in}, {0, file_resize_in}}}}, mqueue, &tag, &msg, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
             break;
 file_resize_alloc_fail:
             handle_free(file_get_size_in);
@@ -1598,7 +1605,7 @@ file_read_alloc_fail:
             err = write_back_entry(&open_file->entry, open_file->entry_offset, UPDATE_READ);
             if (err)
                 goto read_fail;
-            message_reply(msg, &(SendMessage){1, &(SendMessageData){range.length, data_buf}, 0, NULL}, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            msg_received = !message_reply_receive(msg, &(SendMessage){1, &(SendMessageData){range.length, data_buf}, 0, NULL}, mqueue, &tag, &msg, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
             free(data_buf);
             break;
 read_fail:
@@ -1634,7 +1641,7 @@ read_fail:
             err = write_back_entry(&open_file->entry, open_file->entry_offset, UPDATE_WRITE);
             if (err)
                 goto loop_fail;
-            message_reply(msg, NULL, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            msg_received = !message_reply_receive(msg, NULL, mqueue, &tag, &msg, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
             break;
         }
         case TAG_GET_SIZE: {
@@ -1644,7 +1651,8 @@ read_fail:
                 goto loop_fail;
             }
             u64 file_size = (u64)open_file->entry.file_size;
-            message_reply(msg, &(SendMessage){1, &(SendMessageData){sizeof(u64), &file_size}, 0, NULL}, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            msg_received = !message_reply_receive(msg, &(SendMessage){1, &(SendMessageData){sizeof(u64), &file_size}, 0, NULL}, mqueue, &tag, &msg, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            break;
         }
         case TAG_RESIZE: {
             OpenFile *open_file = (OpenFile *)tag.data[1];
@@ -1663,7 +1671,8 @@ read_fail:
             err = write_back_entry(&open_file->entry, open_file->entry_offset, UPDATE_WRITE);
             if (err)
                 goto loop_fail;
-            message_reply(msg, NULL, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            msg_received = !message_reply_receive(msg, NULL, mqueue, &tag, &msg, FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE);
+            break;
         }
         }
         free(msg_data);
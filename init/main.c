@@ -264,7 +264,7 @@ part_read_fail:
     }
     // Create mqueue and channel for opening partitions
     handle_t mqueue;
-    err = mqueue_create(&mqueue);
+    err = mqueue_create(&mqueue, MQUEUE_DEFAULT_MAX_LENGTH, MQUEUE_DEFAULT_MAX_DATA_SIZE);
     if (err)
         return;
     handle_t virt_drive_open_in, virt_drive_open_out;
@@ -304,10 +304,14 @@ part_read_fail:
     if (err)
         return;
     free(virt_drive_info);
+    handle_t msg;
+    // Set if the next message was already received together with the reply to the previous one
+    bool msg_received = false;
     while (1) {
         // Wait for a message
-        handle_t msg;
-        mqueue_receive(mqueue, NULL, &msg, TIMEOUT_NONE, 0);
+        if (!msg_received)
+            mqueue_receive(mqueue, NULL, &msg, TIMEOUT_NONE, 0);
+        msg_received = false;
         u32 part_i;
         err = message_read(msg, &(ReceiveMessage){sizeof(u32), &part_i, 0, NULL}, NULL, NULL, 0, 0);
         if (err)
@@ -324,8 +328,8 @@ part_read_fail:
         err = channel_call_read(phys_drive_open_channel, &(SendMessage){1, &(SendMessageData){sizeof(PhysDriveOpenArgs), &drive_open_args}, 0, NULL}, &(ReceiveMessage){0, NULL, 2, drive_attached_handles}, NULL);
         if (err)
             goto loop_fail;
-        // Reply to the message
-        message_reply(msg, &(SendMessage){0, NULL, 1, &(SendMessageHandles){2, (SendAttachedHandle[]){{ATTACHED_HANDLE_FLAG_MOVE, drive_attached_handles[0].handle_i}, {ATTACHED_HANDLE_FLAG_MOVE, drive_attached_handles[1].handle_i}}}}, FLAG_FREE_MESSAGE);
+        // Reply to the message and wait for the next one
+        msg_received = !message_reply_receive(msg, &(SendMessage){0, NULL, 1, &(SendMessageHandles){2, (SendAttachedHandle[]){{ATTACHED_HANDLE_FLAG_MOVE, drive_attached_handles[0].handle_i}, {ATTACHED_HANDLE_FLAG_MOVE, drive_attached_handles[1].handle_i}}}}, mqueue, NULL, &msg, FLAG_FREE_MESSAGE);
         continue;
 loop_fail:
         message_reply_error(msg, user_error_code(err), FLAG_FREE_MESSAGE);
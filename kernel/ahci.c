@@ -6,6 +6,7 @@
 #include "framebuffer.h"
 #include "page.h"
 #include "process.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "string.h"
 
@@ -384,7 +385,7 @@ err_t ahci_init(void) {
         if (sector_count == 0)
             continue;
         // Allocate message queue
-        MessageQueue *port_queue = mqueue_alloc();
+        MessageQueue *port_queue = mqueue_alloc(MQUEUE_DEFAULT_MAX_LENGTH, MQUEUE_DEFAULT_MAX_DATA_SIZE);
         if (port_queue == NULL)
             return ERR_KERNEL_NO_MEMORY;
         // Spawn receive and reply thread
@@ -398,6 +399,8 @@ err_t ahci_init(void) {
             return err;
         process_set_kernel_stack(receive_thread, ahci_drive_receive_kernel_thread_main);
         process_set_kernel_stack(reply_thread, ahci_drive_reply_kernel_thread_main);
+        // The reply thread runs at realtime priority to keep the latency of completing requests low
+        process_set_priority(reply_thread, PROCESS_PRIORITY_REALTIME);
         process_enqueue(receive_thread);
         process_enqueue(reply_thread);
         user_drive_num++;
@@ -447,6 +450,11 @@ _Noreturn void ahci_drive_receive_kernel_thread_main(void) {
         Message *message;
         // Get message from user process
         mqueue_receive(drives[port_i]->queue, &message, false, false, TIMEOUT_NONE);
+        // Write data may have been transferred by moving pages
+        if (message_linearize(message)) {
+            err = ERR_NO_MEMORY;
+            goto fail;
+        }
         // Check if message is write or read command
         bool write = message->tag.data[0] == TAG_WRITE;
         // Verify message size
@@ -490,7 +498,7 @@ _Noreturn void ahci_drive_receive_kernel_thread_main(void) {
         u64 offset_page = offset / PAGE_SIZE;
         u64 length_pages = (offset + length - 1) / PAGE_SIZE - offset / PAGE_SIZE + 1;
         // Allocate issued request structure
-        IssuedRequest *issued_request = malloc(sizeof(IssuedRequest));
+        IssuedRequest *issued_request = slab_alloc(sizeof(IssuedRequest));
         if (issued_request == NULL) {
             err = ERR_NO_MEMORY;
             goto fail;
@@ -504,15 +512,20 @@ _Noreturn void ahci_drive_receive_kernel_thread_main(void) {
             err = ERR_NO_MEMORY;
             goto fail_reply_alloc;
         }
+        // Allocate buffer pages for all commands at once
+        // This is done before any command is issued, so that the request can't fail partway through.
+        u64 *buffer_pages = malloc(length_pages * sizeof(u64));
+        if (buffer_pages == NULL) {
+            err = ERR_NO_MEMORY;
+            goto fail_buffer_pages_alloc;
+        }
+        if (page_alloc_n(buffer_pages, length_pages)) {
+            err = ERR_NO_MEMORY;
+            goto fail_buffer_page_alloc;
+        }
         // Issue a request for each page
         for (u64 i = 0; i < length_pages; i++) {
-            // Allocate buffer page
-            u64 buffer_page;
-            buffer_page = page_alloc();
-            if (buffer_page == 0) {
-                err = ERR_NO_MEMORY;
-                goto fail_buffer_page_alloc;
-            }
+            u64 buffer_page = buffer_pages[i];
             spinlock_acquire(&drives[port_i]->lock);
             // Copy data to page if writing
             bool edge_page = offset > (offset_page + i) * PAGE_SIZE || offset + length < (offset_page + i + 1) * PAGE_SIZE;
@@ -563,11 +576,14 @@ slot_found:;
             drives[port_i]->commands_issued |= UINT32_C(1) << slot_i;
             spinlock_release(&drives[port_i]->lock);
         }
+        free(buffer_pages);
         continue;
 fail_buffer_page_alloc:
+        free(buffer_pages);
+fail_buffer_pages_alloc:
         message_free(issued_request->reply);
 fail_reply_alloc:
-        free(issued_request);
+        slab_free(issued_request, sizeof(IssuedRequest));
 fail:
         message_reply_error(message, err);
         message_free(message);
@@ -655,7 +671,7 @@ command_fail:
                     message_reply(issued_request->message, issued_request->reply);
                     message_free(issued_request->message);
                 }
-                free(issued_request);
+                slab_free(issued_request, sizeof(IssuedRequest));
             }
             // Mark command slot as free
             drives[port_i]->commands_issued &= ~(UINT32_C(1) << slot_i);
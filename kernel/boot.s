@@ -14,7 +14,6 @@ global vbe_mode_info
 global memory_ranges
 global memory_ranges_length
 global pd_fb
-global pdpt_page_stack
 global pd_devices_other
 global pt_id_map_init
 global idle_page_map
@@ -37,8 +36,7 @@ pdpt_devices equ 0x75000
 pd_fb equ 0x74000
 pd_devices_other equ 0x73000
 pt_id_map_init equ 0x72000
-pdpt_page_stack equ 0x71000
-boot_page_tables_start equ 0x71000
+boot_page_tables_start equ 0x72000
 boot_page_tables_length equ 0x80000 - boot_page_tables_start
 
 idle_page_map equ pml4
@@ -84,6 +82,7 @@ CPUID_TSC_DEADLINE equ 1 << 24
 CR0_PE equ 1 << 0
 CR0_MP equ 1 << 1
 CR0_EM equ 1 << 2
+CR0_WP equ 1 << 16
 CR0_PG equ 1 << 31
 CR4_PAE equ 1 << 5
 CR4_PGE equ 1 << 7
@@ -120,7 +119,6 @@ FB_PDPTE equ 0x000
 DEVICES_OTHER_PDPTE equ 0x002
 STACK_PML4E equ 0x1FE
 STACK_BOTTOM_VIRTUAL equ (0xFFFF << 48) | (STACK_PML4E << 39) | PAGE_SIZE
-PAGE_STACK_PML4E equ 0x1FC
 
 SEGMENT_KERNEL_CODE equ 0x08
 SEGMENT_KERNEL_DATA equ 0x10
@@ -595,9 +593,9 @@ protected_mode_start_ap:
   rdmsr
   or eax, EFER_MSR_SCE | EFER_MSR_LME | EFER_MSR_NXE
   wrmsr
-  ; Set PG and clear EM in CR0
+  ; Set PG and WP and clear EM in CR0
   mov eax, cr0
-  or eax, CR0_PG | CR0_MP
+  or eax, CR0_PG | CR0_MP | CR0_WP
   and eax, ~CR0_EM
   mov cr0, eax
   ; Load GDT
@@ -663,14 +661,12 @@ protected_mode_start:
   mov dword [pd_stack], pt_stack | PAGE_WRITE | PAGE_PRESENT
   mov dword [pt_stack], stack | PAGE_GLOBAL | PAGE_WRITE | PAGE_PRESENT
   mov dword [pt_stack + 4], PAGE_NX >> 32
-  ; Set up mapping for framebuffer, identity mapping initialization and page stack
-  ; The pd_fb, pt_id_map_init, and pdpt_page_stack will be filled in by the kernel.
+  ; Set up mapping for framebuffer and identity mapping initialization
+  ; The pd_fb and pt_id_map_init will be filled in by the kernel.
   mov dword [pml4 + DEVICES_PML4E * 8], pdpt_devices | PAGE_WRITE | PAGE_PRESENT
   mov dword [pdpt_devices + FB_PDPTE * 8], pd_fb | PAGE_WRITE | PAGE_PRESENT
   mov dword [pdpt_devices + DEVICES_OTHER_PDPTE * 8], pd_devices_other | PAGE_WRITE | PAGE_PRESENT
   mov dword [pd_devices_other], pt_id_map_init | PAGE_WRITE | PAGE_PRESENT
-  mov dword [pml4 + PAGE_STACK_PML4E * 8], pdpt_page_stack | PAGE_WRITE | PAGE_PRESENT
-  mov dword [pml4 + PAGE_STACK_PML4E * 8 + 4], PAGE_NX >> 32
   ; Map kernel contents at the beginning of the last PDPTE (top 1 GB of address space)
   ; Each segment is mapped with the appropriate permissions.
   mov dword [pml4 + 0x1FF * 8], pdpt_kernel | PAGE_WRITE | PAGE_PRESENT
@@ -723,9 +719,9 @@ protected_mode_start:
   rdmsr
   or eax, EFER_MSR_SCE | EFER_MSR_LME | EFER_MSR_NXE
   wrmsr
-  ; Set PG and clear EM in CR0
+  ; Set PG and WP and clear EM in CR0
   mov eax, cr0
-  or eax, CR0_PG | CR0_MP
+  or eax, CR0_PG | CR0_MP | CR0_WP
   and eax, ~CR0_EM
   mov cr0, eax
   ; Load GDT
@@ -4,23 +4,45 @@
 #include "alloc.h"
 #include "error.h"
 #include "interrupt.h"
+#include "memcpy.h"
 #include "page.h"
 #include "percpu.h"
 #include "process.h"
+#include "shm.h"
+#include "slab.h"
 #include "spinlock.h"
 #include "string.h"
 #include "time.h"
 
-#define MESSAGE_QUEUE_MAX_LENGTH 16
+// Minimum data size of a message for its data to be transferred by moving pages
+#define MESSAGE_MOVE_PAGES_MIN_SIZE (16 * PAGE_SIZE)
+
+// A process blocked waiting for a message to arrive in a queue
+// It's allocated on the stack of the receiving process and linked into the queue while the process waits.
+typedef struct MessageQueueReceiver {
+    // Set to NULL once the receiver is removed from the queue by a sender
+    Process *process;
+    // Set if the process is also in the timeout queue
+    bool waiting_for_timeout;
+    struct MessageQueueReceiver *prev_receiver;
+    struct MessageQueueReceiver *next_receiver;
+} MessageQueueReceiver;
 
 typedef struct MessageQueue {
     spinlock_t lock;
     size_t refcount;
     bool closed;
-    bool waiting_for_timeout;
-    Process *blocked_receiver;
+    // Receivers blocked waiting for a message, in the order they started waiting
+    MessageQueueReceiver *blocked_receivers_start;
+    MessageQueueReceiver *blocked_receivers_end;
     ProcessQueue blocked_senders;
+    // Number of messages in the queue and total size of their data, not counting replies
     size_t length;
+    size_t data_size;
+    // Limits past which senders block until messages are received
+    // A message is always accepted into an empty queue, so that messages larger than the data size limit can still be sent.
+    size_t max_length;
+    size_t max_data_size;
     Message *start;
     Message *end;
 } MessageQueue;
@@ -40,6 +62,9 @@ static void attached_handle_free(AttachedHandle handle) {
     case ATTACHED_HANDLE_TYPE_CHANNEL_RECEIVE:
         channel_del_ref(handle.channel);
         break;
+    case ATTACHED_HANDLE_TYPE_SHARED_MEMORY:
+        shm_del_ref(handle.shm);
+        break;
     }
 }
 
@@ -53,11 +78,6 @@ static err_t verify_user_send_message(const SendMessage *user_message) {
     err = verify_user_buffer(user_message->data_buffers, user_message->data_buffers_num * sizeof(SendMessageData), false);
     if (err)
         return err;
-    for (size_t i = 0; i < user_message->data_buffers_num; i++) {
-        err = verify_user_buffer(user_message->data_buffers[i].data, user_message->data_buffers[i].length, false);
-        if (err)
-            return err;
-    }
     err = verify_user_buffer(user_message->handles_buffers, user_message->handles_buffers_num * sizeof(SendMessageHandles), false);
     if (err)
         return err;
@@ -86,7 +106,7 @@ static err_t verify_user_receive_message(const ReceiveMessage *user_message) {
 // Create a message with a data buffer of a given size
 Message *message_alloc(size_t data_size) {
     // Allocate message
-    Message *message = malloc(sizeof(Message));
+    Message *message = slab_alloc(sizeof(Message));
     if (message == NULL)
         return NULL;
     memset(message, 0, sizeof(Message));
@@ -94,7 +114,7 @@ Message *message_alloc(size_t data_size) {
     // Allocate message data
     message->data = malloc(data_size);
     if (message->data == NULL && data_size != 0) {
-        free(message);
+        slab_free(message, sizeof(Message));
         return NULL;
     }
     return message;
@@ -105,17 +125,125 @@ Message *message_alloc_copy(size_t data_size, const void *data) {
     Message *message = message_alloc(data_size);
     if (message == NULL)
         return NULL;
-    memcpy(message->data, data, data_size);
+    memcpy_large(message->data, data, data_size);
     return message;
 }
 
+// Copy data from a user buffer into the pages of a message starting at a given offset
+static err_t message_pages_write_user(u64 *pages, size_t offset, const void *data, size_t length) {
+    err_t err;
+    while (length > 0) {
+        size_t copy_length = PAGE_SIZE - offset % PAGE_SIZE;
+        if (copy_length > length)
+            copy_length = length;
+        err = copy_from_user(PHYS_ADDR(pages[offset / PAGE_SIZE]) + offset % PAGE_SIZE, data, copy_length);
+        if (err)
+            return err;
+        offset += copy_length;
+        data += copy_length;
+        length -= copy_length;
+    }
+    return 0;
+}
+
+// Get the length of the part at the start of a data buffer that can be moved into the pages of a message
+// Whole pages are moved if the buffer is page-aligned both in memory and within the message.
+static size_t message_pages_movable_length(const SendMessageData *buffer, size_t offset) {
+    if ((u64)buffer->data % PAGE_SIZE != 0 || offset % PAGE_SIZE != 0)
+        return 0;
+    return buffer->length / PAGE_SIZE * PAGE_SIZE;
+}
+
+// Transfer the data of user buffers into the pages of a message
+// Whole pages are moved out of the sender's address space wherever possible, leaving it with zeroed pages, and the rest is copied.
+// The parts that can only be copied are copied first. If copying a page that can't be moved fails afterwards,
+// the pages moved so far are moved back, so that the sender keeps its data.
+static err_t message_pages_transfer_user(u64 *pages, const SendMessageData *buffers, size_t buffers_num) {
+    err_t err;
+    size_t data_offset = 0;
+    for (size_t i = 0; i < buffers_num; i++) {
+        size_t movable_length = message_pages_movable_length(&buffers[i], data_offset);
+        err = message_pages_write_user(pages, data_offset + movable_length, buffers[i].data + movable_length, buffers[i].length - movable_length);
+        if (err)
+            return err;
+        data_offset += buffers[i].length;
+    }
+    data_offset = 0;
+    size_t pages_transferred = 0;
+    for (size_t i = 0; i < buffers_num; i++) {
+        size_t movable_length = message_pages_movable_length(&buffers[i], data_offset);
+        for (size_t offset = 0; offset < movable_length; offset += PAGE_SIZE) {
+            // The message page is cleared before the exchange, so the sender is left with a zeroed page
+            u64 *page = &pages[(data_offset + offset) / PAGE_SIZE];
+            memset(PHYS_ADDR(*page), 0, PAGE_SIZE);
+            if (!exchange_user_page((u64)buffers[i].data + offset, page)) {
+                err = copy_from_user(PHYS_ADDR(*page), buffers[i].data + offset, PAGE_SIZE);
+                if (err)
+                    goto fail;
+            }
+            pages_transferred++;
+        }
+        data_offset += buffers[i].length;
+    }
+    return 0;
+fail:
+    // Exchange the pages transferred so far back into place
+    // Pages that were copied instead of moved are exchanged as well, which leaves the sender with a copy of its own data.
+    data_offset = 0;
+    for (size_t i = 0; i < buffers_num && pages_transferred > 0; i++) {
+        size_t movable_length = message_pages_movable_length(&buffers[i], data_offset);
+        for (size_t offset = 0; offset < movable_length && pages_transferred > 0; offset += PAGE_SIZE) {
+            exchange_user_page((u64)buffers[i].data + offset, &pages[(data_offset + offset) / PAGE_SIZE]);
+            pages_transferred--;
+        }
+        data_offset += buffers[i].length;
+    }
+    return err;
+}
+
+// Copy data from the pages of a message into a user buffer starting at a given offset
+// If `move_pages` is set, whole pages are moved into the user address space instead of being copied wherever alignment allows.
+// Moved pages are exchanged with the pages previously mapped at the destination, so the message data is no longer valid afterwards.
+static err_t message_pages_read_user(u64 *pages, size_t offset, void *data, size_t length, bool move_pages) {
+    err_t err;
+    while (length > 0) {
+        size_t copy_length;
+        if (move_pages && offset % PAGE_SIZE == 0 && (u64)data % PAGE_SIZE == 0 && length >= PAGE_SIZE
+                && exchange_user_page((u64)data, &pages[offset / PAGE_SIZE])) {
+            copy_length = PAGE_SIZE;
+        } else {
+            copy_length = PAGE_SIZE - offset % PAGE_SIZE;
+            if (copy_length > length)
+                copy_length = length;
+            err = copy_to_user(data, PHYS_ADDR(pages[offset / PAGE_SIZE]) + offset % PAGE_SIZE, copy_length);
+            if (err)
+                return err;
+        }
+        offset += copy_length;
+        data += copy_length;
+        length -= copy_length;
+    }
+    return 0;
+}
+
+// Free the pages holding the data of a message
+static void message_pages_free(u64 *pages, size_t data_size) {
+    page_free_n(pages, (data_size + PAGE_SIZE - 1) / PAGE_SIZE);
+    free(pages);
+}
+
 // Create a message from a user-provided message specification
-static err_t message_alloc_user(const SendMessage *user_message, Message **message_ptr, Message *message) {
+// The specification and its buffer lists are copied into kernel memory first, and only the copy is used afterwards,
+// so that other threads or processes sharing the memory can't change the lengths while the message is being created.
+// If `move_pages` is set and the message is large enough, the data is stored in separate pages
+// and page-aligned parts of the data buffers are moved out of the sender's address space instead of being copied.
+// Pages moved out of the sender's address space are replaced with zeroed pages.
+static err_t message_alloc_user(const SendMessage *user_message, Message **message_ptr, Message *message, bool move_pages) {
     err_t err;
     // If the user message is NULL, allocate an empty message
     if (user_message == NULL) {
         if (message == NULL) {
-            message = malloc(sizeof(Message));
+            message = slab_alloc(sizeof(Message));
             if (message == NULL)
                 return ERR_KERNEL_NO_MEMORY;
         }
@@ -123,126 +251,257 @@ static err_t message_alloc_user(const SendMessage *user_message, Message **messa
         *message_ptr = message;
         return 0;
     }
+    // Copy the message specification
+    SendMessage spec;
+    err = copy_from_user(&spec, user_message, sizeof(SendMessage));
+    if (err)
+        return err;
+    if (spec.data_buffers_num > SIZE_MAX / sizeof(SendMessageData) || spec.handles_buffers_num > SIZE_MAX / sizeof(SendMessageHandles))
+        return ERR_KERNEL_INVALID_ADDRESS;
+    SendMessageData *data_buffers = malloc(spec.data_buffers_num * sizeof(SendMessageData));
+    if (spec.data_buffers_num != 0 && data_buffers == NULL)
+        return ERR_KERNEL_NO_MEMORY;
+    err = copy_from_user(data_buffers, spec.data_buffers, spec.data_buffers_num * sizeof(SendMessageData));
+    if (err)
+        goto fail_data_buffers_copy;
+    SendMessageHandles *handles_buffers = malloc(spec.handles_buffers_num * sizeof(SendMessageHandles));
+    if (spec.handles_buffers_num != 0 && handles_buffers == NULL) {
+        err = ERR_KERNEL_NO_MEMORY;
+        goto fail_data_buffers_copy;
+    }
+    err = copy_from_user(handles_buffers, spec.handles_buffers, spec.handles_buffers_num * sizeof(SendMessageHandles));
+    if (err)
+        goto fail_handles_buffers_copy;
     // Calculate total data and handles length
+    // The buffers haven't been verified, so the total lengths are checked for overflow.
     size_t data_length = 0;
-    for (size_t i = 0; i < user_message->data_buffers_num; i++)
-        data_length += user_message->data_buffers[i].length;
+    for (size_t i = 0; i < spec.data_buffers_num; i++) {
+        if (data_length + data_buffers[i].length < data_length) {
+            err = ERR_KERNEL_INVALID_ADDRESS;
+            goto fail_handles_buffers_copy;
+        }
+        data_length += data_buffers[i].length;
+    }
     size_t handles_length = 0;
-    for (size_t i = 0; i < user_message->handles_buffers_num; i++)
-        handles_length += user_message->handles_buffers[i].length;
+    for (size_t i = 0; i < spec.handles_buffers_num; i++) {
+        if (handles_length + handles_buffers[i].length < handles_length || handles_length + handles_buffers[i].length > SIZE_MAX / sizeof(AttachedHandle)) {
+            err = ERR_KERNEL_INVALID_ADDRESS;
+            goto fail_handles_buffers_copy;
+        }
+        handles_length += handles_buffers[i].length;
+    }
+    // Copy the attached handle specifications into a single list
+    SendAttachedHandle *send_handles = malloc(handles_length * sizeof(SendAttachedHandle));
+    if (handles_length != 0 && send_handles == NULL) {
+        err = ERR_KERNEL_NO_MEMORY;
+        goto fail_handles_buffers_copy;
+    }
+    size_t handles_offset = 0;
+    for (size_t i = 0; i < spec.handles_buffers_num; i++) {
+        err = copy_from_user(send_handles + handles_offset, handles_buffers[i].handles, handles_buffers[i].length * sizeof(SendAttachedHandle));
+        if (err)
+            goto fail_send_handles_copy;
+        handles_offset += handles_buffers[i].length;
+    }
+    free(handles_buffers);
+    handles_buffers = NULL;
+    // Data buffers are validated while they're copied
+    // If the data will be transferred by moving pages, the buffers are also verified in advance, since pages can only be moved from user memory.
+    bool use_data_pages = move_pages && data_length >= MESSAGE_MOVE_PAGES_MIN_SIZE;
+    if (use_data_pages) {
+        for (size_t i = 0; i < spec.data_buffers_num; i++) {
+            err = verify_user_buffer(data_buffers[i].data, data_buffers[i].length, false);
+            if (err)
+                goto fail_send_handles_copy;
+        }
+    }
     // Allocate data buffer
-    void *data = malloc(data_length);
-    if (data_length != 0 && data == NULL)
-        return ERR_KERNEL_NO_MEMORY;
+    // If the data will be transferred by moving pages, allocate one page for every page of data instead.
+    // Pages of data that are moved from the sender get exchanged with these pages, while the rest of the data is copied into them.
+    void *data = NULL;
+    u64 *data_pages = NULL;
+    if (use_data_pages) {
+        size_t data_pages_num = (data_length + PAGE_SIZE - 1) / PAGE_SIZE;
+        data_pages = malloc(data_pages_num * sizeof(u64));
+        if (data_pages == NULL) {
+            err = ERR_KERNEL_NO_MEMORY;
+            goto fail_send_handles_copy;
+        }
+        if (page_alloc_n(data_pages, data_pages_num)) {
+            free(data_pages);
+            err = ERR_KERNEL_NO_MEMORY;
+            goto fail_send_handles_copy;
+        }
+    } else {
+        data = malloc(data_length);
+        if (data_length != 0 && data == NULL) {
+            err = ERR_KERNEL_NO_MEMORY;
+            goto fail_send_handles_copy;
+        }
+    }
     // Allocate handle list
     AttachedHandle *handles = malloc(handles_length * sizeof(AttachedHandle));
     if (handles_length != 0 && handles == NULL) {
-        free(data);
-        return ERR_KERNEL_NO_MEMORY;
+        err = ERR_KERNEL_NO_MEMORY;
+        goto fail_handles_alloc;
+    }
+    // Copy the data, unless it's transferred by moving pages
+    // This is done before the handles are copied, since the copy fails if any of the buffers is invalid.
+    if (data_pages == NULL) {
+        size_t data_offset = 0;
+        for (size_t i = 0; i < spec.data_buffers_num; i++) {
+            err = copy_from_user(data + data_offset, data_buffers[i].data, data_buffers[i].length);
+            if (err)
+                goto fail_data_copy;
+            data_offset += data_buffers[i].length;
+        }
     }
     // Allocate the message
     bool message_allocated = false;
     if (message == NULL) {
         message_allocated = true;
-        message = malloc(sizeof(Message));
+        message = slab_alloc(sizeof(Message));
         if (message == NULL) {
-            free(handles);
-            free(data);
-            return ERR_KERNEL_NO_MEMORY;
+            err = ERR_KERNEL_NO_MEMORY;
+            goto fail_data_copy;
         }
     }
     memset(message, 0, sizeof(Message));
     message->data_size = data_length;
     message->data = data;
+    message->data_pages = data_pages;
     message->handles_size = handles_length;
     message->handles = handles;
-    // Verify the handles
-    for (size_t buffer_i = 0; buffer_i < user_message->handles_buffers_num; buffer_i++) {
-        const SendMessageHandles *buffer = &user_message->handles_buffers[buffer_i];
-        for (size_t handle_i = 0; handle_i < buffer->length; handle_i++) {
-            Handle handle;
-            err = handle_get(&cpu_local->current_process->handles, buffer->handles[handle_i].handle_i, &handle);
-            if (err)
-                goto fail;
+    // Copy the handles
+    // The references taken by handle_get() become the references held by the message.
+    HandleList *handle_list = &cpu_local->current_process->group->handles;
+    size_t handles_copied;
+    for (handles_copied = 0; handles_copied < handles_length; handles_copied++) {
+        SendAttachedHandle send_handle = send_handles[handles_copied];
+        Handle handle;
+        err = handle_get(handle_list, send_handle.handle_i, &handle);
+        if (err)
+            goto fail_handles_copy;
+        // Confirm flags are valid
+        if (send_handle.flags & ~ATTACHED_HANDLE_FLAG_MOVE) {
+            err = ERR_KERNEL_INVALID_ARG;
+        } else {
             switch (handle.type) {
             case HANDLE_TYPE_CHANNEL_SEND:
+                handles[handles_copied] = (AttachedHandle){ATTACHED_HANDLE_TYPE_CHANNEL_SEND, {.channel = handle.channel}};
                 break;
             case HANDLE_TYPE_CHANNEL_RECEIVE:
-                if (!(buffer->handles[handle_i].flags & ATTACHED_HANDLE_FLAG_MOVE)) {
+                if (!(send_handle.flags & ATTACHED_HANDLE_FLAG_MOVE))
                     err = ERR_KERNEL_UNCOPIEABLE_HANDLE_TYPE;
-                    goto fail;
-                }
+                handles[handles_copied] = (AttachedHandle){ATTACHED_HANDLE_TYPE_CHANNEL_RECEIVE, {.channel = handle.channel}};
                 break;
-            default:
-                err = ERR_KERNEL_WRONG_HANDLE_TYPE;
-                goto fail;
-            }
-            continue;
-fail:
-            if (message_allocated)
-                free(message);
-            free(handles);
-            free(data);
-            return err;
-        }
-    }
-    // Copy the handles
-    size_t handles_offset = 0;
-    for (size_t buffer_i = 0; buffer_i < user_message->handles_buffers_num; buffer_i++) {
-        const SendMessageHandles *buffer = &user_message->handles_buffers[buffer_i];
-        for (size_t handle_i = 0; handle_i < buffer->length; handle_i++) {
-            // Confirm flags are valid
-            if (buffer->handles[handle_i].flags & ~ATTACHED_HANDLE_FLAG_MOVE) {
-                err = ERR_KERNEL_INVALID_ARG;
-                goto fail;
-            }
-            // Copy the handle data
-            Handle handle;
-            err = handle_get(&cpu_local->current_process->handles, buffer->handles[handle_i].handle_i, &handle);
-            if (err)
-                goto fail;
-            switch (handle.type) {
-            case HANDLE_TYPE_CHANNEL_SEND:
-                if (!(buffer->handles[handle_i].flags & ATTACHED_HANDLE_FLAG_MOVE))
-                    channel_add_ref(handle.channel);
-                handles[handles_offset + handle_i] = (AttachedHandle){ATTACHED_HANDLE_TYPE_CHANNEL_SEND, {.channel = handle.channel}};
-                break;
-            case HANDLE_TYPE_CHANNEL_RECEIVE:
-                handles[handles_offset + handle_i] = (AttachedHandle){ATTACHED_HANDLE_TYPE_CHANNEL_RECEIVE, {.channel = handle.channel}};
+            case HANDLE_TYPE_SHARED_MEMORY:
+                handles[handles_copied] = (AttachedHandle){ATTACHED_HANDLE_TYPE_SHARED_MEMORY, {.shm = handle.shm}};
                 break;
             default:
+                err = ERR_KERNEL_WRONG_HANDLE_TYPE;
                 break;
             }
-            // Remove the handle if move flag is set
-            if (buffer->handles[handle_i].flags & ATTACHED_HANDLE_FLAG_MOVE)
-                handle_clear(&cpu_local->current_process->handles, buffer->handles[handle_i].handle_i, false);
         }
-        handles_offset += buffer->length;
+        if (err) {
+            handle_put(handle_list, send_handle.handle_i, handle);
+            goto fail_handles_copy;
+        }
     }
-    // Copy the data
-    size_t data_offset = 0;
-    for (size_t i = 0; i < user_message->data_buffers_num; i++) {
-        memcpy(data + data_offset, user_message->data_buffers[i].data, user_message->data_buffers[i].length);
-        data_offset += user_message->data_buffers[i].length;
+    // Transfer the data by moving pages
+    // This is done after the handles are copied, since moving pages can't be fully undone, but before any handles are removed,
+    // so that the sender keeps its handles if the transfer fails.
+    if (data_pages != NULL) {
+        err = message_pages_transfer_user(data_pages, data_buffers, spec.data_buffers_num);
+        if (err)
+            goto fail_handles_copy;
+        // The pages are allocated without being cleared, so clear the end of the last page after the data
+        if (data_length % PAGE_SIZE != 0)
+            memset(PHYS_ADDR(data_pages[data_length / PAGE_SIZE]) + data_length % PAGE_SIZE, 0, PAGE_SIZE - data_length % PAGE_SIZE);
     }
+    // Remove the handles that have the move flag set, dropping the reference held by the handle
+    // If another thread has removed a handle in the meantime, the message keeps the only reference.
+    for (size_t i = 0; i < handles_length; i++) {
+        if (!(send_handles[i].flags & ATTACHED_HANDLE_FLAG_MOVE))
+            continue;
+        const void *object = handles[i].type == ATTACHED_HANDLE_TYPE_SHARED_MEMORY ? (const void *)handles[i].shm : (const void *)handles[i].channel;
+        if (handle_take(handle_list, send_handles[i].handle_i, object))
+            attached_handle_free(handles[i]);
+    }
+    free(send_handles);
+    free(data_buffers);
     *message_ptr = message;
     return 0;
+fail_handles_copy:
+    for (size_t i = 0; i < handles_copied; i++)
+        attached_handle_free(handles[i]);
+    if (message_allocated)
+        slab_free(message, sizeof(Message));
+fail_data_copy:
+    free(handles);
+fail_handles_alloc:
+    if (data_pages != NULL)
+        message_pages_free(data_pages, data_length);
+    free(data);
+fail_send_handles_copy:
+    free(send_handles);
+fail_handles_buffers_copy:
+    free(handles_buffers);
+fail_data_buffers_copy:
+    free(data_buffers);
+    return err;
+}
+
+// Move the data of a message transferred by moving pages into a contiguous buffer
+// Kernel threads access message data directly, so they must call this on any message received from userspace before reading its data.
+err_t message_linearize(Message *message) {
+    if (message->data_pages == NULL)
+        return 0;
+    void *data = malloc(message->data_size);
+    if (data == NULL)
+        return ERR_KERNEL_NO_MEMORY;
+    // Large messages are copied using non-temporal stores, so that they don't evict the rest of the cache
+    bool nontemporal = message->data_size >= MEMCPY_NONTEMPORAL_MIN;
+    if (nontemporal)
+        kernel_fpu_begin();
+    for (size_t offset = 0; offset < message->data_size; offset += PAGE_SIZE) {
+        size_t copy_length = message->data_size - offset < PAGE_SIZE ? message->data_size - offset : PAGE_SIZE;
+        if (nontemporal)
+            memcpy_nontemporal(data + offset, PHYS_ADDR(message->data_pages[offset / PAGE_SIZE]), copy_length);
+        else
+            memcpy(data + offset, PHYS_ADDR(message->data_pages[offset / PAGE_SIZE]), copy_length);
+    }
+    if (nontemporal)
+        kernel_fpu_end();
+    message_pages_free(message->data_pages, message->data_size);
+    message->data = data;
+    message->data_pages = NULL;
+    return 0;
 }
 
 // Read a message into user-provided buffers
-err_t message_read_user(const Message *message, ReceiveMessage *user_message, const MessageLength *offset, bool check_types) {
+// If `move_pages` is set, data transferred by moving pages is moved into the user buffer where possible.
+// This leaves the message data invalid, so it should only be set when the message is freed afterwards.
+err_t message_read_user(const Message *message, ReceiveMessage *user_message, const MessageLength *offset, bool check_types, bool move_pages) {
     err_t err;
     if (message->data_size >= offset->data) {
         if (user_message->data_length > message->data_size - offset->data)
             user_message->data_length = message->data_size - offset->data;
-        memcpy(user_message->data, message->data + offset->data, user_message->data_length);
+        // The data is copied with copy_to_user() rather than with non-temporal stores, since those run with preemption disabled,
+        // where a page fault on the user buffer can't be handled
+        if (message->data_pages != NULL)
+            err = message_pages_read_user(message->data_pages, offset->data, user_message->data, user_message->data_length, move_pages);
+        else
+            err = copy_to_user(user_message->data, message->data + offset->data, user_message->data_length);
+        if (err)
+            return err;
     } else {
         user_message->data_length = 0;
     }
     if (message->handles_size >= offset->handles) {
         if (user_message->handles_length > message->handles_size - offset->handles)
             user_message->handles_length = message->handles_size - offset->handles;
-        err = handles_reserve(&cpu_local->current_process->handles, user_message->handles_length);
+        err = handles_reserve(&cpu_local->current_process->group->handles, user_message->handles_length);
         if (err)
             return err;
         // Check handle types if necessary
@@ -254,23 +513,39 @@ err_t message_read_user(const Message *message, ReceiveMessage *user_message, co
             }
         }
         // Read the handles
+        // Each handle holds a new reference to the object. If a handle can't be added, the handles added so far are removed again.
+        HandleList *handle_list = &cpu_local->current_process->group->handles;
         for (size_t i = 0; i < user_message->handles_length; i++) {
-            switch (message->handles[offset->handles + i].type) {
-            case ATTACHED_HANDLE_TYPE_CHANNEL_SEND: {
-                channel_add_ref(message->handles[offset->handles + i].channel);
-                handle_t handle_i;
-                handle_add(&cpu_local->current_process->handles, (Handle){HANDLE_TYPE_CHANNEL_SEND, {.channel = message->handles[offset->handles + i].channel}}, &handle_i);
-                user_message->handles[i] = (ReceiveAttachedHandle){ATTACHED_HANDLE_TYPE_CHANNEL_SEND, handle_i};
+            AttachedHandle attached_handle = message->handles[offset->handles + i];
+            Handle handle;
+            switch (attached_handle.type) {
+            case ATTACHED_HANDLE_TYPE_CHANNEL_SEND:
+                channel_add_ref(attached_handle.channel);
+                handle = (Handle){HANDLE_TYPE_CHANNEL_SEND, {.channel = attached_handle.channel}};
                 break;
-            }
-            case ATTACHED_HANDLE_TYPE_CHANNEL_RECEIVE: {
-                channel_add_ref(message->handles[offset->handles + i].channel);
-                handle_t handle_i;
-                handle_add(&cpu_local->current_process->handles, (Handle){HANDLE_TYPE_CHANNEL_RECEIVE, {.channel = message->handles[offset->handles + i].channel}}, &handle_i);
-                user_message->handles[i] = (ReceiveAttachedHandle){ATTACHED_HANDLE_TYPE_CHANNEL_RECEIVE, handle_i};
+            case ATTACHED_HANDLE_TYPE_CHANNEL_RECEIVE:
+                channel_add_ref(attached_handle.channel);
+                handle = (Handle){HANDLE_TYPE_CHANNEL_RECEIVE, {.channel = attached_handle.channel}};
+                break;
+            case ATTACHED_HANDLE_TYPE_SHARED_MEMORY:
+            default:
+                shm_add_ref(attached_handle.shm);
+                handle = (Handle){HANDLE_TYPE_SHARED_MEMORY, {.shm = attached_handle.shm}};
                 break;
             }
+            handle_t handle_i;
+            err = handle_add(handle_list, handle, &handle_i);
+            if (err) {
+                attached_handle_free(attached_handle);
+                for (size_t j = 0; j < i; j++) {
+                    AttachedHandle added_handle = message->handles[offset->handles + j];
+                    const void *object = added_handle.type == ATTACHED_HANDLE_TYPE_SHARED_MEMORY ? (const void *)added_handle.shm : (const void *)added_handle.channel;
+                    if (handle_take(handle_list, user_message->handles[j].handle_i, object))
+                        attached_handle_free(added_handle);
+                }
+                return err;
             }
+            user_message->handles[i] = (ReceiveAttachedHandle){attached_handle.type, handle_i};
         }
     } else {
         user_message->handles_length = 0;
@@ -281,19 +556,23 @@ err_t message_read_user(const Message *message, ReceiveMessage *user_message, co
 // Free a message along with its data buffer
 void message_free(Message *message) {
     free(message->data);
+    if (message->data_pages != NULL)
+        message_pages_free(message->data_pages, message->data_size);
     for (size_t i = 0; i < message->handles_size; i++)
         attached_handle_free(message->handles[i]);
     if (message->async_reply) {
         mqueue_del_ref(message->mqueue);
-        free(message->reply_template);
+        slab_free(message->reply_template, sizeof(Message));
     }
-    free(message);
+    slab_free(message, sizeof(Message));
 }
 
 static err_t mqueue_send(MessageQueue *queue, Message *message, bool nonblock);
 
 // Reply to a message
-err_t message_reply(Message *message, Message *reply) {
+// If there is a sender blocked waiting for the reply and `sender_ptr` is not NULL, the sender is not unblocked,
+// but returned through `sender_ptr` instead. The caller is then responsible for unblocking it.
+static err_t message_reply_(Message *message, Message *reply, Process **sender_ptr) {
     // Fail if message was already replied to
     if (message->replied_to)
         return ERR_KERNEL_MESSAGE_ALREADY_REPLIED_TO;
@@ -319,16 +598,26 @@ err_t message_reply(Message *message, Message *reply) {
             *(message->reply) = reply;
         else
             message_free(reply);
-        // If there is a sender blocked waiting for a reply, unblock it
-        if (message->blocked_sender != NULL)
-            process_enqueue(message->blocked_sender);
+        // If there is a sender blocked waiting for a reply, unblock it or return it to the caller
+        if (message->blocked_sender != NULL) {
+            if (sender_ptr != NULL)
+                *sender_ptr = message->blocked_sender;
+            else
+                process_enqueue(message->blocked_sender);
+        }
         message->blocked_sender = NULL;
     }
     return 0;
 }
 
+// Reply to a message
+err_t message_reply(Message *message, Message *reply) {
+    return message_reply_(message, reply, NULL);
+}
+
 // Reply to a message with an error code
-err_t message_reply_error(Message *message, err_t error) {
+// The blocked sender is handled the same way as in message_reply_().
+static err_t message_reply_error_(Message *message, err_t error, Process **sender_ptr) {
     // Fail if message was already replied to
     if (message->replied_to)
         return ERR_KERNEL_MESSAGE_ALREADY_REPLIED_TO;
@@ -351,24 +640,43 @@ err_t message_reply_error(Message *message, err_t error) {
         // Set the reply error code if one is wanted
         if (message->reply_error != NULL)
             *(message->reply_error) = error;
-        // If there is a sender blocked waiting for a reply, unblock it
-        if (message->blocked_sender != NULL)
-            process_enqueue(message->blocked_sender);
+        // If there is a sender blocked waiting for a reply, unblock it or return it to the caller
+        if (message->blocked_sender != NULL) {
+            if (sender_ptr != NULL)
+                *sender_ptr = message->blocked_sender;
+            else
+                process_enqueue(message->blocked_sender);
+        }
         message->blocked_sender = NULL;
     }
     return 0;
 }
 
-// Create a message queue
-MessageQueue *mqueue_alloc(void) {
-    MessageQueue *mqueue = malloc(sizeof(MessageQueue));
+// Reply to a message with an error code
+err_t message_reply_error(Message *message, err_t error) {
+    return message_reply_error_(message, error, NULL);
+}
+
+// Create a message queue holding at most `max_length` messages with at most `max_data_size` bytes of data in total
+MessageQueue *mqueue_alloc(size_t max_length, size_t max_data_size) {
+    MessageQueue *mqueue = slab_alloc(sizeof(MessageQueue));
     if (mqueue == NULL)
         return NULL;
     memset(mqueue, 0, sizeof(MessageQueue));
     mqueue->refcount = 1;
+    mqueue->max_length = max_length;
+    mqueue->max_data_size = max_data_size;
     return mqueue;
 }
 
+// Check if a message queue has no space for a message
+// Replies are always accepted, since their senders can't block waiting for the receiver.
+static bool mqueue_full(MessageQueue *queue, Message *message) {
+    if (message->is_reply || queue->length == 0)
+        return false;
+    return queue->length >= queue->max_length || message->data_size > queue->max_data_size - queue->data_size;
+}
+
 // Increment the message queue reference count
 void mqueue_add_ref(MessageQueue *queue) {
     spinlock_acquire(&queue->lock);
@@ -387,7 +695,7 @@ void mqueue_del_ref(MessageQueue *queue) {
             message = next_message;
         }
         spinlock_release(&queue->lock);
-        free(queue);
+        slab_free(queue, sizeof(MessageQueue));
     } else {
         spinlock_release(&queue->lock);
     }
@@ -404,6 +712,54 @@ void mqueue_close(MessageQueue *queue) {
     spinlock_release(&queue->lock);
 }
 
+// Add a receiver to the end of the list of receivers blocked on a queue
+static void mqueue_receiver_add(MessageQueue *queue, MessageQueueReceiver *receiver) {
+    receiver->prev_receiver = queue->blocked_receivers_end;
+    receiver->next_receiver = NULL;
+    if (queue->blocked_receivers_end == NULL)
+        queue->blocked_receivers_start = receiver;
+    else
+        queue->blocked_receivers_end->next_receiver = receiver;
+    queue->blocked_receivers_end = receiver;
+}
+
+// Remove a receiver from the list of receivers blocked on a queue
+static void mqueue_receiver_remove(MessageQueue *queue, MessageQueueReceiver *receiver) {
+    if (receiver->prev_receiver == NULL)
+        queue->blocked_receivers_start = receiver->next_receiver;
+    else
+        receiver->prev_receiver->next_receiver = receiver->next_receiver;
+    if (receiver->next_receiver == NULL)
+        queue->blocked_receivers_end = receiver->prev_receiver;
+    else
+        receiver->next_receiver->prev_receiver = receiver->prev_receiver;
+}
+
+// Unblock the receiver that has been waiting on a queue the longest
+// Receivers that were already unblocked by a timeout are skipped, since they won't take a message from the queue.
+// Must be called with the queue lock held.
+static void mqueue_unblock_receiver(MessageQueue *queue) {
+    while (queue->blocked_receivers_start != NULL) {
+        MessageQueueReceiver *receiver = queue->blocked_receivers_start;
+        mqueue_receiver_remove(queue, receiver);
+        Process *process = receiver->process;
+        receiver->process = NULL;
+        bool unblock;
+        if (receiver->waiting_for_timeout) {
+            spinlock_acquire(&wait_queue_lock);
+            unblock = wait_queue_remove_process(process);
+            spinlock_release(&wait_queue_lock);
+        } else {
+            unblock = true;
+        }
+        if (unblock) {
+            process->timed_out = false;
+            process_enqueue(process);
+            return;
+        }
+    }
+}
+
 // Send a message to a message queue - assumes the queue lock is already held
 static err_t mqueue_send_(MessageQueue *queue, Message *message, bool nonblock) {
     // Fail if queue is closed
@@ -412,7 +768,7 @@ static err_t mqueue_send_(MessageQueue *queue, Message *message, bool nonblock)
         return ERR_KERNEL_CHANNEL_CLOSED;
     }
     // If the queue is full, block until there is space
-    while (!message->is_reply && queue->length >= MESSAGE_QUEUE_MAX_LENGTH) {
+    while (mqueue_full(queue, message)) {
         if (nonblock) {
             message_free(message);
             return ERR_KERNEL_MQUEUE_FULL;
@@ -430,26 +786,12 @@ static err_t mqueue_send_(MessageQueue *queue, Message *message, bool nonblock)
         queue->end->next_message = message;
         queue->end = message;
     }
-    if (!message->is_reply)
+    if (!message->is_reply) {
         queue->length += 1;
-    // If there is a receiver blocked waiting for a message, unblock it
-    // Don't unblock if the process has already been unblocked by a timeout
-    if (queue->blocked_receiver != NULL) {
-        bool unblock;
-        if (queue->waiting_for_timeout) {
-            spinlock_acquire(&wait_queue_lock);
-            unblock = wait_queue_remove_process(queue->blocked_receiver);
-            spinlock_release(&wait_queue_lock);
-            queue->waiting_for_timeout = false;
-        } else {
-            unblock = true;
-        }
-        if (unblock) {
-            queue->blocked_receiver->timed_out = false;
-            process_enqueue(queue->blocked_receiver);
-        }
+        queue->data_size += message->data_size;
     }
-    queue->blocked_receiver = NULL;
+    // If there are receivers blocked waiting for a message, unblock one of them
+    mqueue_unblock_receiver(queue);
     return 0;
 }
 
@@ -486,8 +828,12 @@ static err_t mqueue_call(MessageQueue *queue, Message *message, Message **reply)
     return reply_error;
 }
 
-// Receive a message from a queue
-err_t mqueue_receive(MessageQueue *queue, Message **message_ptr, bool nonblock, bool prioritize_timeout, i64 timeout) {
+// Receive up to `n` messages from a queue
+// Blocks until at least one message is available, and then takes all available messages up to `n` under a single lock acquisition.
+// A message carrying an error code is only ever returned alone, so that the caller can report its error
+// without dropping other messages.
+// Any number of processes can wait on the same queue. Each message sent unblocks one of them.
+err_t mqueue_receive_batch(MessageQueue *queue, Message **messages, size_t n, size_t *received_ptr, bool nonblock, bool prioritize_timeout, i64 timeout) {
     // If timeouts are prioritized, check for timeout first
     if (prioritize_timeout && timeout != TIMEOUT_NONE && time_get() >= timeout)
         return ERR_KERNEL_TIMEOUT;
@@ -501,8 +847,9 @@ err_t mqueue_receive(MessageQueue *queue, Message **message_ptr, bool nonblock,
         }
         if (timeout == TIMEOUT_NONE) {
             // If there is no timeout, block until message is received
-            queue->blocked_receiver = cpu_local->current_process;
-            queue->waiting_for_timeout = false;
+            // The sender that unblocks the process also removes it from the list of blocked receivers.
+            MessageQueueReceiver receiver = {cpu_local->current_process, false, NULL, NULL};
+            mqueue_receiver_add(queue, &receiver);
             process_block(&queue->lock);
             spinlock_acquire(&queue->lock);
         } else {
@@ -512,40 +859,56 @@ err_t mqueue_receive(MessageQueue *queue, Message **message_ptr, bool nonblock,
                 return ERR_KERNEL_TIMEOUT;
             }
             // Add to timeout queue and wait for message at the same time
-            queue->blocked_receiver = cpu_local->current_process;
-            queue->waiting_for_timeout = true;
+            MessageQueueReceiver receiver = {cpu_local->current_process, true, NULL, NULL};
+            mqueue_receiver_add(queue, &receiver);
             spinlock_acquire(&wait_queue_lock);
             wait_queue_insert_current_process(timeout);
             spinlock_release(&queue->lock);
             process_block(&wait_queue_lock);
-            // After unblocking, check if the cause was a timeout and return an error if it was
+            // If the process was unblocked by the timeout, it's still in the list of blocked receivers
             spinlock_acquire(&queue->lock);
-            queue->waiting_for_timeout = false;
-            queue->blocked_receiver = NULL;
+            if (receiver.process != NULL)
+                mqueue_receiver_remove(queue, &receiver);
+            // Check if the cause was a timeout and return an error if it was
+            // If a message arrived anyway, pass it on to another blocked receiver.
             if (cpu_local->current_process->timed_out || (prioritize_timeout && time_get() >= timeout)) {
+                if (queue->start != NULL)
+                    mqueue_unblock_receiver(queue);
                 spinlock_release(&queue->lock);
                 return ERR_KERNEL_TIMEOUT;
             }
         }
     }
-    // Remove a message from the queue
-    Message *message = queue->start;
-    queue->start = queue->start->next_message;
-    if (!message->is_reply) {
-        queue->length -= 1;
-        // If there is a blocked sender, unblock it
-        Process *blocked_sender = process_queue_remove(&queue->blocked_senders);
-        if (blocked_sender != NULL)
-            process_enqueue(blocked_sender);
+    // Remove the messages from the queue
+    // Stop before a message carrying an error code, or right after one if it's the first message.
+    size_t received = 0;
+    while (received < n && queue->start != NULL && (received == 0 || (queue->start->error_code == 0 && messages[0]->error_code == 0))) {
+        Message *message = queue->start;
+        queue->start = queue->start->next_message;
+        if (!message->is_reply) {
+            queue->length -= 1;
+            queue->data_size -= message->data_size;
+            // If there is a blocked sender, unblock it
+            Process *blocked_sender = process_queue_remove(&queue->blocked_senders);
+            if (blocked_sender != NULL)
+                process_enqueue(blocked_sender);
+        }
+        messages[received++] = message;
     }
     spinlock_release(&queue->lock);
-    *message_ptr = message;
+    *received_ptr = received;
     return 0;
 }
 
+// Receive a message from a queue
+err_t mqueue_receive(MessageQueue *queue, Message **message_ptr, bool nonblock, bool prioritize_timeout, i64 timeout) {
+    size_t received;
+    return mqueue_receive_batch(queue, message_ptr, 1, &received, nonblock, prioritize_timeout, timeout);
+}
+
 // Create a channel
 Channel *channel_alloc(void) {
-    Channel *channel = malloc(sizeof(Channel));
+    Channel *channel = slab_alloc(sizeof(Channel));
     if (channel == NULL)
         return NULL;
     memset(channel, 0, sizeof(Channel));
@@ -568,7 +931,7 @@ void channel_del_ref(Channel *channel) {
         if (channel->queue != NULL)
             mqueue_del_ref(channel->queue);
         spinlock_release(&channel->lock);
-        free(channel);
+        slab_free(channel, sizeof(Channel));
     } else {
         spinlock_release(&channel->lock);
     }
@@ -636,6 +999,38 @@ err_t channel_send(Channel *channel, Message *message, bool nonblock) {
     return mqueue_send(queue, message, nonblock);
 }
 
+// Send multiple messages on a channel
+// The channel and queue locks are each acquired once for the whole batch. The messages are sent in order.
+// If sending one of them fails, the remaining ones are freed. The number of messages sent is returned in `sent_ptr` either way.
+err_t channel_send_batch(Channel *channel, Message **messages, size_t n, bool nonblock, size_t *sent_ptr) {
+    err_t err;
+    MessageQueue *queue;
+    *sent_ptr = 0;
+    err = channel_prepare_for_send(channel, messages[0], &queue, nonblock);
+    if (err) {
+        for (size_t i = 0; i < n; i++)
+            message_free(messages[i]);
+        return err;
+    }
+    for (size_t i = 1; i < n; i++)
+        messages[i]->tag = messages[0]->tag;
+    spinlock_acquire(&queue->lock);
+    size_t sent = 0;
+    for (; sent < n; sent++) {
+        err = mqueue_send_(queue, messages[sent], nonblock);
+        if (err)
+            break;
+    }
+    spinlock_release(&queue->lock);
+    *sent_ptr = sent;
+    if (err) {
+        for (size_t i = sent + 1; i < n; i++)
+            message_free(messages[i]);
+        return err;
+    }
+    return 0;
+}
+
 // Send a message on a channel and wait for a reply
 err_t channel_call(Channel *channel, Message *message, Message **reply) {
     err_t err;
@@ -657,7 +1052,7 @@ err_t channel_call_async(Channel *channel, Message *message, MessageQueue *mqueu
         message_free(message);
         return err;
     }
-    message->reply_template = malloc(sizeof(Message));
+    message->reply_template = slab_alloc(sizeof(Message));
     if (message->reply_template == NULL) {
         message_free(message);
         return ERR_KERNEL_NO_MEMORY;
@@ -673,20 +1068,24 @@ err_t channel_call_async(Channel *channel, Message *message, MessageQueue *mqueu
 err_t syscall_message_get_length(handle_t i, MessageLength *length) {
     err_t err;
     Handle handle;
-    // Get the message from handle
-    err = handle_get(&cpu_local->current_process->handles, i, &handle);
-    if (err)
-        return err;
-    if (handle.type != HANDLE_TYPE_MESSAGE)
-        return ERR_KERNEL_WRONG_HANDLE_TYPE;
     // Verify buffer is valid
     err = verify_user_buffer(length, sizeof(MessageLength), true);
     if (err)
         return err;
+    // Get the message from handle
+    err = handle_get(&cpu_local->current_process->group->handles, i, &handle);
+    if (err)
+        return err;
+    if (handle.type != HANDLE_TYPE_MESSAGE) {
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+        goto put_message;
+    }
     // Copy the length
     length->data = handle.message->data_size;
     length->handles = handle.message->handles_size;
-    return 0;
+put_message:
+    handle_put(&cpu_local->current_process->group->handles, i, handle);
+    return err;
 }
 
 // Read the contents of a message into a buffer starting at a given offset
@@ -701,12 +1100,6 @@ err_t syscall_message_read(handle_t i, ReceiveMessage *user_message, const Messa
     // Verify flags are valid
     if (flags & ~(FLAG_ALLOW_PARTIAL_DATA_READ | FLAG_ALLOW_PARTIAL_HANDLES_READ | FLAG_FREE_MESSAGE))
         return ERR_KERNEL_INVALID_ARG;
-    // Get the message from handle
-    err = handle_get(&cpu_local->current_process->handles, i, &handle);
-    if (err)
-        return err;
-    if (handle.type != HANDLE_TYPE_MESSAGE)
-        return ERR_KERNEL_WRONG_HANDLE_TYPE;
     // Check provided error code is not reserved
     if (reply_error >= ERR_KERNEL_MIN)
         return ERR_KERNEL_INVALID_ARG;
@@ -724,6 +1117,14 @@ err_t syscall_message_read(handle_t i, ReceiveMessage *user_message, const Messa
         if (err)
             return err;
     }
+    // Get the message from handle
+    err = handle_get(&cpu_local->current_process->group->handles, i, &handle);
+    if (err)
+        return err;
+    if (handle.type != HANDLE_TYPE_MESSAGE) {
+        handle_put(&cpu_local->current_process->group->handles, i, handle);
+        return ERR_KERNEL_WRONG_HANDLE_TYPE;
+    }
     // Perform bounds check
     size_t data_length = handle.message != NULL ? handle.message->data_size : 0;
     size_t handles_length = handle.message != NULL ? handle.message->handles_size : 0;
@@ -742,45 +1143,109 @@ err_t syscall_message_read(handle_t i, ReceiveMessage *user_message, const Messa
     if (range_err != 0) {
         if (reply_error != 0)
             message_reply_error(handle.message, reply_error);
-        handle_clear(&cpu_local->current_process->handles, i, true);
+        handle_clear(&cpu_local->current_process->group->handles, i, true);
         err = range_err;
     } else {
         // Copy the message data if bounds check passed
-        err = message_read_user(handle.message, user_message, offset, true);
+        err = message_read_user(handle.message, user_message, offset, true, (bool)(flags & FLAG_FREE_MESSAGE));
     }
     // Free message and handle if requested
+    // The message is freed once it's no longer used.
     if (flags & FLAG_FREE_MESSAGE)
-        handle_clear(&cpu_local->current_process->handles, i, true);
+        handle_clear(&cpu_local->current_process->group->handles, i, true);
+    handle_put(&cpu_local->current_process->group->handles, i, handle);
     return err;
 }
 
 // Send a message on a channel
+// If FLAG_MOVE_PAGES is set, the data of large messages is transferred by moving whole pages where possible.
 err_t syscall_channel_send(handle_t channel_i, const SendMessage *user_message, u64 flags) {
     err_t err;
     Handle channel_handle;
     // Verify flags are valid
-    if (flags & ~FLAG_NONBLOCK)
+    if (flags & ~(FLAG_NONBLOCK | FLAG_MOVE_PAGES))
         return ERR_KERNEL_INVALID_ARG;
     // Verify buffers are valid
     err = verify_user_send_message(user_message);
     if (err)
         return err;
     // Get the channel from handle
-    err = handle_get(&cpu_local->current_process->handles, channel_i, &channel_handle);
+    err = handle_get(&cpu_local->current_process->group->handles, channel_i, &channel_handle);
     if (err)
         return err;
-    if (channel_handle.type != HANDLE_TYPE_CHANNEL_SEND)
-        return ERR_KERNEL_WRONG_HANDLE_TYPE;
+    if (channel_handle.type != HANDLE_TYPE_CHANNEL_SEND) {
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+        goto put_channel;
+    }
     // Create a message
     Message *message;
-    err = message_alloc_user(user_message, &message, NULL);
+    err = message_alloc_user(user_message, &message, NULL, (bool)(flags & FLAG_MOVE_PAGES));
     if (err)
-        return err;
+        goto put_channel;
     // Send the message
     err = channel_send(channel_handle.channel, message, (bool)(flags & FLAG_NONBLOCK));
+put_channel:
+    handle_put(&cpu_local->current_process->group->handles, channel_i, channel_handle);
+    return err;
+}
+
+// Send multiple messages on a channel with a single syscall
+// At most MESSAGE_BATCH_MAX messages can be sent at once. The flags are the same as in channel_send().
+// If an error occurs, the messages before the failed one are still sent. The number of messages sent is written to `sent_ptr` if it's not NULL.
+err_t syscall_channel_send_batch(handle_t channel_i, const SendMessage *user_messages, size_t n, size_t *sent_ptr, u64 flags) {
+    err_t err;
+    Handle channel_handle;
+    // Report no messages sent until they are, so that the count is written on every error
+    if (sent_ptr != NULL) {
+        err = verify_user_buffer(sent_ptr, sizeof(size_t), true);
+        if (err)
+            return err;
+        *sent_ptr = 0;
+    }
+    // Verify flags are valid
+    if (flags & ~(FLAG_NONBLOCK | FLAG_MOVE_PAGES))
+        return ERR_KERNEL_INVALID_ARG;
+    if (n == 0 || n > MESSAGE_BATCH_MAX)
+        return ERR_KERNEL_INVALID_ARG;
+    // Verify buffers are valid
+    err = verify_user_buffer(user_messages, n * sizeof(SendMessage), false);
     if (err)
         return err;
-    return 0;
+    for (size_t i = 0; i < n; i++) {
+        err = verify_user_send_message(&user_messages[i]);
+        if (err)
+            return err;
+    }
+    // Get the channel from handle
+    err = handle_get(&cpu_local->current_process->group->handles, channel_i, &channel_handle);
+    if (err)
+        return err;
+    if (channel_handle.type != HANDLE_TYPE_CHANNEL_SEND) {
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+        goto put_channel;
+    }
+    // Create the messages
+    // Creating a message moves its handles out of the handle list, so if creating one fails,
+    // the ones created before it are still sent rather than freed, and the error is reported afterwards.
+    Message *messages[MESSAGE_BATCH_MAX];
+    size_t allocated = 0;
+    err_t alloc_err = 0;
+    for (; allocated < n; allocated++) {
+        alloc_err = message_alloc_user(&user_messages[allocated], &messages[allocated], NULL, (bool)(flags & FLAG_MOVE_PAGES));
+        if (alloc_err)
+            break;
+    }
+    // Send the messages
+    size_t sent = 0;
+    if (allocated != 0)
+        err = channel_send_batch(channel_handle.channel, messages, allocated, (bool)(flags & FLAG_NONBLOCK), &sent);
+    if (sent_ptr != NULL)
+        *sent_ptr = sent;
+    if (!err)
+        err = alloc_err;
+put_channel:
+    handle_put(&cpu_local->current_process->group->handles, channel_i, channel_handle);
+    return err;
 }
 
 // Send a message on a channel and wait for a reply
@@ -797,26 +1262,61 @@ err_t syscall_channel_call(handle_t channel_i, const SendMessage *user_message,
             return err;
     }
     // Get the channel from handle
-    err = handle_get(&cpu_local->current_process->handles, channel_i, &channel_handle);
+    err = handle_get(&cpu_local->current_process->group->handles, channel_i, &channel_handle);
     if (err)
         return err;
-    if (channel_handle.type != HANDLE_TYPE_CHANNEL_SEND)
-        return ERR_KERNEL_WRONG_HANDLE_TYPE;
+    if (channel_handle.type != HANDLE_TYPE_CHANNEL_SEND) {
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+        goto put_channel;
+    }
     // Create a message
     Message *message;
-    err = message_alloc_user(user_message, &message, NULL);
+    err = message_alloc_user(user_message, &message, NULL, false);
     if (err)
-        return err;
+        goto put_channel;
     // Send the message
     Message *reply;
     err = channel_call(channel_handle.channel, message, &reply);
     if (err)
-        return err;
+        goto put_channel;
     // Add the reply handle
-    if (reply_i_ptr != NULL) {
-        err = handle_add(&cpu_local->current_process->handles, (Handle){HANDLE_TYPE_MESSAGE, {.message = reply}}, reply_i_ptr);
-        if (err)
-            return err;
+    if (reply_i_ptr != NULL)
+        err = handle_add(&cpu_local->current_process->group->handles, (Handle){HANDLE_TYPE_MESSAGE, {.message = reply}}, reply_i_ptr);
+put_channel:
+    handle_put(&cpu_local->current_process->group->handles, channel_i, channel_handle);
+    return err;
+}
+
+// Free a received message that can't be returned to the user
+// The sender is replied to with the error first, so that it doesn't wait for a reply forever.
+static void message_drop(Message *message, err_t error) {
+    message_reply_error(message, error);
+    message_free(message);
+}
+
+// Receive a message from a queue and return it to the user
+// Assumes the user buffers were already verified.
+static err_t mqueue_receive_user(MessageQueue *mqueue, MessageTag *tag_ptr, handle_t *message_i_ptr, bool nonblock, bool prioritize_timeout, i64 timeout) {
+    err_t err;
+    // Receive a message
+    Message *message;
+    err = mqueue_receive(mqueue, &message, nonblock, prioritize_timeout, timeout);
+    if (err)
+        return err;
+    // Return the tag
+    if (tag_ptr != NULL)
+        *tag_ptr = message->tag;
+    // Return error code if the message has one
+    if (message->error_code) {
+        err = message->error_code;
+        message_free(message);
+        return err;
+    }
+    // Add the handle
+    err = handle_add(&cpu_local->current_process->group->handles, (Handle){HANDLE_TYPE_MESSAGE, {.message = message}}, message_i_ptr);
+    if (err) {
+        message_drop(message, err);
+        return err;
     }
     return 0;
 }
@@ -838,63 +1338,205 @@ err_t syscall_mqueue_receive(handle_t mqueue_i, MessageTag *tag_ptr, handle_t *m
     if (err)
         return err;
     // Get the channel from handle
-    err = handle_get(&cpu_local->current_process->handles, mqueue_i, &mqueue_handle);
+    err = handle_get(&cpu_local->current_process->group->handles, mqueue_i, &mqueue_handle);
     if (err)
         return err;
-    if (mqueue_handle.type != HANDLE_TYPE_MESSAGE_QUEUE)
-        return ERR_KERNEL_WRONG_HANDLE_TYPE;
-    // Receive a message
-    Message *message;
-    err = mqueue_receive(mqueue_handle.mqueue, &message, (bool)(flags & FLAG_NONBLOCK), (bool)(flags & FLAG_PRIORITIZE_TIMEOUT), timeout);
+    if (mqueue_handle.type != HANDLE_TYPE_MESSAGE_QUEUE) {
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+        goto put_mqueue;
+    }
+    err = mqueue_receive_user(mqueue_handle.mqueue, tag_ptr, message_i_ptr, (bool)(flags & FLAG_NONBLOCK), (bool)(flags & FLAG_PRIORITIZE_TIMEOUT), timeout);
+put_mqueue:
+    handle_put(&cpu_local->current_process->group->handles, mqueue_i, mqueue_handle);
+    return err;
+}
+
+// Receive multiple messages from a queue with a single syscall
+// Blocks until at least one message arrives, and then returns up to `n` messages that are in the queue.
+// The length of the arrays `tags` and `message_is` is read from `length_ptr`, and can be at most MESSAGE_BATCH_MAX.
+// The tags and message handles are written to the arrays, and the number of messages received to `length_ptr`.
+// The timeout and flags are the same as in mqueue_receive().
+// A message carrying an error code is received alone, like in mqueue_receive(): its tag is written to `tags`
+// and the error is returned with no messages received. Messages after it stay in the queue.
+err_t syscall_mqueue_receive_batch(handle_t mqueue_i, MessageTag *tags, handle_t *message_is, size_t *length_ptr, i64 timeout, u64 flags) {
+    err_t err;
+    Handle mqueue_handle;
+    // Verify flags are valid
+    if (flags & ~(FLAG_NONBLOCK | FLAG_PRIORITIZE_TIMEOUT))
+        return ERR_KERNEL_INVALID_ARG;
+    // Get the length of the arrays
+    err = verify_user_buffer(length_ptr, sizeof(size_t), true);
     if (err)
         return err;
-    // Return the tag
-    if (tag_ptr != NULL)
-        *tag_ptr = message->tag;
-    // Return error code if the message has one
-    if (message->error_code)
-        return message->error_code;
-    // Add the handle
-    err = handles_reserve(&cpu_local->current_process->handles, 1);
+    size_t n = *length_ptr;
+    if (n == 0 || n > MESSAGE_BATCH_MAX)
+        return ERR_KERNEL_INVALID_ARG;
+    *length_ptr = 0;
+    // Verify buffers are valid
+    if (tags != NULL) {
+        err = verify_user_buffer(tags, n * sizeof(MessageTag), true);
+        if (err)
+            return err;
+    }
+    err = verify_user_buffer(message_is, n * sizeof(handle_t), true);
     if (err)
         return err;
-    handle_add(&cpu_local->current_process->handles, (Handle){HANDLE_TYPE_MESSAGE, {.message = message}}, message_i_ptr);
-    return 0;
+    // Get the queue from handle
+    err = handle_get(&cpu_local->current_process->group->handles, mqueue_i, &mqueue_handle);
+    if (err)
+        return err;
+    if (mqueue_handle.type != HANDLE_TYPE_MESSAGE_QUEUE) {
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+        goto put_mqueue;
+    }
+    // Reserve the handles before receiving, so that received messages aren't lost if the handle list can't be extended
+    err = handles_reserve(&cpu_local->current_process->group->handles, n);
+    if (err)
+        goto put_mqueue;
+    // Receive the messages
+    Message *messages[MESSAGE_BATCH_MAX];
+    size_t received;
+    err = mqueue_receive_batch(mqueue_handle.mqueue, messages, n, &received, (bool)(flags & FLAG_NONBLOCK), (bool)(flags & FLAG_PRIORITIZE_TIMEOUT), timeout);
+    handle_put(&cpu_local->current_process->group->handles, mqueue_i, mqueue_handle);
+    if (err)
+        return err;
+    // Return error code if the message has one
+    // A message carrying an error code is always received alone.
+    if (messages[0]->error_code) {
+        if (tags != NULL)
+            tags[0] = messages[0]->tag;
+        err = messages[0]->error_code;
+        message_free(messages[0]);
+        return err;
+    }
+    // Return the tags and add the handles
+    // Other threads may have used up the reserved handles, in which case the remaining messages are dropped with the error.
+    size_t added = 0;
+    for (; added < received; added++) {
+        if (tags != NULL)
+            tags[added] = messages[added]->tag;
+        err = handle_add(&cpu_local->current_process->group->handles, (Handle){HANDLE_TYPE_MESSAGE, {.message = messages[added]}}, &message_is[added]);
+        if (err)
+            break;
+    }
+    for (size_t i = added; i < received; i++)
+        message_drop(messages[i], err);
+    *length_ptr = added;
+    return err;
+put_mqueue:
+    handle_put(&cpu_local->current_process->group->handles, mqueue_i, mqueue_handle);
+    return err;
+}
+
+// Reply to a message with a reply given by the user
+// The blocked sender is handled the same way as in message_reply_().
+// Assumes the reply buffer was already verified.
+static err_t message_reply_user(handle_t message_i, Message *message, const SendMessage *user_reply, u64 flags, Process **sender_ptr) {
+    err_t err;
+    // Create a reply
+    Message *reply;
+    if (message->async_reply)
+        err = message_alloc_user(user_reply, &reply, message->reply_template, (bool)(flags & FLAG_MOVE_PAGES));
+    else
+        err = message_alloc_user(user_reply, &reply, NULL, (bool)(flags & FLAG_MOVE_PAGES));
+    if (!err)
+        // Send the reply
+        err = message_reply_(message, reply, sender_ptr);
+    if ((flags & FLAG_REPLY_ON_FAILURE) && err == ERR_KERNEL_NO_MEMORY)
+        // Send reply error code if there was a failure
+        message_reply_error_(message, ERR_NO_MEMORY, sender_ptr);
+    // Free message and handle if requested
+    if (flags & FLAG_FREE_MESSAGE)
+        handle_clear(&cpu_local->current_process->group->handles, message_i, true);
+    return err;
 }
 
 // Reply to a message
 // If FLAG_REPLY_ON_FAILURE is set, out-of-memory errors will cause an error reply of ERR_NO_MEMORY to be sent.
+// If FLAG_MOVE_PAGES is set, the data of large replies is transferred by moving whole pages where possible.
 err_t syscall_message_reply(handle_t message_i, const SendMessage *user_reply, u64 flags) {
     err_t err;
     Handle message_handle;
     // Verify flags are valid
-    if (flags & ~(FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE))
+    if (flags & ~(FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE | FLAG_MOVE_PAGES))
         return ERR_KERNEL_INVALID_ARG;
     // Verify buffer is valid
     err = verify_user_send_message(user_reply);
     if (err)
         return err;
     // Get the message from handle
-    err = handle_get(&cpu_local->current_process->handles, message_i, &message_handle);
+    err = handle_get(&cpu_local->current_process->group->handles, message_i, &message_handle);
     if (err)
         return err;
-    if (message_handle.type != HANDLE_TYPE_MESSAGE)
+    if (message_handle.type != HANDLE_TYPE_MESSAGE) {
+        handle_put(&cpu_local->current_process->group->handles, message_i, message_handle);
         return ERR_KERNEL_WRONG_HANDLE_TYPE;
-    // Create a reply
-    Message *reply;
-    if (message_handle.message->async_reply)
-        err = message_alloc_user(user_reply, &reply, message_handle.message->reply_template);
-    else
-        err = message_alloc_user(user_reply, &reply, NULL);
+    }
+    // Send the reply
+    Process *sender = NULL;
+    err = message_reply_user(message_i, message_handle.message, user_reply, flags, &sender);
+    handle_put(&cpu_local->current_process->group->handles, message_i, message_handle);
+    // Switch directly to the sender if it was waiting for the reply
+    if (sender != NULL)
+        process_enqueue_handoff(sender);
+    return err;
+}
+
+// Reply to a message and wait for a message on a queue
+// Functions like message_reply() followed by mqueue_receive() with no timeout, but takes a single syscall.
+// The flags apply to the reply. If the reply fails, no message is received.
+err_t syscall_message_reply_receive(handle_t message_i, const SendMessage *user_reply, handle_t mqueue_i, MessageTag *tag_ptr, handle_t *message_i_ptr, u64 flags) {
+    err_t err;
+    Handle message_handle;
+    Handle mqueue_handle;
+    // Verify flags are valid
+    if (flags & ~(FLAG_FREE_MESSAGE | FLAG_REPLY_ON_FAILURE | FLAG_MOVE_PAGES))
+        return ERR_KERNEL_INVALID_ARG;
+    // Verify buffers are valid
+    err = verify_user_send_message(user_reply);
+    if (err)
+        return err;
+    if (tag_ptr != NULL) {
+        err = verify_user_buffer(tag_ptr, sizeof(MessageTag), true);
+        if (err)
+            return err;
+    }
+    err = verify_user_buffer(message_i_ptr, sizeof(handle_t), true);
+    if (err)
+        return err;
+    // Get the message and queue from handles
+    // Both are checked before replying so that the reply isn't sent if the queue handle is invalid.
+    err = handle_get(&cpu_local->current_process->group->handles, message_i, &message_handle);
+    if (err)
+        return err;
+    if (message_handle.type != HANDLE_TYPE_MESSAGE) {
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+        goto put_message;
+    }
+    err = handle_get(&cpu_local->current_process->group->handles, mqueue_i, &mqueue_handle);
+    if (err)
+        goto put_message;
+    if (mqueue_handle.type != HANDLE_TYPE_MESSAGE_QUEUE) {
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+        goto put_mqueue;
+    }
+    // Send the reply
+    Process *sender = NULL;
+    err = message_reply_user(message_i, message_handle.message, user_reply, flags, &sender);
+    handle_put(&cpu_local->current_process->group->handles, message_i, message_handle);
+    // Switch directly to the sender if it was waiting for the reply
+    // The current process continues once the sender blocks, which is often by sending another message to this queue.
+    if (sender != NULL)
+        process_enqueue_handoff(sender);
+    // Receive the next message
     if (!err)
-        // Send the reply
-        err = message_reply(message_handle.message, reply);
-    if ((flags & FLAG_REPLY_ON_FAILURE) && err == ERR_KERNEL_NO_MEMORY)
-        // Send reply error code if there was a failure
-        message_reply_error(message_handle.message, ERR_NO_MEMORY);
-    // Free message and handle if requested
-    if (flags & FLAG_FREE_MESSAGE)
-        handle_clear(&cpu_local->current_process->handles, message_i, true);
+        err = mqueue_receive_user(mqueue_handle.mqueue, tag_ptr, message_i_ptr, false, false, TIMEOUT_NONE);
+    handle_put(&cpu_local->current_process->group->handles, mqueue_i, mqueue_handle);
+    return err;
+put_mqueue:
+    handle_put(&cpu_local->current_process->group->handles, mqueue_i, mqueue_handle);
+put_message:
+    handle_put(&cpu_local->current_process->group->handles, message_i, message_handle);
     return err;
 }
 
@@ -908,16 +1550,23 @@ err_t syscall_message_reply_error(handle_t message_i, err_t error, u64 flags) {
     if (error >= ERR_KERNEL_MIN || error == 0)
         return ERR_KERNEL_INVALID_ARG;
     // Get the message from handle
-    err = handle_get(&cpu_local->current_process->handles, message_i, &message_handle);
+    err = handle_get(&cpu_local->current_process->group->handles, message_i, &message_handle);
     if (err)
         return err;
-    if (message_handle.type != HANDLE_TYPE_MESSAGE)
+    if (message_handle.type != HANDLE_TYPE_MESSAGE) {
+        handle_put(&cpu_local->current_process->group->handles, message_i, message_handle);
         return ERR_KERNEL_WRONG_HANDLE_TYPE;
+    }
     // Send the error
-    err = message_reply_error(message_handle.message, error);
+    Process *sender = NULL;
+    err = message_reply_error_(message_handle.message, error, &sender);
     // Free message and handle if requested
     if (flags & FLAG_FREE_MESSAGE)
-        handle_clear(&cpu_local->current_process->handles, message_i, true);
+        handle_clear(&cpu_local->current_process->group->handles, message_i, true);
+    handle_put(&cpu_local->current_process->group->handles, message_i, message_handle);
+    // Switch directly to the sender if it was waiting for the reply
+    if (sender != NULL)
+        process_enqueue_handoff(sender);
     return err;
 }
 
@@ -939,19 +1588,24 @@ err_t syscall_channel_call_read(handle_t channel_i, const SendMessage *user_mess
             return err;
     }
     // Get the channel from handle
-    err = handle_get(&cpu_local->current_process->handles, channel_i, &channel_handle);
+    err = handle_get(&cpu_local->current_process->group->handles, channel_i, &channel_handle);
     if (err)
         return err;
-    if (channel_handle.type != HANDLE_TYPE_CHANNEL_SEND)
+    if (channel_handle.type != HANDLE_TYPE_CHANNEL_SEND) {
+        handle_put(&cpu_local->current_process->group->handles, channel_i, channel_handle);
         return ERR_KERNEL_WRONG_HANDLE_TYPE;
+    }
     // Create a message
     Message *message;
-    err = message_alloc_user(user_message, &message, NULL);
-    if (err)
+    err = message_alloc_user(user_message, &message, NULL, false);
+    if (err) {
+        handle_put(&cpu_local->current_process->group->handles, channel_i, channel_handle);
         return err;
+    }
     // Send the message
     Message *reply;
     err = channel_call(channel_handle.channel, message, &reply);
+    handle_put(&cpu_local->current_process->group->handles, channel_i, channel_handle);
     if (err)
         return err;
     // Perform bounds check on the reply
@@ -974,7 +1628,7 @@ err_t syscall_channel_call_read(handle_t channel_i, const SendMessage *user_mess
         return ERR_KERNEL_MESSAGE_HANDLES_TOO_LONG;
     }
     // Copy the message data
-    err = message_read_user(reply, user_reply, &(MessageLength){0, 0}, true);
+    err = message_read_user(reply, user_reply, &(MessageLength){0, 0}, true, true);
     message_free(reply);
     if (err)
         return err;
@@ -982,18 +1636,22 @@ err_t syscall_channel_call_read(handle_t channel_i, const SendMessage *user_mess
 }
 
 // Create a new message queue
-err_t syscall_mqueue_create(handle_t *handle_i_ptr) {
+// Senders block once the queue holds `max_length` messages or `max_data_size` bytes of message data.
+// The limits can't exceed MQUEUE_MAX_LENGTH and MQUEUE_MAX_DATA_SIZE.
+err_t syscall_mqueue_create(handle_t *handle_i_ptr, size_t max_length, size_t max_data_size) {
     err_t err;
+    if (max_length == 0 || max_length > MQUEUE_MAX_LENGTH || max_data_size > MQUEUE_MAX_DATA_SIZE)
+        return ERR_KERNEL_INVALID_ARG;
     // Verify buffer is valid
     err = verify_user_buffer(handle_i_ptr, sizeof(handle_t), true);
     if (err)
         return err;
     // Allocate the message queue
-    MessageQueue *mqueue = mqueue_alloc();
+    MessageQueue *mqueue = mqueue_alloc(max_length, max_data_size);
     if (mqueue == NULL)
         return ERR_KERNEL_NO_MEMORY;
     // Add the handle
-    err = handle_add(&cpu_local->current_process->handles, (Handle){HANDLE_TYPE_MESSAGE_QUEUE, {.mqueue = mqueue}}, handle_i_ptr);
+    err = handle_add(&cpu_local->current_process->group->handles, (Handle){HANDLE_TYPE_MESSAGE_QUEUE, {.mqueue = mqueue}}, handle_i_ptr);
     if (err) {
         mqueue_del_ref(mqueue);
         return err;
@@ -1006,25 +1664,29 @@ err_t syscall_mqueue_add_channel(handle_t mqueue_i, handle_t channel_i, MessageT
     // Get the handles
     Handle mqueue_handle;
     Handle channel_handle;
-    err = handle_get(&cpu_local->current_process->handles, mqueue_i, &mqueue_handle);
+    err = handle_get(&cpu_local->current_process->group->handles, mqueue_i, &mqueue_handle);
     if (err)
         return err;
-    err = handle_get(&cpu_local->current_process->handles, channel_i, &channel_handle);
+    err = handle_get(&cpu_local->current_process->group->handles, channel_i, &channel_handle);
     if (err)
-        return err;
+        goto put_mqueue;
     // Check handle types
-    if (mqueue_handle.type != HANDLE_TYPE_MESSAGE_QUEUE)
-        return ERR_KERNEL_WRONG_HANDLE_TYPE;
-    if (channel_handle.type != HANDLE_TYPE_CHANNEL_RECEIVE)
-        return ERR_KERNEL_WRONG_HANDLE_TYPE;
+    if (mqueue_handle.type != HANDLE_TYPE_MESSAGE_QUEUE || channel_handle.type != HANDLE_TYPE_CHANNEL_RECEIVE) {
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+        goto put_channel;
+    }
     // Add the channel to the message queue
     err = channel_set_mqueue(channel_handle.channel, mqueue_handle.mqueue, tag);
     if (err)
-        return err;
-    // Remove the channel handle
-    channel_del_ref(channel_handle.channel);
-    handle_clear(&cpu_local->current_process->handles, channel_i, false);
-    return 0;
+        goto put_channel;
+    // Remove the channel handle, dropping the reference it held
+    if (handle_take(&cpu_local->current_process->group->handles, channel_i, channel_handle.channel))
+        channel_del_ref(channel_handle.channel);
+put_channel:
+    handle_put(&cpu_local->current_process->group->handles, channel_i, channel_handle);
+put_mqueue:
+    handle_put(&cpu_local->current_process->group->handles, mqueue_i, mqueue_handle);
+    return err;
 }
 
 err_t syscall_channel_create(handle_t *channel_send_i_ptr, handle_t *channel_receive_i_ptr) {
@@ -1043,20 +1705,28 @@ err_t syscall_channel_create(handle_t *channel_send_i_ptr, handle_t *channel_rec
     // Increment refcount since two references are created
     channel_add_ref(channel);
     // Add the handles
-    err = handles_reserve(&cpu_local->current_process->handles, 2);
+    // If the second handle can't be added, the first one is removed again, unless another thread already freed it.
+    HandleList *handle_list = &cpu_local->current_process->group->handles;
+    err = handle_add(handle_list, (Handle){HANDLE_TYPE_CHANNEL_SEND, {.channel = channel}}, channel_send_i_ptr);
+    if (err) {
+        channel_del_ref(channel);
+        channel_del_ref(channel);
+        return err;
+    }
+    err = handle_add(handle_list, (Handle){HANDLE_TYPE_CHANNEL_RECEIVE, {.channel = channel}}, channel_receive_i_ptr);
     if (err) {
+        if (handle_take(handle_list, *channel_send_i_ptr, channel))
+            channel_del_ref(channel);
         channel_del_ref(channel);
         return err;
     }
-    handle_add(&cpu_local->current_process->handles, (Handle){HANDLE_TYPE_CHANNEL_SEND, {.channel = channel}}, channel_send_i_ptr);
-    handle_add(&cpu_local->current_process->handles, (Handle){HANDLE_TYPE_CHANNEL_RECEIVE, {.channel = channel}}, channel_receive_i_ptr);
     return 0;
 }
 
 err_t syscall_channel_call_async(handle_t channel_i, const SendMessage *user_message, handle_t mqueue_i, MessageTag tag, u64 flags) {
     err_t err;
     // Verify flags are valid
-    if (flags & ~FLAG_NONBLOCK)
+    if (flags & ~(FLAG_NONBLOCK | FLAG_MOVE_PAGES))
         return ERR_KERNEL_INVALID_ARG;
     // Verify buffers are valid
     err = verify_user_send_message(user_message);
@@ -1065,25 +1735,27 @@ err_t syscall_channel_call_async(handle_t channel_i, const SendMessage *user_mes
     // Get the handles
     Handle channel_handle;
     Handle mqueue_handle;
-    err = handle_get(&cpu_local->current_process->handles, channel_i, &channel_handle);
+    err = handle_get(&cpu_local->current_process->group->handles, channel_i, &channel_handle);
     if (err)
         return err;
-    err = handle_get(&cpu_local->current_process->handles, mqueue_i, &mqueue_handle);
+    err = handle_get(&cpu_local->current_process->group->handles, mqueue_i, &mqueue_handle);
     if (err)
-        return err;
+        goto put_channel;
     // Check handle types
-    if (channel_handle.type != HANDLE_TYPE_CHANNEL_SEND)
-        return ERR_KERNEL_WRONG_HANDLE_TYPE;
-    if (mqueue_handle.type != HANDLE_TYPE_MESSAGE_QUEUE)
-        return ERR_KERNEL_WRONG_HANDLE_TYPE;
+    if (channel_handle.type != HANDLE_TYPE_CHANNEL_SEND || mqueue_handle.type != HANDLE_TYPE_MESSAGE_QUEUE) {
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+        goto put_mqueue;
+    }
     // Create a message
     Message *message;
-    err = message_alloc_user(user_message, &message, NULL);
+    err = message_alloc_user(user_message, &message, NULL, (bool)(flags & FLAG_MOVE_PAGES));
     if (err)
-        return err;
+        goto put_mqueue;
     // Send the message
     err = channel_call_async(channel_handle.channel, message, mqueue_handle.mqueue, tag, (bool)(flags & FLAG_NONBLOCK));
-    if (err)
-        return err;
-    return 0;
+put_mqueue:
+    handle_put(&cpu_local->current_process->group->handles, mqueue_i, mqueue_handle);
+put_channel:
+    handle_put(&cpu_local->current_process->group->handles, channel_i, channel_handle);
+    return err;
 }
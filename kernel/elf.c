@@ -1,7 +1,11 @@
 #include "types.h"
 #include "elf.h"
 
+#include "alloc.h"
 #include "page.h"
+#include "percpu.h"
+#include "process.h"
+#include "spinlock.h"
 #include "string.h"
 
 #define ELF_CLASS_64_BIT 2
@@ -54,11 +58,55 @@ typedef struct ELFProgramHeader {
     u64 alignment;
 } ELFProgramHeader;
 
-// Loads an ELF file stored in a buffer into memory.
-// On success `*entry` is set to the entry point.
-err_t load_elf_file(const u8 *file, size_t file_length, u64 *entry) {
-    err_t err;
-    // Verify the ELF header
+// A memory image of a loadable segment of an ELF file
+// The pages contain the segment data and are zero-filled outside of it.
+typedef struct ELFImageSegment {
+    u64 start;
+    size_t pages_num;
+    bool write;
+    bool execute;
+    u64 *pages;
+} ELFImageSegment;
+
+// A memory image of an ELF file, shared by all processes loaded from the same file
+// Read-only segments are mapped into processes as shared pages and writable segments as copy-on-write pages.
+// Each process loaded from the image holds a reference to it, and the image is freed once the last one exits.
+struct ELFImage {
+    struct ELFImage *next;
+    size_t refcount;
+    u64 hash;
+    size_t file_length;
+    u64 entry;
+    size_t segments_num;
+    ELFImageSegment segments[];
+};
+
+// Cache of the ELF images used by running processes
+// The lock protects the list and the reference counts. The images themselves don't change once they're in the cache.
+static spinlock_t elf_cache_lock;
+static ELFImage *elf_cache = NULL;
+
+#define HASH_OFFSET_BASIS UINT64_C(0xCBF29CE484222325)
+#define HASH_PRIME UINT64_C(0x00000100000001B3)
+
+// Calculate the hash of a file used to look it up in the cache
+// This is a variant of FNV-1a processing eight bytes at a time. Since it's not collision resistant,
+// a matching hash is only used to find a candidate image, which is then compared with the file.
+static u64 elf_hash(const u8 *file, size_t file_length) {
+    u64 hash = HASH_OFFSET_BASIS;
+    size_t i = 0;
+    for (; i + sizeof(u64) <= file_length; i += sizeof(u64)) {
+        u64 word;
+        memcpy(&word, file + i, sizeof(u64));
+        hash = (hash ^ word) * HASH_PRIME;
+    }
+    for (; i < file_length; i++)
+        hash = (hash ^ file[i]) * HASH_PRIME;
+    return hash;
+}
+
+// Verify the ELF header and all loadable program headers of a file
+static err_t elf_verify(const u8 *file, size_t file_length) {
     if (sizeof(ELFHeader) > file_length)
         return ERR_KERNEL_INVALID_ARG;
     ELFHeader *header = (ELFHeader *)file;
@@ -84,11 +132,9 @@ err_t load_elf_file(const u8 *file, size_t file_length, u64 *entry) {
         return ERR_KERNEL_INVALID_ARG;
     if (header->pht_offset + header->pht_entry_size * header->pht_entries_num > file_length)
         return ERR_KERNEL_INVALID_ARG;
-    // Load the program segments into memory
     for (u16 i = 0; i < header->pht_entries_num; i++) {
         ELFProgramHeader *program_header = (ELFProgramHeader *)(file + header->pht_offset + header->pht_entry_size * i);
         if (program_header->type == ELF_PT_TYPE_LOAD) {
-            // Verify the program header
             if (program_header->offset + program_header->file_size < program_header->offset)
                 return ERR_KERNEL_INVALID_ARG;
             if (program_header->offset + program_header->file_size > file_length)
@@ -99,28 +145,245 @@ err_t load_elf_file(const u8 *file, size_t file_length, u64 *entry) {
                 return ERR_KERNEL_INVALID_ARG;
             if (program_header->vaddr + program_header->memory_size > USER_ADDR_UPPER_BOUND)
                 return ERR_KERNEL_INVALID_ARG;
-            // Calculate the first and last page to map
-            u64 start_page = program_header->vaddr / PAGE_SIZE * PAGE_SIZE;
-            u64 end_page = (program_header->vaddr + program_header->memory_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
-            // Map the memory range
-            err = map_user_pages(
-                start_page,
-                end_page - start_page,
-                (program_header->flags & ELF_PT_FLAGS_W) != 0,
-                (program_header->flags & ELF_PT_FLAGS_X) != 0
-            );
-            if (err)
-                return err;
-            // Copy segment data from file to memory
-            memcpy((void *)program_header->vaddr, file + program_header->offset, program_header->file_size);
-            // Fill in the memory that's mapped but not copied to with zeroes
-            // This includes both memory that's not filled due to segments not being page-aligned,
-            // as well as memory that's specified as zeroed by the ELF file (in the difference between memory_size and file_size).
-            u64 loaded_end_byte = program_header->vaddr + program_header->file_size;
-            memset((void *)start_page, 0, program_header->vaddr - start_page);
-            memset((void *)loaded_end_byte, 0, end_page - loaded_end_byte);
         }
     }
-    *entry = header->entry;
+    return 0;
+}
+
+// Get the range of a page starting at `page_addr` that's filled with data from the file, relative to the start of the page
+// If the range is empty, `*data_start` is equal to `*data_end`.
+static void segment_page_data_range(const ELFProgramHeader *program_header, u64 page_addr, u64 *data_start, u64 *data_end) {
+    u64 start = program_header->vaddr > page_addr ? program_header->vaddr : page_addr;
+    u64 end = program_header->vaddr + program_header->file_size < page_addr + PAGE_SIZE ? program_header->vaddr + program_header->file_size : page_addr + PAGE_SIZE;
+    if (start >= end)
+        start = end = page_addr;
+    *data_start = start - page_addr;
+    *data_end = end - page_addr;
+}
+
+// Fill the page of a segment image starting at `page_addr`
+static void segment_page_load(u8 *page, const u8 *file, const ELFProgramHeader *program_header, u64 page_addr) {
+    u64 data_start, data_end;
+    segment_page_data_range(program_header, page_addr, &data_start, &data_end);
+    memset(page, 0, data_start);
+    memcpy(page + data_start, file + program_header->offset + (page_addr + data_start - program_header->vaddr), data_end - data_start);
+    memset(page + data_end, 0, PAGE_SIZE - data_end);
+}
+
+// Check if the page of a segment image starting at `page_addr` has the contents it would have if it was loaded from the file
+static bool segment_page_matches(const u8 *page, const u8 *file, const ELFProgramHeader *program_header, u64 page_addr) {
+    u64 data_start, data_end;
+    segment_page_data_range(program_header, page_addr, &data_start, &data_end);
+    for (u64 i = 0; i < data_start; i++)
+        if (page[i] != 0)
+            return false;
+    if (memcmp(page + data_start, file + program_header->offset + (page_addr + data_start - program_header->vaddr), data_end - data_start) != 0)
+        return false;
+    for (u64 i = data_end; i < PAGE_SIZE; i++)
+        if (page[i] != 0)
+            return false;
+    return true;
+}
+
+// Get the segment image parameters described by a program header
+static ELFImageSegment segment_from_program_header(const ELFProgramHeader *program_header) {
+    u64 start_page = program_header->vaddr / PAGE_SIZE * PAGE_SIZE;
+    u64 end_page = (program_header->vaddr + program_header->memory_size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    return (ELFImageSegment){
+        .start = start_page,
+        .pages_num = (end_page - start_page) / PAGE_SIZE,
+        .write = (program_header->flags & ELF_PT_FLAGS_W) != 0,
+        .execute = (program_header->flags & ELF_PT_FLAGS_X) != 0,
+        .pages = NULL,
+    };
+}
+
+// Count the loadable segments of a file
+// Assumes the file was already verified.
+static size_t elf_count_segments(const u8 *file) {
+    ELFHeader *header = (ELFHeader *)file;
+    size_t segments_num = 0;
+    for (u16 i = 0; i < header->pht_entries_num; i++) {
+        ELFProgramHeader *program_header = (ELFProgramHeader *)(file + header->pht_offset + header->pht_entry_size * i);
+        if (program_header->type == ELF_PT_TYPE_LOAD)
+            segments_num++;
+    }
+    return segments_num;
+}
+
+// Free an image that's not in the cache
+static void elf_image_free(ELFImage *image) {
+    for (size_t i = 0; i < image->segments_num; i++) {
+        page_free_n(image->segments[i].pages, image->segments[i].pages_num);
+        free(image->segments[i].pages);
+    }
+    free(image);
+}
+
+// Create an image of a file
+// Assumes the file was already verified.
+// Returns NULL on failure.
+static ELFImage *elf_image_create(const u8 *file, size_t file_length, u64 hash) {
+    err_t err;
+    ELFHeader *header = (ELFHeader *)file;
+    size_t segments_num = elf_count_segments(file);
+    ELFImage *image = malloc(sizeof(ELFImage) + segments_num * sizeof(ELFImageSegment));
+    if (image == NULL)
+        return NULL;
+    *image = (ELFImage){
+        .next = NULL,
+        .refcount = 1,
+        .hash = hash,
+        .file_length = file_length,
+        .entry = header->entry,
+        .segments_num = 0,
+    };
+    for (u16 i = 0; i < header->pht_entries_num; i++) {
+        ELFProgramHeader *program_header = (ELFProgramHeader *)(file + header->pht_offset + header->pht_entry_size * i);
+        if (program_header->type != ELF_PT_TYPE_LOAD)
+            continue;
+        ELFImageSegment segment = segment_from_program_header(program_header);
+        segment.pages = malloc(segment.pages_num * sizeof(u64));
+        if (segment.pages == NULL && segment.pages_num != 0)
+            goto fail;
+        err = page_alloc_n(segment.pages, segment.pages_num);
+        if (err) {
+            free(segment.pages);
+            goto fail;
+        }
+        for (size_t j = 0; j < segment.pages_num; j++)
+            segment_page_load(PHYS_ADDR(segment.pages[j]), file, program_header, segment.start + j * PAGE_SIZE);
+        image->segments[image->segments_num++] = segment;
+    }
+    return image;
+fail:
+    elf_image_free(image);
+    return NULL;
+}
+
+// Check if an image could have been created from the given file without comparing its pages
+// Assumes the file was already verified.
+static bool elf_image_is_candidate(const ELFImage *image, const u8 *file, size_t file_length, u64 hash) {
+    ELFHeader *header = (ELFHeader *)file;
+    return image->hash == hash && image->file_length == file_length && image->entry == header->entry;
+}
+
+// Check if a candidate image was created from the given file by comparing its pages
+// Assumes the file was already verified.
+static bool elf_image_matches(const ELFImage *image, const u8 *file) {
+    ELFHeader *header = (ELFHeader *)file;
+    if (image->segments_num != elf_count_segments(file))
+        return false;
+    size_t segment_i = 0;
+    for (u16 i = 0; i < header->pht_entries_num; i++) {
+        ELFProgramHeader *program_header = (ELFProgramHeader *)(file + header->pht_offset + header->pht_entry_size * i);
+        if (program_header->type != ELF_PT_TYPE_LOAD)
+            continue;
+        const ELFImageSegment *segment = &image->segments[segment_i++];
+        ELFImageSegment expected = segment_from_program_header(program_header);
+        if (segment->start != expected.start || segment->pages_num != expected.pages_num
+                || segment->write != expected.write || segment->execute != expected.execute)
+            return false;
+        for (size_t j = 0; j < segment->pages_num; j++)
+            if (!segment_page_matches(PHYS_ADDR(segment->pages[j]), file, program_header, segment->start + j * PAGE_SIZE))
+                return false;
+    }
+    return true;
+}
+
+// Drop a reference to an image, removing it from the cache if it was the last one
+// Must be called with the cache lock held. Returns true if the image is no longer used and should be freed.
+static bool elf_image_del_ref_locked(ELFImage *image) {
+    image->refcount -= 1;
+    if (image->refcount != 0)
+        return false;
+    ELFImage **link = &elf_cache;
+    while (*link != image)
+        link = &(*link)->next;
+    *link = image->next;
+    return true;
+}
+
+// Drop a reference to an image and free it if there are no remaining references
+// Called when a process loaded from the image is freed, after its page map is freed.
+void elf_image_del_ref(ELFImage *image) {
+    spinlock_acquire(&elf_cache_lock);
+    bool unused = elf_image_del_ref_locked(image);
+    spinlock_release(&elf_cache_lock);
+    if (unused)
+        elf_image_free(image);
+}
+
+// Find an image of the given file in the cache and take a reference to it
+// Comparing the pages of a candidate image takes time proportional to the size of the file, so it's done without the cache lock held.
+// The reference taken on the candidate keeps it in the cache meanwhile, so the search can continue from it if it doesn't match.
+// Returns NULL if the file isn't in the cache.
+static ELFImage *elf_cache_find(const u8 *file, size_t file_length, u64 hash) {
+    ELFImage *unused_images = NULL;
+    spinlock_acquire(&elf_cache_lock);
+    ELFImage *image = elf_cache;
+    while (image != NULL) {
+        if (!elf_image_is_candidate(image, file, file_length, hash)) {
+            image = image->next;
+            continue;
+        }
+        image->refcount += 1;
+        spinlock_release(&elf_cache_lock);
+        if (elf_image_matches(image, file))
+            break;
+        spinlock_acquire(&elf_cache_lock);
+        ELFImage *next = image->next;
+        // If the image was freed by all processes in the meantime, it's freed once the lock is released
+        if (elf_image_del_ref_locked(image)) {
+            image->next = unused_images;
+            unused_images = image;
+        }
+        image = next;
+    }
+    if (image == NULL)
+        spinlock_release(&elf_cache_lock);
+    while (unused_images != NULL) {
+        ELFImage *next = unused_images->next;
+        elf_image_free(unused_images);
+        unused_images = next;
+    }
+    return image;
+}
+
+// Loads an ELF file stored in a buffer into memory.
+// The file is loaded into the cache if it's not there yet, and its cached image is mapped into the current process.
+// On success `*entry` is set to the entry point.
+err_t load_elf_file(const u8 *file, size_t file_length, u64 *entry) {
+    err_t err;
+    err = elf_verify(file, file_length);
+    if (err)
+        return err;
+    // Find the image in the cache, creating it if it's not there
+    // If another process adds the same file to the cache while the image is being created, both images are kept,
+    // and each is freed once the processes using it exit.
+    u64 hash = elf_hash(file, file_length);
+    ELFImage *image = elf_cache_find(file, file_length, hash);
+    if (image == NULL) {
+        image = elf_image_create(file, file_length, hash);
+        if (image == NULL)
+            return ERR_KERNEL_NO_MEMORY;
+        spinlock_acquire(&elf_cache_lock);
+        image->next = elf_cache;
+        elf_cache = image;
+        spinlock_release(&elf_cache_lock);
+    }
+    // The process keeps its reference to the image until its page map is freed, even if mapping the segments fails
+    cpu_local->current_process->group->elf_image = image;
+    // Map the image segments
+    for (size_t i = 0; i < image->segments_num; i++) {
+        ELFImageSegment *segment = &image->segments[i];
+        if (segment->write)
+            err = map_user_cow_pages(segment->start, segment->pages_num, segment->pages, segment->execute);
+        else
+            err = map_user_shared_pages(segment->start, segment->pages_num, segment->pages, false, segment->execute);
+        if (err)
+            return err;
+    }
+    *entry = image->entry;
     return 0;
 }
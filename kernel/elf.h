@@ -3,4 +3,7 @@
 #include "types.h"
 #include "error.h"
 
+typedef struct ELFImage ELFImage;
+
+void elf_image_del_ref(ELFImage *image);
 err_t load_elf_file(const u8 *file, size_t file_length, u64 *entry);
@@ -251,6 +251,11 @@ _Noreturn void framebuffer_kernel_thread_main(void) {
             message_free(reply);
             continue;
         }
+        // The reply data may have been transferred by moving pages
+        if (message_linearize(reply)) {
+            message_free(reply);
+            continue;
+        }
         // Display the contents of the reply
         // Use fast copy if it's available
         framebuffer_lock();
@@ -0,0 +1,168 @@
+#include "types.h"
+#include "futex.h"
+
+#include "page.h"
+#include "percpu.h"
+#include "process.h"
+#include "spinlock.h"
+#include "time.h"
+
+// Number of buckets in the futex wait table - must be a power of two
+#define FUTEX_BUCKETS_NUM 64
+
+// A thread blocked waiting on a futex
+// It's allocated on the stack of the waiting thread and linked into a bucket of the wait table while the thread waits.
+typedef struct FutexWaiter {
+    // Set to NULL once the waiter is removed from the bucket by a waking thread
+    Process *process;
+    // Key of the futex, as returned by futex_get_key()
+    ThreadGroup *group;
+    u64 addr;
+    // Set if the thread is also in the timeout queue
+    bool waiting_for_timeout;
+    struct FutexWaiter *prev_waiter;
+    struct FutexWaiter *next_waiter;
+} FutexWaiter;
+
+// A list of waiters on futexes whose keys hash to the same bucket, in the order they started waiting
+typedef struct FutexBucket {
+    spinlock_t lock;
+    FutexWaiter *waiters_start;
+    FutexWaiter *waiters_end;
+} FutexBucket;
+
+static FutexBucket futex_buckets[FUTEX_BUCKETS_NUM];
+
+static FutexBucket *futex_bucket(ThreadGroup *group, u64 addr) {
+    u64 key = ((u64)group ^ (addr >> 2)) * UINT64_C(0x9E3779B97F4A7C15);
+    return &futex_buckets[key >> 58 & (FUTEX_BUCKETS_NUM - 1)];
+}
+
+static void futex_waiter_add(FutexBucket *bucket, FutexWaiter *waiter) {
+    waiter->prev_waiter = bucket->waiters_end;
+    waiter->next_waiter = NULL;
+    if (bucket->waiters_end == NULL)
+        bucket->waiters_start = waiter;
+    else
+        bucket->waiters_end->next_waiter = waiter;
+    bucket->waiters_end = waiter;
+}
+
+static void futex_waiter_remove(FutexBucket *bucket, FutexWaiter *waiter) {
+    if (waiter->prev_waiter == NULL)
+        bucket->waiters_start = waiter->next_waiter;
+    else
+        waiter->prev_waiter->next_waiter = waiter->next_waiter;
+    if (waiter->next_waiter == NULL)
+        bucket->waiters_end = waiter->prev_waiter;
+    else
+        waiter->next_waiter->prev_waiter = waiter->prev_waiter;
+}
+
+// Get the key identifying the futex at a given address
+// Futexes located in shared memory objects are identified by their physical address, so that they can be used by multiple processes.
+// In that case the thread group is set to NULL. Other futexes are identified by the thread group and their address.
+static err_t futex_get_key(const u32 *addr, ThreadGroup **group_ptr, u64 *addr_ptr) {
+    err_t err;
+    if ((u64)addr % sizeof(u32) != 0)
+        return ERR_KERNEL_INVALID_ADDRESS;
+    err = verify_user_buffer(addr, sizeof(u32), false);
+    if (err)
+        return err;
+    if (get_user_shared_addr((u64)addr, addr_ptr)) {
+        *group_ptr = NULL;
+    } else {
+        *group_ptr = cpu_local->current_process->group;
+        *addr_ptr = (u64)addr;
+    }
+    return 0;
+}
+
+// Block until woken by futex_wake() if the value at the given address is equal to `expected`
+// The value is read with the bucket lock held, so a wakeup issued after the value was changed can't be missed.
+// Returns ERR_KERNEL_INVALID_OPERATION if the value is different and ERR_KERNEL_TIMEOUT if the timeout passes first.
+err_t syscall_futex_wait(const u32 *addr, u32 expected, i64 timeout) {
+    err_t err;
+    ThreadGroup *group;
+    u64 key_addr;
+    err = futex_get_key(addr, &group, &key_addr);
+    if (err)
+        return err;
+    FutexBucket *bucket = futex_bucket(group, key_addr);
+    spinlock_acquire(&bucket->lock);
+    u32 value;
+    err = copy_from_user(&value, addr, sizeof(u32));
+    if (err)
+        goto fail;
+    if (value != expected) {
+        err = ERR_KERNEL_INVALID_OPERATION;
+        goto fail;
+    }
+    if (timeout == TIMEOUT_NONE) {
+        // The thread that wakes this one also removes it from the bucket
+        FutexWaiter waiter = {cpu_local->current_process, group, key_addr, false, NULL, NULL};
+        futex_waiter_add(bucket, &waiter);
+        process_block(&bucket->lock);
+        return 0;
+    }
+    if (time_get() >= timeout) {
+        err = ERR_KERNEL_TIMEOUT;
+        goto fail;
+    }
+    // Add to timeout queue and wait to be woken at the same time
+    FutexWaiter waiter = {cpu_local->current_process, group, key_addr, true, NULL, NULL};
+    futex_waiter_add(bucket, &waiter);
+    spinlock_acquire(&wait_queue_lock);
+    wait_queue_insert_current_process(timeout);
+    spinlock_release(&bucket->lock);
+    process_block(&wait_queue_lock);
+    // If the thread was unblocked by the timeout, it's still in the bucket
+    spinlock_acquire(&bucket->lock);
+    if (waiter.process != NULL)
+        futex_waiter_remove(bucket, &waiter);
+    spinlock_release(&bucket->lock);
+    if (cpu_local->current_process->timed_out)
+        return ERR_KERNEL_TIMEOUT;
+    return 0;
+fail:
+    spinlock_release(&bucket->lock);
+    return err;
+}
+
+// Wake up to `n` threads waiting on the futex at the given address, in the order they started waiting
+// Threads that were already unblocked by a timeout are skipped and don't count towards `n`.
+err_t syscall_futex_wake(const u32 *addr, size_t n) {
+    err_t err;
+    ThreadGroup *group;
+    u64 key_addr;
+    err = futex_get_key(addr, &group, &key_addr);
+    if (err)
+        return err;
+    FutexBucket *bucket = futex_bucket(group, key_addr);
+    spinlock_acquire(&bucket->lock);
+    FutexWaiter *waiter = bucket->waiters_start;
+    while (waiter != NULL && n > 0) {
+        FutexWaiter *next_waiter = waiter->next_waiter;
+        if (waiter->group == group && waiter->addr == key_addr) {
+            futex_waiter_remove(bucket, waiter);
+            Process *process = waiter->process;
+            waiter->process = NULL;
+            bool unblock;
+            if (waiter->waiting_for_timeout) {
+                spinlock_acquire(&wait_queue_lock);
+                unblock = wait_queue_remove_process(process);
+                spinlock_release(&wait_queue_lock);
+            } else {
+                unblock = true;
+            }
+            if (unblock) {
+                process->timed_out = false;
+                process_enqueue(process);
+                n--;
+            }
+        }
+        waiter = next_waiter;
+    }
+    spinlock_release(&bucket->lock);
+    return 0;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "types.h"
+#include "error.h"
+
+err_t syscall_futex_wait(const u32 *addr, u32 expected, i64 timeout);
+err_t syscall_futex_wake(const u32 *addr, size_t n);
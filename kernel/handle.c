@@ -3,6 +3,8 @@
 
 #include "alloc.h"
 #include "channel.h"
+#include "shm.h"
+#include "spinlock.h"
 #include "string.h"
 
 #define HANDLE_LIST_DEFAULT_LENGTH 8
@@ -28,19 +30,23 @@ static void handle_free(Handle handle) {
         mqueue_close(handle.mqueue);
         mqueue_del_ref(handle.mqueue);
         break;
+    case HANDLE_TYPE_SHARED_MEMORY:
+        shm_del_ref(handle.shm);
+        break;
     }
 }
 
 // Initialize a handle list
 err_t handle_list_init(HandleList *list) {
+    list->lock = SPINLOCK_FREE;
     list->length = HANDLE_LIST_DEFAULT_LENGTH;
     list->free_handles = list->length;
-    list->handles = malloc(list->length * sizeof(Handle));
+    list->handles = malloc(list->length * sizeof(HandleSlot));
     if (list->handles == NULL)
         return ERR_KERNEL_NO_MEMORY;
     for (size_t i = 0; i < list->length - 1; i++)
-        list->handles[i] = (Handle){HANDLE_TYPE_EMPTY, .next_free_handle = i + 1};
-    list->handles[list->length - 1] = (Handle){HANDLE_TYPE_EMPTY, .next_free_handle = NO_NEXT_HANDLE};
+        list->handles[i] = (HandleSlot){{HANDLE_TYPE_EMPTY, .next_free_handle = i + 1}, false, false};
+    list->handles[list->length - 1] = (HandleSlot){{HANDLE_TYPE_EMPTY, .next_free_handle = NO_NEXT_HANDLE}, false, false};
     list->first_free_handle = 0;
     return 0;
 }
@@ -48,30 +54,79 @@ err_t handle_list_init(HandleList *list) {
 // Free a handle list
 void handle_list_free(HandleList *list) {
     for (handle_t i = 0; i < list->length; i++)
-        handle_free(list->handles[i]);
+        handle_free(list->handles[i].handle);
     free(list->handles);
 }
 
+// Return a slot to the list of free handles
+// Must be called with the list lock held.
+static void handle_slot_free(HandleList *list, handle_t i) {
+    list->handles[i] = (HandleSlot){{HANDLE_TYPE_EMPTY, .next_free_handle = list->first_free_handle}, false, false};
+    list->first_free_handle = i;
+    list->free_handles += 1;
+}
+
 // Clear a handle in a list
-// If `free` is set, frees the handle as well.
+// If `free` is set, frees the handle as well. The handle is freed after the lock is released.
+// If the handle is a message handle currently used by a thread, it's instead freed once handle_put() is called on it.
+// Message handles must always be cleared with `free` set.
 void handle_clear(HandleList *list, handle_t i, bool free) {
-    if (i >= list->length)
+    spinlock_acquire(&list->lock);
+    if (i >= list->length || list->handles[i].handle.type == HANDLE_TYPE_EMPTY) {
+        spinlock_release(&list->lock);
+        return;
+    }
+    if (list->handles[i].in_use) {
+        list->handles[i].free_pending = true;
+        spinlock_release(&list->lock);
         return;
+    }
+    Handle handle = list->handles[i].handle;
+    handle_slot_free(list, i);
+    spinlock_release(&list->lock);
     if (free)
-        handle_free(list->handles[i]);
-    list->handles[i] = (Handle){HANDLE_TYPE_EMPTY, .next_free_handle = list->first_free_handle};
-    list->first_free_handle = i;
-    list->free_handles += 1;
+        handle_free(handle);
+}
+
+// Clear a handle without freeing it if it still refers to a given object
+// The reference held by the handle is passed to the caller.
+// Returns false if the handle was cleared or replaced by another thread in the meantime.
+bool handle_take(HandleList *list, handle_t i, const void *object) {
+    spinlock_acquire(&list->lock);
+    const void *current = NULL;
+    if (i < list->length && !list->handles[i].in_use) {
+        switch (list->handles[i].handle.type) {
+        case HANDLE_TYPE_CHANNEL_SEND:
+        case HANDLE_TYPE_CHANNEL_RECEIVE:
+            current = list->handles[i].handle.channel;
+            break;
+        case HANDLE_TYPE_MESSAGE_QUEUE:
+            current = list->handles[i].handle.mqueue;
+            break;
+        case HANDLE_TYPE_SHARED_MEMORY:
+            current = list->handles[i].handle.shm;
+            break;
+        default:
+            break;
+        }
+    }
+    if (current == NULL || current != object) {
+        spinlock_release(&list->lock);
+        return false;
+    }
+    handle_slot_free(list, i);
+    spinlock_release(&list->lock);
+    return true;
 }
 
 // Extend the handle list to length `new_length`
 static err_t handle_list_extend(HandleList *list, size_t new_length) {
-    Handle *new_handles = realloc(list->handles, new_length * sizeof(Handle));
+    HandleSlot *new_handles = realloc(list->handles, new_length * sizeof(HandleSlot));
     if (new_handles == NULL)
         return ERR_KERNEL_NO_MEMORY;
     for (size_t i = list->length; i < new_length - 1; i++)
-        new_handles[i] = (Handle){HANDLE_TYPE_EMPTY, .next_free_handle = i + 1};
-    new_handles[new_length - 1] = (Handle){HANDLE_TYPE_EMPTY, .next_free_handle = list->first_free_handle};
+        new_handles[i] = (HandleSlot){{HANDLE_TYPE_EMPTY, .next_free_handle = i + 1}, false, false};
+    new_handles[new_length - 1] = (HandleSlot){{HANDLE_TYPE_EMPTY, .next_free_handle = list->first_free_handle}, false, false};
     list->first_free_handle = list->length;
     list->free_handles += new_length - list->length;
     list->length = new_length;
@@ -82,68 +137,129 @@ static err_t handle_list_extend(HandleList *list, size_t new_length) {
 // Add a handle to the list in the first empty slot
 err_t handle_add(HandleList *list, Handle handle, handle_t *i_ptr) {
     err_t err;
-    // Search for the first empty slot
-    if (list->first_free_handle != NO_NEXT_HANDLE) {
-        size_t i = list->first_free_handle;
-        list->first_free_handle = list->handles[i].next_free_handle;
-        list->free_handles -= 1;
-        list->handles[i] = handle;
-        *i_ptr = i;
-        return 0;
+    spinlock_acquire(&list->lock);
+    // If there are no empty slots, extend the list
+    if (list->first_free_handle == NO_NEXT_HANDLE) {
+        err = handle_list_extend(list, 2 * list->length);
+        if (err) {
+            spinlock_release(&list->lock);
+            return err;
+        }
     }
-    // If there are none, extend the list
-    err = handle_list_extend(list, 2 * list->length);
-    if (err)
-        return err;
+    // Take the first empty slot
     size_t i = list->first_free_handle;
-    list->first_free_handle = list->handles[i].next_free_handle;
+    list->first_free_handle = list->handles[i].handle.next_free_handle;
     list->free_handles -= 1;
-    list->handles[i] = handle;
+    list->handles[i] = (HandleSlot){handle, false, false};
+    spinlock_release(&list->lock);
     *i_ptr = i;
     return 0;
 }
 
-// Get the contents of a handle
+// Get the contents of a handle and start using it
+// A reference to the object is taken, so that it isn't freed while in use. It must be dropped with handle_put().
+// Messages have no reference count, so a message handle is instead marked as used and can only be used by one thread at a time.
+// Returns ERR_KERNEL_INVALID_HANDLE if the message handle is already used by another thread.
 err_t handle_get(HandleList *list, handle_t i, Handle *handle) {
-    if (i >= list->length)
-        return ERR_KERNEL_INVALID_HANDLE;
-    if (list->handles[i].type == HANDLE_TYPE_EMPTY)
+    spinlock_acquire(&list->lock);
+    if (i >= list->length || list->handles[i].handle.type == HANDLE_TYPE_EMPTY || list->handles[i].in_use) {
+        spinlock_release(&list->lock);
         return ERR_KERNEL_INVALID_HANDLE;
-    *handle = list->handles[i];
+    }
+    switch (list->handles[i].handle.type) {
+    case HANDLE_TYPE_EMPTY:
+        break;
+    case HANDLE_TYPE_MESSAGE:
+        list->handles[i].in_use = true;
+        break;
+    case HANDLE_TYPE_CHANNEL_SEND:
+    case HANDLE_TYPE_CHANNEL_RECEIVE:
+        channel_add_ref(list->handles[i].handle.channel);
+        break;
+    case HANDLE_TYPE_MESSAGE_QUEUE:
+        mqueue_add_ref(list->handles[i].handle.mqueue);
+        break;
+    case HANDLE_TYPE_SHARED_MEMORY:
+        shm_add_ref(list->handles[i].handle.shm);
+        break;
+    }
+    *handle = list->handles[i].handle;
+    spinlock_release(&list->lock);
     return 0;
 }
 
+// Stop using a handle obtained with handle_get()
+// If a message handle was cleared while in use, the message is freed now.
+void handle_put(HandleList *list, handle_t i, Handle handle) {
+    switch (handle.type) {
+    case HANDLE_TYPE_EMPTY:
+        break;
+    case HANDLE_TYPE_MESSAGE: {
+        // The slot can't be reused while it's marked as used, so it still holds the message
+        spinlock_acquire(&list->lock);
+        list->handles[i].in_use = false;
+        if (!list->handles[i].free_pending) {
+            spinlock_release(&list->lock);
+            break;
+        }
+        handle_slot_free(list, i);
+        spinlock_release(&list->lock);
+        handle_free(handle);
+        break;
+    }
+    case HANDLE_TYPE_CHANNEL_SEND:
+    case HANDLE_TYPE_CHANNEL_RECEIVE:
+        channel_del_ref(handle.channel);
+        break;
+    case HANDLE_TYPE_MESSAGE_QUEUE:
+        mqueue_del_ref(handle.mqueue);
+        break;
+    case HANDLE_TYPE_SHARED_MEMORY:
+        shm_del_ref(handle.shm);
+        break;
+    }
+}
+
 // Set the contents of a handle
 err_t handle_set(HandleList *list, handle_t i, Handle handle) {
     err_t err;
+    spinlock_acquire(&list->lock);
     // If the handle is too large, try extend the list so that it fits
     if (i >= list->length) {
         size_t new_length = list->length;
         while (new_length <= i)
             new_length *= 2;
         err = handle_list_extend(list, new_length);
-        if (err)
+        if (err) {
+            spinlock_release(&list->lock);
             return err;
+        }
     }
     // If filling an empty handle, shrink the free handle count
-    if (list->handles[i].type == HANDLE_TYPE_EMPTY)
+    if (list->handles[i].handle.type == HANDLE_TYPE_EMPTY)
         list->free_handles -= 1;
     // Set the handle
-    list->handles[i] = handle;
+    list->handles[i] = (HandleSlot){handle, false, false};
+    spinlock_release(&list->lock);
     return 0;
 }
 
 // Ensure at least n handles can be allocated without errors
+// If other threads of the process add handles in the meantime, handle_add() may still have to extend the list.
 err_t handles_reserve(HandleList *list, size_t n) {
     err_t err;
+    spinlock_acquire(&list->lock);
     // Extend the list to have at least n free slots
     if (n >= list->free_handles) {
         size_t new_length = list->length;
         while (new_length <= list->length + (n - list->free_handles))
             new_length *= 2;
         err = handle_list_extend(list, new_length);
-        if (err)
+        if (err) {
+            spinlock_release(&list->lock);
             return err;
+        }
     }
+    spinlock_release(&list->lock);
     return 0;
 }
@@ -4,6 +4,8 @@
 #include "error.h"
 
 #include "channel.h"
+#include "shm.h"
+#include "spinlock.h"
 
 typedef enum HandleType {
     HANDLE_TYPE_EMPTY,
@@ -11,6 +13,7 @@ typedef enum HandleType {
     HANDLE_TYPE_CHANNEL_SEND,
     HANDLE_TYPE_CHANNEL_RECEIVE,
     HANDLE_TYPE_MESSAGE_QUEUE,
+    HANDLE_TYPE_SHARED_MEMORY,
 } HandleType;
 
 typedef struct Handle {
@@ -20,12 +23,25 @@ typedef struct Handle {
         Message *message;
         Channel *channel;
         MessageQueue *mqueue;
+        SharedMemory *shm;
     };
 } Handle;
 
+typedef struct HandleSlot {
+    Handle handle;
+    // Set while a message handle is being used by a thread
+    bool in_use;
+    // Set if a message handle was cleared while in use, so that it's freed once the thread using it is done
+    bool free_pending;
+} HandleSlot;
+
+// The handle list of a process is shared by all of its threads, so each operation on it holds the lock.
+// Using a handle with handle_get() keeps the object it refers to alive until handle_put() is called,
+// even if another thread frees the handle in the meantime.
 typedef struct HandleList {
+    spinlock_t lock;
     size_t length;
-    Handle *handles;
+    HandleSlot *handles;
     size_t free_handles;
     // The free handles form a linked list - this is the index of its start
     size_t first_free_handle;
@@ -36,5 +52,7 @@ void handle_list_free(HandleList *list);
 void handle_clear(HandleList *list, handle_t i, bool free);
 err_t handle_add(HandleList *list, Handle handle, handle_t *i_ptr);
 err_t handle_get(HandleList *list, handle_t i, Handle *handle);
+void handle_put(HandleList *list, handle_t i, Handle handle);
+bool handle_take(HandleList *list, handle_t i, const void *object);
 err_t handle_set(HandleList *list, handle_t i, Handle handle);
 err_t handles_reserve(HandleList *list, size_t n);
@@ -69,10 +69,15 @@ void send_input_events(void) {
     if (input_event_queue_size == 0)
         return;
     // Send all the events
+    // Consecutive events going to the same channel are sent as a single batch.
     interrupt_disable();
     spinlock_acquire(&input_event_queue_lock);
     size_t old_input_event_queue_size = input_event_queue_size;
     input_event_queue_size = 0;
+    Channel *batch_channel = NULL;
+    Message *batch_messages[INPUT_EVENT_QUEUE_SIZE];
+    size_t batch_length = 0;
+    size_t sent;
     for (size_t i = 0; i < old_input_event_queue_size; i++) {
         Channel *channel = NULL;
         Message *message = NULL;
@@ -96,8 +101,15 @@ void send_input_events(void) {
         }
         if (message == NULL)
             continue;
-        channel_send(channel, message, true);
+        if (channel != batch_channel && batch_length > 0) {
+            channel_send_batch(batch_channel, batch_messages, batch_length, true, &sent);
+            batch_length = 0;
+        }
+        batch_channel = channel;
+        batch_messages[batch_length++] = message;
     }
+    if (batch_length > 0)
+        channel_send_batch(batch_channel, batch_messages, batch_length, true, &sent);
     spinlock_release(&input_event_queue_lock);
     interrupt_enable();
 }
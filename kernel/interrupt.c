@@ -12,11 +12,17 @@
 #define IDT_GATE_PRESENT 0x80
 #define IDT_GATE_INTERRUPT 0x0E
 
+#define INT_DEVICE_NOT_AVAILABLE 0x07
 #define INT_DOUBLE_FAULT 0x08
 #define INT_PAGE_FAULT 0x0E
 
+#define PAGE_FAULT_PRESENT (UINT64_C(1) << 0)
+#define PAGE_FAULT_WRITE (UINT64_C(1) << 1)
+
 extern u64 interrupt_handlers[IDT_ENTRIES_NUM];
 
+extern u64 uaccess_fixup(u64 rip);
+
 static void idt_set_entry(IDTEntry *entry, u64 addr, u8 ist) {
     *entry = (IDTEntry){
         .addr1 = (u16)addr,
@@ -63,17 +69,49 @@ static bool interrupt_pushes_error_code(u8 i) {
 
 // This is a default handler used for exceptions that don't have a specific handler assigned to them.
 // It's called by the wrapper in `interrupt.s`.
+// Device-not-available exceptions are used to restore the FPU state lazily.
+// Page faults on user pages reserved to be allocated on first access or marked as copy-on-write are resolved by the page allocator.
+// Other page faults caused by kernel code accessing user memory resume at the fixup address listed in the exception table.
+// Page faults in kernel code on user memory unmapped by another thread kill the current thread if no locks are held.
 // If the interrupt occurred in kernel code, it prints the exception information and halts.
 void general_exception_handler(u8 interrupt_number, InterruptFrame *interrupt_frame, u64 error_code) {
-    // If the exception occurred in user mode, kill the currently running process
-    if ((interrupt_frame->cs & 3) != 0) {
-        interrupt_enable();
-        process_exit();
+    // The FPU is disabled until the running process uses it, at which point its state is restored
+    if (interrupt_number == INT_DEVICE_NOT_AVAILABLE) {
+        process_fpu_restore();
+        return;
     }
     u64 page_fault_address;
     if (interrupt_number == INT_PAGE_FAULT) {
         // If the interrupt is a page fault, get the page fault address from CR2
         asm ("mov %0, cr2" : "=r"(page_fault_address));
+        // If the fault can be resolved by allocating or copying the page, return to retry the access
+        // Interrupts are enabled while the fault is handled, since the page map lock may be held by another thread
+        // of the same process that is waiting for this CPU to respond to a TLB shootdown.
+        interrupt_enable();
+        bool resolved = handle_user_page_fault(page_fault_address, error_code & PAGE_FAULT_PRESENT, error_code & PAGE_FAULT_WRITE);
+        interrupt_disable();
+        if (resolved)
+            return;
+        if ((interrupt_frame->cs & 3) == 0) {
+            // If the fault occurred while copying user memory, return to the fixup code to report the error
+            u64 fixup = uaccess_fixup(interrupt_frame->rip);
+            if (fixup != 0) {
+                interrupt_frame->rip = fixup;
+                return;
+            }
+            // If kernel code faulted on a user page it has already verified, another thread of the process must have unmapped it.
+            // If the kernel holds no locks at this point, it's safe to kill the current thread.
+            if (page_fault_address < USER_ADDR_UPPER_BOUND && cpu_local->current_process != NULL
+                    && cpu_local->preempt_disable == 0 && cpu_local->interrupt_disable == 1) {
+                interrupt_enable();
+                process_exit();
+            }
+        }
+    }
+    // If the exception occurred in user mode, kill the currently running process
+    if ((interrupt_frame->cs & 3) != 0) {
+        interrupt_enable();
+        process_exit();
     }
     // Stop all other cores
     send_halt_ipi();
@@ -9,6 +9,7 @@ extern apic_timer_irq_handler
 extern keyboard_irq_handler
 extern mouse_irq_handler
 extern ahci_irq_handler
+extern tlb_shootdown_ipi_handler
 extern wakeup_ipi_handler
 extern halt_ipi_handler
 
@@ -19,11 +20,12 @@ IDT_APIC_TIMER_IRQ equ 0x20
 IDT_KEYBOARD_IRQ equ 0x21
 IDT_MOUSE_IRQ equ 0x22
 IDT_AHCI_IRQ equ 0x23
+IDT_TLB_SHOOTDOWN_IPI equ 0x2C
 IDT_WAKEUP_IPI equ 0x2D
 IDT_HALT_IPI equ 0x2E
 IDT_SPURIOUS_INT equ 0x2F
 
-%define interrupt_has_handler(i) ((i) < IDT_EXCEPTIONS_NUM || (i) == IDT_APIC_TIMER_IRQ || (i) == IDT_KEYBOARD_IRQ || (i) == IDT_MOUSE_IRQ || (i) == IDT_AHCI_IRQ || (i) == IDT_WAKEUP_IPI || (i) == IDT_HALT_IPI || (i) == IDT_SPURIOUS_INT)
+%define interrupt_has_handler(i) ((i) < IDT_EXCEPTIONS_NUM || (i) == IDT_APIC_TIMER_IRQ || (i) == IDT_KEYBOARD_IRQ || (i) == IDT_MOUSE_IRQ || (i) == IDT_AHCI_IRQ || (i) == IDT_TLB_SHOOTDOWN_IPI || (i) == IDT_WAKEUP_IPI || (i) == IDT_HALT_IPI || (i) == IDT_SPURIOUS_INT)
 %define interrupt_pushes_error_code(i) ((i) == 0x08 || (i) == 0x0A || (i) == 0x0B || (i) == 0x0C || (i) == 0x0D || (i) == 0x0E || (i) == 0x11 || (i) == 0x15 || (i) == 0x1D || (i) == 0x1E)
 
 ; Define a wrapper handler for each interrupt that has a handler function
@@ -77,6 +79,8 @@ interrupt_handler_%+i:
   call mouse_irq_handler
 %elif i == IDT_AHCI_IRQ
   call ahci_irq_handler
+%elif i == IDT_TLB_SHOOTDOWN_IPI
+  call tlb_shootdown_ipi_handler
 %elif i == IDT_WAKEUP_IPI
   call wakeup_ipi_handler
 %elif i == IDT_HALT_IPI
@@ -0,0 +1,10 @@
+#pragma once
+
+#include "types.h"
+
+// Copies of at least this size are done with non-temporal stores
+// It's chosen to be around the size of the L2 cache, as larger copies would evict most of its contents anyway.
+#define MEMCPY_NONTEMPORAL_MIN (UINT64_C(1) << 18)
+
+void memcpy_nontemporal(void * restrict dest, const void * restrict src, size_t n);
+void *memcpy_large(void * restrict dest, const void * restrict src, size_t n);
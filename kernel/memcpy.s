@@ -0,0 +1,43 @@
+global memcpy_nontemporal
+
+section .text
+
+; Copy memory using non-temporal stores, which write to memory without filling the cache
+; Uses SSE registers, so it must be called between kernel_fpu_begin() and kernel_fpu_end().
+; rdi - void * restrict dest
+; rsi - const void * restrict src
+; rdx - size_t n
+memcpy_nontemporal:
+  ; Copy single bytes until the destination is aligned to 16 bytes
+  mov rcx, rdi
+  neg rcx
+  and rcx, 15
+  cmp rcx, rdx
+  cmova rcx, rdx
+  sub rdx, rcx
+  rep movsb
+  ; Copy 64 bytes at a time using non-temporal stores
+  mov rcx, rdx
+  shr rcx, 6
+  jz .tail
+.loop:
+  movdqu xmm0, [rsi]
+  movdqu xmm1, [rsi + 16]
+  movdqu xmm2, [rsi + 32]
+  movdqu xmm3, [rsi + 48]
+  movntdq [rdi], xmm0
+  movntdq [rdi + 16], xmm1
+  movntdq [rdi + 32], xmm2
+  movntdq [rdi + 48], xmm3
+  add rsi, 64
+  add rdi, 64
+  sub rcx, 1
+  jnz .loop
+  ; Non-temporal stores are weakly ordered, so they have to be fenced before the data is accessed by anything else
+  sfence
+.tail:
+  ; Copy the remaining bytes
+  mov rcx, rdx
+  and rcx, 63
+  rep movsb
+  ret
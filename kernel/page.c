@@ -2,6 +2,10 @@
 #include "page.h"
 
 #include "framebuffer.h"
+#include "interrupt.h"
+#include "percpu.h"
+#include "process.h"
+#include "smp.h"
 #include "spinlock.h"
 #include "string.h"
 
@@ -10,15 +14,37 @@
 #define MEMORY_RANGE_ACPI_ATTR_VALID (1 << 0)
 #define MEMORY_RANGE_ACPI_ATTR_NONVOLATILE (1 << 1)
 
-#define PAGE_STACK_PML4E UINT64_C(0x1FC)
-#define PAGE_STACK_BOTTOM (u64 *)ASSEMBLE_ADDR_PML4E(PAGE_STACK_PML4E, 0)
-
 #define ID_MAP_INIT_AREA ASSEMBLE_ADDR_PDE(0x1FD, 0x002, 0x000, 0)
 
-static spinlock_t page_stack_lock;
+// Lowest physical address of pages that can be allocated
+// Low memory pages are discarded, as many of them are used by the bootloader.
+#define USABLE_MEMORY_START (UINT64_C(1) << 20)
+
+// Free pages are managed by a buddy allocator.
+// Each free block consists of 2^order pages and is aligned to its size. The blocks of each order form a doubly linked list,
+// with the links stored in the first page of the block and accessed through the identity mapping.
+// When a block is freed and its buddy (the other half of the block of the next order containing it) is free as well,
+// the two are merged into one block of the next order.
+
+static spinlock_t page_lock;
+
+typedef struct FreeBlock {
+    u64 prev; // physical address of previous block, or 0 if there is none
+    u64 next; // physical address of next block, or 0 if there is none
+} FreeBlock;
+
+// Physical addresses of the first free block of each order, or 0 if there are none
+static u64 free_lists[PAGE_ORDERS_NUM];
 
-// Free pages are stored in a stack.
-static u64 *page_stack_top = PAGE_STACK_BOTTOM;
+// Holds the state of every physical page up to the end of usable memory
+// The first page of each free block has its entry set to PAGE_STATE_FREE combined with the block's order, all other entries are zero.
+static u8 *page_states;
+static u64 page_states_length;
+
+#define PAGE_STATE_FREE 0x80
+
+// Number of free pages, not counting the ones held in per-CPU caches
+static size_t free_pages_num;
 
 typedef struct MemoryRange {
     u64 start;
@@ -29,99 +55,349 @@ typedef struct MemoryRange {
 
 extern MemoryRange memory_ranges[];
 extern u16 memory_ranges_length;
-extern u64 pdpt_page_stack[PAGE_MAP_LEVEL_SIZE];
 extern u64 pt_id_map_init[PAGE_MAP_LEVEL_SIZE];
 
+// Get the page-aligned bounds of a usable memory range
+// The range is clamped to the part of memory that can be allocated. Returns false if there are no usable pages in the range.
+static bool usable_range_bounds(u16 i, u64 *start, u64 *end) {
+    // If the memory type or ACPI attributes don't mark the memory range as valid, skip it
+    if (memory_ranges[i].type != MEMORY_RANGE_TYPE_USABLE)
+        return false;
+    if ((memory_ranges[i].acpi_attrs & (MEMORY_RANGE_ACPI_ATTR_VALID | MEMORY_RANGE_ACPI_ATTR_NONVOLATILE)) != (MEMORY_RANGE_ACPI_ATTR_VALID))
+        return false;
+    *start = (memory_ranges[i].start + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    *end = (memory_ranges[i].start + memory_ranges[i].length) / PAGE_SIZE * PAGE_SIZE;
+    // Discard low memory pages and pages that would go outside the identity mapping
+    if (*start < USABLE_MEMORY_START)
+        *start = USABLE_MEMORY_START;
+    if (*end > IDENTITY_MAPPING_SIZE)
+        *end = IDENTITY_MAPPING_SIZE;
+    return *start < *end;
+}
+
+// Get the bounds of the part of a usable memory range not used for the identity mapping
+// The pages used for the mapping are the ones up to `id_map_end` in the range with index `id_map_range_i` and all usable pages in the ranges before it.
+// Returns false if there are no remaining pages in the range.
+static bool remaining_range_bounds(u16 i, u64 *start, u64 *end, u16 id_map_range_i, u64 id_map_end) {
+    if (i < id_map_range_i || !usable_range_bounds(i, start, end))
+        return false;
+    if (i == id_map_range_i && *start < id_map_end)
+        *start = id_map_end;
+    return *start < *end;
+}
+
+static void free_list_add(u64 block, u64 order) {
+    FreeBlock *free_block = PHYS_ADDR(block);
+    free_block->prev = 0;
+    free_block->next = free_lists[order];
+    if (free_lists[order] != 0)
+        ((FreeBlock *)PHYS_ADDR(free_lists[order]))->prev = block;
+    free_lists[order] = block;
+    page_states[block >> PAGE_BITS] = PAGE_STATE_FREE | order;
+}
+
+static void free_list_remove(u64 block, u64 order) {
+    FreeBlock *free_block = PHYS_ADDR(block);
+    if (free_block->prev != 0)
+        ((FreeBlock *)PHYS_ADDR(free_block->prev))->next = free_block->next;
+    else
+        free_lists[order] = free_block->next;
+    if (free_block->next != 0)
+        ((FreeBlock *)PHYS_ADDR(free_block->next))->prev = free_block->prev;
+    page_states[block >> PAGE_BITS] = 0;
+}
+
+// Allocate a block of a given order, splitting a larger block if necessary
+// Returns 0 on failure.
+// Must be called with `page_lock` held.
+static u64 block_alloc(u64 order) {
+    u64 block_order = order;
+    while (block_order < PAGE_ORDERS_NUM && free_lists[block_order] == 0)
+        block_order++;
+    if (block_order == PAGE_ORDERS_NUM)
+        return 0;
+    u64 block = free_lists[block_order];
+    free_list_remove(block, block_order);
+    // Return the unused upper halves to the free lists
+    while (block_order > order) {
+        block_order--;
+        free_list_add(block + (PAGE_SIZE << block_order), block_order);
+    }
+    free_pages_num -= UINT64_C(1) << order;
+    return block;
+}
+
+// Free a block of a given order, merging it with its buddies while they're free
+// Must be called with `page_lock` held.
+static void block_free(u64 block, u64 order) {
+    free_pages_num += UINT64_C(1) << order;
+    while (order < PAGE_ORDERS_NUM - 1) {
+        u64 buddy = block ^ (PAGE_SIZE << order);
+        if ((buddy >> PAGE_BITS) >= page_states_length || page_states[buddy >> PAGE_BITS] != (PAGE_STATE_FREE | order))
+            break;
+        free_list_remove(buddy, order);
+        block &= ~(PAGE_SIZE << order);
+        order++;
+    }
+    free_list_add(block, order);
+}
+
+// Free all pages in the range from `start` to `end` exclusive, splitting it into the largest possible blocks
+// Must be called with `page_lock` held.
+static void range_free(u64 start, u64 end) {
+    while (start < end) {
+        u64 order = 0;
+        while (order < PAGE_ORDERS_NUM - 1 && start % (PAGE_SIZE << (order + 1)) == 0 && start + (PAGE_SIZE << (order + 1)) <= end)
+            order++;
+        block_free(start, order);
+        start += PAGE_SIZE << order;
+    }
+}
+
 err_t page_alloc_init(void) {
-    // Number of pages allocated in the identity mapping initialization area
-    size_t filled_id_map_pages = 0;
-    // The virtual address of the top of the page stack
+    // Create the identity mapping
+    // The identity mapping page map consists of PAGE_MAP_LEVEL_SIZE PDs, each one mapping PAGE_MAP_LEVEL_SIZE large pages.
+    // We use the first PAGE_MAP_LEVEL_SIZE pages we find as PDs for this mapping.
+    // We first map them as regular pages so that we fill them with PD entries for the large pages.
+    // The index of the memory range containing the last page used and the address of the page after it are stored,
+    // so that the pages used for the mapping are not freed later.
     u64 *pml4 = (u64 *)get_pml4();
-    u64 *page_stack_top_pdpt = pdpt_page_stack;
-    u64 *page_stack_top_pd = NULL;
-    u64 *page_stack_top_pt = NULL;
-    // Iterate over the memory ranges gathered by the bootloader
-    for (u16 i = 0; i < memory_ranges_length / sizeof(MemoryRange); i++) {
-        // If the memory type or ACPI attributes don't mark the memory range as valid, skip it
-        if (memory_ranges[i].type != MEMORY_RANGE_TYPE_USABLE)
-            continue;
-        if ((memory_ranges[i].acpi_attrs & (MEMORY_RANGE_ACPI_ATTR_VALID | MEMORY_RANGE_ACPI_ATTR_NONVOLATILE)) != (MEMORY_RANGE_ACPI_ATTR_VALID))
+    size_t filled_id_map_pages = 0;
+    u16 id_map_range_i;
+    u64 id_map_end = 0;
+    for (id_map_range_i = 0; id_map_range_i < memory_ranges_length / sizeof(MemoryRange); id_map_range_i++) {
+        u64 range_start, range_end;
+        if (!usable_range_bounds(id_map_range_i, &range_start, &range_end))
             continue;
-        u64 page_start = (((memory_ranges[i].start - 1) >> PAGE_BITS) + 1) << PAGE_BITS;
-        u64 page_end = ((memory_ranges[i].start + memory_ranges[i].length) >> PAGE_BITS) << PAGE_BITS;
-        // Add each page in the range to the page stack
-        for (u64 page = page_start; page < page_end; page += PAGE_SIZE) {
-            // Discard low memory pages, as many of them are used by the bootloader
-            if (page < (UINT64_C(1) << 20))
-                continue;
-            // Discard pages that would go outside the identity mapping
-            if (page >= IDENTITY_MAPPING_SIZE)
-                continue;
-            // Fill part of the identity mapping
-            // The identity mapping page map consists of PAGE_MAP_LEVEL_SIZE PDs, each one mapping PAGE_MAP_LEVEL_SIZE large pages.
-            // We use the first PAGE_MAP_LEVEL_SIZE pages we find as PDs for this mapping.
-            // We first map them as regular pages so that we fill them with PD entries for the large pages.
-            if (filled_id_map_pages < PAGE_MAP_LEVEL_SIZE) {
-                // Map the page in the initialization area
-                pt_id_map_init[filled_id_map_pages] = page | PAGE_WRITE | PAGE_PRESENT;
-                filled_id_map_pages++;
-                // Once we got all the pages we need, we fill them with PD entries and map them as PDs.
-                if (filled_id_map_pages == PAGE_MAP_LEVEL_SIZE) {
-                    for (size_t i = 0; i < PAGE_MAP_LEVEL_SIZE * PAGE_MAP_LEVEL_SIZE; i++)
-                        *((u64 *)ID_MAP_INIT_AREA + i) = (i * LARGE_PAGE_SIZE) | PAGE_NX | PAGE_GLOBAL | PAGE_LARGE | PAGE_WRITE | PAGE_PRESENT;
-                    pml4[IDENTITY_MAPPING_PML4E] = (u64)pt_id_map_init | PAGE_WRITE | PAGE_PRESENT;
-                }
-                continue;
-            }
-            // If we go exhaust all space in the PDPT, we end the loop prematurely.
-            // This should never happen.
-            if (page_stack_top >= PAGE_STACK_BOTTOM + PDPT_SIZE / sizeof(u64))
-                return 0;
-            // If we reach the end of the mapped part of the stack,
-            // we use the current page to extend the mapping.
-            // Otherwise, we just push the page on top of the stack.
-            if ((u64)page_stack_top % PD_SIZE == 0 && page_stack_top_pdpt[ADDR_PDPTE(page_stack_top)] == 0) {
-                memset(PHYS_ADDR(page), 0, PAGE_SIZE);
-                page_stack_top_pdpt[ADDR_PDPTE(page_stack_top)] = page | PAGE_WRITE | PAGE_PRESENT;
-                page_stack_top_pd = PHYS_ADDR(page);
-            } else if ((u64)page_stack_top % PT_SIZE == 0 && page_stack_top_pd[ADDR_PDE(page_stack_top)] == 0) {
-                memset(PHYS_ADDR(page), 0, PAGE_SIZE);
-                page_stack_top_pd[ADDR_PDE(page_stack_top)] = page | PAGE_WRITE | PAGE_PRESENT;
-                page_stack_top_pt = PHYS_ADDR(page);
-            } else if ((u64)page_stack_top % PAGE_SIZE == 0 && page_stack_top_pt[ADDR_PTE(page_stack_top)] == 0) {
-                memset(PHYS_ADDR(page), 0, PAGE_SIZE);
-                page_stack_top_pt[ADDR_PTE(page_stack_top)] = page | PAGE_GLOBAL | PAGE_WRITE | PAGE_PRESENT;
-            } else {
-                *page_stack_top = page;
-                page_stack_top++;
-            }
+        for (id_map_end = range_start; id_map_end < range_end && filled_id_map_pages < PAGE_MAP_LEVEL_SIZE; id_map_end += PAGE_SIZE) {
+            // Map the page in the initialization area
+            pt_id_map_init[filled_id_map_pages] = id_map_end | PAGE_WRITE | PAGE_PRESENT;
+            filled_id_map_pages++;
         }
+        if (filled_id_map_pages == PAGE_MAP_LEVEL_SIZE)
+            break;
     }
     // If we didn't find enough pages to create the identity mapping, the initialization fails
     if (filled_id_map_pages < PAGE_MAP_LEVEL_SIZE)
         return ERR_KERNEL_NO_MEMORY;
+    // Once we got all the pages we need, we fill them with PD entries and map them as PDs.
+    for (size_t i = 0; i < PAGE_MAP_LEVEL_SIZE * PAGE_MAP_LEVEL_SIZE; i++)
+        *((u64 *)ID_MAP_INIT_AREA + i) = (i * LARGE_PAGE_SIZE) | PAGE_NX | PAGE_GLOBAL | PAGE_LARGE | PAGE_WRITE | PAGE_PRESENT;
+    pml4[IDENTITY_MAPPING_PML4E] = (u64)pt_id_map_init | PAGE_WRITE | PAGE_PRESENT;
+    // Find the end of usable memory
+    u64 memory_end = 0;
+    for (u16 i = 0; i < memory_ranges_length / sizeof(MemoryRange); i++) {
+        u64 range_start, range_end;
+        if (usable_range_bounds(i, &range_start, &range_end) && range_end > memory_end)
+            memory_end = range_end;
+    }
+    // Allocate the page state array in the first range that can fit it
+    page_states_length = memory_end >> PAGE_BITS;
+    u64 page_states_size = (page_states_length + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    u64 page_states_start = 0;
+    for (u16 i = 0; i < memory_ranges_length / sizeof(MemoryRange); i++) {
+        u64 range_start, range_end;
+        if (remaining_range_bounds(i, &range_start, &range_end, id_map_range_i, id_map_end) && range_end - range_start >= page_states_size) {
+            page_states_start = range_start;
+            break;
+        }
+    }
+    if (page_states_start == 0)
+        return ERR_KERNEL_NO_MEMORY;
+    page_states = PHYS_ADDR(page_states_start);
+    memset(page_states, 0, page_states_size);
+    // Free all remaining usable memory
+    for (u16 i = 0; i < memory_ranges_length / sizeof(MemoryRange); i++) {
+        u64 range_start, range_end;
+        if (!remaining_range_bounds(i, &range_start, &range_end, id_map_range_i, id_map_end))
+            continue;
+        if (range_start <= page_states_start && page_states_start < range_end) {
+            range_free(range_start, page_states_start);
+            range_free(page_states_start + page_states_size, range_end);
+        } else {
+            range_free(range_start, range_end);
+        }
+    }
     return 0;
 }
 
+// Allocates a block of 2^order physically contiguous pages aligned to its size and returns its physical address.
+// Returns 0 on failure.
+// The pages are not cleared. They can be freed either as a block or separately.
+u64 page_alloc_block(u64 order) {
+    if (order >= PAGE_ORDERS_NUM)
+        return 0;
+    spinlock_acquire(&page_lock);
+    u64 block = block_alloc(order);
+    spinlock_release(&page_lock);
+    return block;
+}
+
+// Allocates `n` physically contiguous pages and returns the physical address of the first one.
+// Returns 0 on failure.
+// The pages are not cleared. They can be freed either together or separately.
+u64 page_alloc_contiguous(size_t n) {
+    if (n == 0)
+        return 0;
+    u64 order = 0;
+    while (order < PAGE_ORDERS_NUM && (UINT64_C(1) << order) < n)
+        order++;
+    if (order == PAGE_ORDERS_NUM)
+        return 0;
+    spinlock_acquire(&page_lock);
+    u64 start = block_alloc(order);
+    // Free the part of the block that wasn't requested
+    if (start != 0)
+        range_free(start + n * PAGE_SIZE, start + (PAGE_SIZE << order));
+    spinlock_release(&page_lock);
+    return start;
+}
+
+// Frees `n` physically contiguous pages starting at `start`
+void page_free_contiguous(u64 start, size_t n) {
+    spinlock_acquire(&page_lock);
+    range_free(start, start + n * PAGE_SIZE);
+    spinlock_release(&page_lock);
+}
+
+// Each CPU keeps a cache of free single pages in front of the buddy allocator, which is accessed with only preemption disabled.
+// When the cache becomes empty or full, half of its capacity is moved from or to the buddy allocator at once.
+
+// Move pages from the buddy allocator into the cache of the current CPU
+// Must be called with preemption disabled.
+static void page_cache_refill(PerCPU *cpu) {
+    spinlock_acquire(&page_lock);
+    while (cpu->page_cache_length < PAGE_CACHE_SIZE / 2) {
+        u64 page = block_alloc(0);
+        if (page == 0)
+            break;
+        cpu->page_cache[cpu->page_cache_length++] = page;
+    }
+    spinlock_release(&page_lock);
+}
+
+// Move pages from the cache of the current CPU to the buddy allocator until the cache is half full
+// Must be called with preemption disabled.
+static void page_cache_drain(PerCPU *cpu) {
+    spinlock_acquire(&page_lock);
+    while (cpu->page_cache_length > PAGE_CACHE_SIZE / 2)
+        block_free(cpu->page_cache[--cpu->page_cache_length], 0);
+    spinlock_release(&page_lock);
+}
+
+// Take a page from the cache of the current CPU, refilling it from the buddy allocator if it's empty
+// Returns 0 if there are no free pages left. The zeroed page pool isn't used.
+static u64 page_cache_alloc(void) {
+    preempt_disable();
+    PerCPU *self = cpu_local->self;
+    if (self->page_cache_length == 0)
+        page_cache_refill(self);
+    u64 page = 0;
+    if (self->page_cache_length != 0)
+        page = self->page_cache[--self->page_cache_length];
+    preempt_enable();
+    return page;
+}
+
+// Idle CPUs clear free pages in advance and keep them in a pool, which is used by page_alloc_clear() before clearing a page itself.
+// The pool is a singly linked list, with the address of the next page stored in the first 8 bytes of each page.
+static spinlock_t zeroed_pages_lock;
+static u64 zeroed_pages = 0;
+static size_t zeroed_pages_num = 0;
+
+// Take a page from the zeroed page pool
+// Returns 0 if the pool is empty.
+static u64 zeroed_page_take(void) {
+    spinlock_acquire(&zeroed_pages_lock);
+    u64 page = zeroed_pages;
+    if (page != 0) {
+        zeroed_pages = *(u64 *)PHYS_ADDR(page);
+        zeroed_pages_num--;
+    }
+    spinlock_release(&zeroed_pages_lock);
+    // Clear the link to the next page
+    if (page != 0)
+        *(u64 *)PHYS_ADDR(page) = 0;
+    return page;
+}
+
+// Clear a free page and add it to the zeroed page pool
+// Called by idle CPUs. Returns false if the pool is full or there are no free pages left.
+bool page_zero_idle(void) {
+    spinlock_acquire(&zeroed_pages_lock);
+    bool full = zeroed_pages_num >= ZEROED_PAGES_MAX;
+    spinlock_release(&zeroed_pages_lock);
+    if (full)
+        return false;
+    // The page isn't taken from the pool itself, as that would keep the CPU clearing the same pages without ever halting
+    u64 page = page_cache_alloc();
+    if (page == 0)
+        return false;
+    memset(PHYS_ADDR(page), 0, PAGE_SIZE);
+    spinlock_acquire(&zeroed_pages_lock);
+    // Another CPU may have filled the pool in the meantime
+    if (zeroed_pages_num >= ZEROED_PAGES_MAX) {
+        spinlock_release(&zeroed_pages_lock);
+        page_free(page);
+        return false;
+    }
+    *(u64 *)PHYS_ADDR(page) = zeroed_pages;
+    zeroed_pages = page;
+    zeroed_pages_num++;
+    spinlock_release(&zeroed_pages_lock);
+    return true;
+}
+
 // Allocates a new page and returns its physical address.
 // Returns 0 on failure.
 // The page is not cleared.
 u64 page_alloc(void) {
-    spinlock_acquire(&page_stack_lock);
-    if (page_stack_top == PAGE_STACK_BOTTOM) {
-        spinlock_release(&page_stack_lock);
-        return 0;
-    }
-    page_stack_top--;
-    u64 page = *page_stack_top;
-    spinlock_release(&page_stack_lock);
+    u64 page = page_cache_alloc();
+    // As a last resort, take a page from the zeroed page pool
+    if (page == 0)
+        page = zeroed_page_take();
     return page;
 }
 
+// Allocates `n` pages and stores their physical addresses in `pages`.
+// Either all pages are allocated or none are. The pages are not cleared.
+// Pages missing from the cache of the current CPU are taken from the buddy allocator with a single lock acquisition,
+// and as a last resort from the zeroed page pool.
+err_t page_alloc_n(u64 *pages, size_t n) {
+    preempt_disable();
+    PerCPU *self = cpu_local->self;
+    // Take as many pages as possible from the cache
+    size_t allocated = n < self->page_cache_length ? n : self->page_cache_length;
+    for (size_t i = 0; i < allocated; i++)
+        pages[i] = self->page_cache[--self->page_cache_length];
+    if (allocated < n) {
+        // Take as many of the rest as possible from the buddy allocator
+        spinlock_acquire(&page_lock);
+        size_t buddy_end = n - allocated <= free_pages_num ? n : allocated + free_pages_num;
+        for (; allocated < buddy_end; allocated++)
+            pages[allocated] = block_alloc(0);
+        spinlock_release(&page_lock);
+    }
+    preempt_enable();
+    // Take the remaining pages from the zeroed page pool
+    for (; allocated < n; allocated++) {
+        pages[allocated] = zeroed_page_take();
+        if (pages[allocated] == 0) {
+            page_free_n(pages, allocated);
+            return ERR_KERNEL_NO_MEMORY;
+        }
+    }
+    return 0;
+}
+
 // Allocates a new page, clears it, and returns its physical address.
 // Returns 0 on failure.
+// A page already cleared by an idle CPU is used if there is one.
 u64 page_alloc_clear(void) {
-    u64 page = page_alloc();
+    u64 page = zeroed_page_take();
+    if (page != 0)
+        return page;
+    page = page_alloc();
     if (page == 0)
         return 0;
     memset(PHYS_ADDR(page), 0, PAGE_SIZE);
@@ -129,23 +405,172 @@ u64 page_alloc_clear(void) {
 }
 
 void page_free(u64 page) {
-    spinlock_acquire(&page_stack_lock);
-    *page_stack_top = page;
-    page_stack_top++;
-    spinlock_release(&page_stack_lock);
+    preempt_disable();
+    PerCPU *self = cpu_local->self;
+    if (self->page_cache_length == PAGE_CACHE_SIZE)
+        page_cache_drain(self);
+    self->page_cache[self->page_cache_length++] = page;
+    preempt_enable();
+}
+
+// Frees `n` pages whose physical addresses are stored in `pages`.
+// Pages that don't fit in the cache of the current CPU are returned to the buddy allocator with a single lock acquisition.
+void page_free_n(const u64 *pages, size_t n) {
+    preempt_disable();
+    PerCPU *self = cpu_local->self;
+    size_t i = 0;
+    while (i < n && self->page_cache_length < PAGE_CACHE_SIZE)
+        self->page_cache[self->page_cache_length++] = pages[i++];
+    if (i < n) {
+        spinlock_acquire(&page_lock);
+        for (; i < n; i++)
+            block_free(pages[i], 0);
+        spinlock_release(&page_lock);
+    }
+    preempt_enable();
 }
 
 // Returns the number of free pages.
+// Pages held in the caches of each CPU are not counted.
 size_t get_free_memory_size(void) {
-    spinlock_acquire(&page_stack_lock);
-    size_t result = page_stack_top - PAGE_STACK_BOTTOM;
-    spinlock_release(&page_stack_lock);
+    spinlock_acquire(&page_lock);
+    size_t result = free_pages_num;
+    spinlock_release(&page_lock);
     return result;
 }
 
+// Set if the CPU supports PCIDs, in which case every CPU has them enabled
+bool pcid_enabled = false;
+// Value written to CR3 when switching to the idle page map
+// If PCIDs are enabled, the idle page map uses PCID 0 and is loaded without flushing the TLB, as its user part is never accessed.
+u64 idle_page_map_cr3;
+
+#define CPUID_PCID (1 << 17)
+#define CR4_PCIDE (UINT64_C(1) << 17)
+
+// Enable PCIDs on the current CPU if they're supported
+// Must be called on every CPU while the idle page map is loaded.
+void pcid_init(void) {
+    u32 cpuid_1_ecx;
+    asm ("mov eax, 1; cpuid" : "=c"(cpuid_1_ecx) : : "eax", "ebx", "edx");
+    pcid_enabled = (cpuid_1_ecx & CPUID_PCID) != 0;
+    idle_page_map_cr3 = get_pml4() | (pcid_enabled ? CR3_NOFLUSH : 0);
+    if (pcid_enabled) {
+        u64 cr4;
+        asm volatile ("mov %0, cr4" : "=r"(cr4));
+        asm volatile ("mov cr4, %0" : : "r"(cr4 | CR4_PCIDE));
+    }
+}
+
+// Complete the TLB shootdown requests sent to the current CPU
+// Called by the TLB shootdown IPI handler and by CPUs waiting for their own shootdown requests to complete.
+// The whole TLB is flushed for the loaded PCID, which covers all requests received up to this point.
+void tlb_shootdown_handle(void) {
+    interrupt_disable();
+    PerCPU *self = cpu_local->self;
+    u64 requests = atomic_load(&self->tlb_shootdown_requests);
+    if (atomic_load(&self->tlb_shootdown_done) != requests) {
+        flush_tlb();
+        atomic_store(&self->tlb_shootdown_done, requests);
+    }
+    interrupt_enable();
+}
+
+// Make all other CPUs that have the page map with a given address space ID loaded flush their TLB
+// IPIs are sent to all such CPUs first, and then each of them is waited for. While waiting, shootdown requests sent to
+// this CPU are completed as well, so that two CPUs waiting for each other can't deadlock even with interrupts disabled.
+// A CPU that loads a different page map in the meantime isn't waited for, as it flushes the entries if it loads this one again.
+static void tlb_shootdown(u64 address_space_id) {
+    PerCPU *self = cpu_local->self;
+    // Paired with the barrier in process_load_page_map()
+    atomic_thread_fence(memory_order_seq_cst);
+    // Interrupts are disabled while sending, so that an interrupt handler sending an IPI can't change the interrupt command register
+    interrupt_disable();
+    for (PerCPU *cpu = sched_cpu_list; cpu != NULL; cpu = cpu->next_sched_cpu) {
+        if (cpu == self || cpu->loaded_address_space_id != address_space_id)
+            continue;
+        atomic_fetch_add(&cpu->tlb_shootdown_requests, 1);
+        send_tlb_shootdown_ipi(cpu->lapic_id);
+    }
+    interrupt_enable();
+    for (PerCPU *cpu = sched_cpu_list; cpu != NULL; cpu = cpu->next_sched_cpu) {
+        if (cpu == self)
+            continue;
+        while (cpu->loaded_address_space_id == address_space_id
+                && atomic_load(&cpu->tlb_shootdown_done) != atomic_load(&cpu->tlb_shootdown_requests)) {
+            tlb_shootdown_handle();
+            asm volatile ("pause");
+        }
+    }
+}
+
+// Make other CPUs drop their TLB entries for the current process page map after a mapping was removed or changed
+// The page map generation is incremented, so that CPUs that ran the process before flush the entries when they next load
+// the page map. If the process has other threads, the CPUs that have the page map loaded are sent TLB shootdown IPIs.
+// Must be called with the page map lock held, after the TLB entries of the current CPU were invalidated.
+static void user_tlb_shootdown(void) {
+    ThreadGroup *group = cpu_local->current_process->group;
+    group->page_map_generation++;
+    if (group->threads_num > 1)
+        tlb_shootdown(group->address_space_id);
+}
+
+// Invalidate a page after its mapping in the current process page map was removed or changed
+static void invalidate_user_page(u64 addr) {
+    invalidate_page(addr);
+    user_tlb_shootdown();
+}
+
+// Lock the page map of the current process
+// Threads of a process share its page map, so all changes to its user part are made with the lock held.
+static void user_page_map_lock(void) {
+    spinlock_acquire(&cpu_local->current_process->group->page_map_lock);
+}
+
+static void user_page_map_unlock(void) {
+    spinlock_release(&cpu_local->current_process->group->page_map_lock);
+}
+
 // Used to protect access to the kernel page map
 static spinlock_t kernel_page_lock;
 
+// Maximum number of pages unmapped at once for which each page is invalidated separately instead of flushing the TLB
+#define UNMAP_INVALIDATE_PAGES_MAX 32
+
+// Charge a number of pages against the memory limit of the current process
+// Pages are charged when they're mapped or reserved, so that allocating them later can't exceed the limit.
+static err_t user_pages_charge(u64 pages_num) {
+    ThreadGroup *group = cpu_local->current_process->group;
+    if (pages_num > group->memory_limit - group->memory_pages)
+        return ERR_KERNEL_NO_MEMORY;
+    group->memory_pages += pages_num;
+    return 0;
+}
+
+// Return pages charged against the memory limit of the current process
+static void user_pages_uncharge(u64 pages_num) {
+    cpu_local->current_process->group->memory_pages -= pages_num;
+}
+
+// Allocate a cleared page map
+// If `user` is true, the page map is charged against the memory limit of the current process.
+// Returns 0 on failure.
+static u64 page_map_page_alloc(bool user) {
+    if (user && user_pages_charge(1))
+        return 0;
+    u64 page = page_alloc_clear();
+    if (page == 0 && user)
+        user_pages_uncharge(1);
+    return page;
+}
+
+// Free a page map allocated with page_map_page_alloc() with the same value of `user`
+static void page_map_page_free(u64 page, bool user) {
+    page_free(page);
+    if (user)
+        user_pages_uncharge(1);
+}
+
 static u64 get_mapping_start_index(u64 start, u64 page_map_start, u64 page_map_bits) {
     return start < page_map_start ? 0 : (start >> page_map_bits) % PAGE_MAP_LEVEL_SIZE;
 }
@@ -156,41 +581,59 @@ static u64 get_mapping_end_index(u64 end, u64 page_map_start, u64 page_map_bits)
 
 // Free the entries not marked as present mapping the range from `start` to `end` inclusive within a page map at address `page_map` mapping the range starting at `page_map_start` of length `1 << page_map_bits`
 // Flags are ignored when unmapping entries, including the present flag.
+// If `lazy` is true, the lowest level entries have no pages allocated for them and are left as is.
+// If `user` is true, the freed page maps are uncharged from the memory limit of the current process.
 // Assumes that the page map maps addresses for at least part of the range and that all addresses are truncated to 48 bits.
-static void free_page_map_range(u64 start, u64 end, u64 *page_map, u64 page_map_start, u64 page_map_bits) {
+static void free_page_map_range(u64 start, u64 end, u64 *page_map, u64 page_map_start, u64 page_map_bits, bool lazy, bool user) {
     u64 mapping_start_index = get_mapping_start_index(start, page_map_start, page_map_bits);
     u64 mapping_end_index = get_mapping_end_index(end, page_map_start, page_map_bits);
     for (u64 i = mapping_start_index; i <= mapping_end_index; i++) {
         u64 next_page_map = page_map[i] & PAGE_MASK;
         if (page_map_bits > PAGE_BITS)
-            free_page_map_range(start, end, PHYS_ADDR(next_page_map), page_map_start + (i << page_map_bits), page_map_bits - 9);
-        if (!(page_map[i] & PAGE_PRESENT))
+            free_page_map_range(start, end, PHYS_ADDR(next_page_map), page_map_start + (i << page_map_bits), page_map_bits - 9, lazy, user);
+        else if (lazy)
+            continue;
+        if (page_map[i] & PAGE_PRESENT)
+            continue;
+        if (page_map_bits > PAGE_BITS)
+            page_map_page_free(next_page_map, user);
+        else
             page_free(next_page_map);
     }
 }
 
 // Fill the entries mapping the range from `start` to `end` inclusive within a page map at address `page_map` mapping the range starting at `page_map_start` of length `1 << page_map_bits`
 // No flags are set, including the present flag. This prevents programs from accessing memory that would be unmapped later if an error occurs.
+// If `lazy` is true, no pages are allocated for the lowest level entries. They're only checked to not be mapped already.
+// If `user` is true, the allocated page maps are charged against the memory limit of the current process.
 // Assumes that the page map maps addresses for at least part of the range and that all addresses are truncated to 48 bits.
 // If an error occurs, all allocated pages are freed.
-static err_t fill_page_map_range(u64 start, u64 end, u64 *page_map, u64 page_map_start, u64 page_map_bits) {
+static err_t fill_page_map_range(u64 start, u64 end, u64 *page_map, u64 page_map_start, u64 page_map_bits, bool lazy, bool user) {
     err_t err;
     // Iterate over the relevant range of page map entries
     u64 mapping_start_index = get_mapping_start_index(start, page_map_start, page_map_bits);
     u64 mapping_end_index = get_mapping_end_index(end, page_map_start, page_map_bits);
     for (u64 i = mapping_start_index; i <= mapping_end_index; i++) {
         u64 *next_page_map;
-        if (page_map[i] & PAGE_PRESENT) {
+        if (page_map_bits == PAGE_BITS && (page_map[i] & PAGE_LAZY)) {
+            // The page is already reserved to be allocated on first access
+            err = ERR_KERNEL_PAGE_ALREADY_MAPPED;
+            goto fail;
+        } else if (page_map[i] & PAGE_PRESENT) {
             // If the we're trying to map a page that's already mapped, return an error
-            if (page_map_bits == PAGE_BITS) {
+            // This includes the case where the entry maps a large page instead of a page map.
+            if (page_map_bits == PAGE_BITS || (page_map[i] & PAGE_LARGE)) {
                 err = ERR_KERNEL_PAGE_ALREADY_MAPPED;
                 goto fail;
             }
             // If we're mapping a page map and it already exists, use it
             next_page_map = PHYS_ADDR(page_map[i] & PAGE_MASK);
+        } else if (page_map_bits == PAGE_BITS && lazy) {
+            // The page will be allocated on first access
+            continue;
         } else {
             // If there is no page present yet, allocate one
-            u64 new_page_phys = page_map_bits > PAGE_BITS ? page_alloc_clear() : page_alloc();
+            u64 new_page_phys = page_map_bits > PAGE_BITS ? page_map_page_alloc(user) : page_alloc();
             if (new_page_phys == 0) {
                 err = ERR_KERNEL_NO_MEMORY;
                 goto fail;
@@ -200,10 +643,10 @@ static err_t fill_page_map_range(u64 start, u64 end, u64 *page_map, u64 page_map
         }
         if (page_map_bits > PAGE_BITS) {
             // Recurse to map the lower level page maps
-            err = fill_page_map_range(start, end, next_page_map, page_map_start + (i << page_map_bits), page_map_bits - 9);
+            err = fill_page_map_range(start, end, next_page_map, page_map_start + (i << page_map_bits), page_map_bits - 9, lazy, user);
             if (err) {
                 if (!(page_map[i] & PAGE_PRESENT))
-                    page_free(page_map[i] & PAGE_MASK);
+                    page_map_page_free(page_map[i] & PAGE_MASK, user);
                 goto fail;
             }
         }
@@ -212,8 +655,14 @@ fail:
         // Free the previously allocated pages and return an error
         for (u64 j = mapping_start_index; j < i; j++) {
             if (page_map_bits > PAGE_BITS)
-                free_page_map_range(start, end, PHYS_ADDR(page_map[j] & PAGE_MASK), page_map_start + (j << page_map_bits), page_map_bits - 9);
-            if (!(page_map[j] & PAGE_PRESENT))
+                free_page_map_range(start, end, PHYS_ADDR(page_map[j] & PAGE_MASK), page_map_start + (j << page_map_bits), page_map_bits - 9, lazy, user);
+            else if (lazy)
+                continue;
+            if (page_map[j] & PAGE_PRESENT)
+                continue;
+            if (page_map_bits > PAGE_BITS)
+                page_map_page_free(page_map[j] & PAGE_MASK, user);
+            else
                 page_free(page_map[j] & PAGE_MASK);
         }
         return err;
@@ -238,6 +687,7 @@ static void enable_page_map_range(u64 start, u64 end, u64 *page_map, u64 page_ma
 }
 
 // Map the pages in the given range with the specified flags
+// If the flags contain PAGE_LAZY instead of PAGE_PRESENT, the pages are only reserved and allocated on first access.
 // Assumes all addresses are truncated to 48 bits.
 static err_t map_pages(u64 start, u64 length, u64 flags) {
     err_t err;
@@ -247,7 +697,7 @@ static err_t map_pages(u64 start, u64 length, u64 flags) {
         return ERR_KERNEL_INVALID_ADDRESS;
     if (length == 0)
         return 0;
-    err = fill_page_map_range(start, start + length - PAGE_SIZE, PHYS_ADDR(get_pml4()), 0, PDPT_BITS);
+    err = fill_page_map_range(start, start + length - PAGE_SIZE, PHYS_ADDR(get_pml4()), 0, PDPT_BITS, flags & PAGE_LAZY, flags & PAGE_USER);
     if (err)
         return err;
     enable_page_map_range(start, start + length - PAGE_SIZE, PHYS_ADDR(get_pml4()), 0, PDPT_BITS, flags);
@@ -264,24 +714,406 @@ err_t map_kernel_pages(u64 start, u64 length, bool write, bool execute) {
     return result;
 }
 
+// Check if a user page entry is charged against the memory limit of the process
+// Pages of shared memory objects and read-only parts of cached ELF images are not charged, but copy-on-write pages are.
+static bool user_page_entry_charged(u64 entry) {
+    if (entry & PAGE_PRESENT)
+        return !(entry & PAGE_SHARED) || (entry & PAGE_COW);
+    return (entry & PAGE_LAZY) != 0;
+}
+
+// Map the pages in the given range into the current process, charging them against its memory limit
+static err_t map_charged_pages(u64 start, u64 length, u64 flags) {
+    err_t err;
+    err = user_pages_charge(length / PAGE_SIZE);
+    if (err)
+        return err;
+    err = map_pages(start, length, flags);
+    if (err)
+        user_pages_uncharge(length / PAGE_SIZE);
+    return err;
+}
+
 // Map the pages in the given range as userspace memory
 err_t map_user_pages(u64 start, u64 length, bool write, bool execute) {
     if (start + length > USER_ADDR_UPPER_BOUND)
         return ERR_KERNEL_INVALID_ADDRESS;
-    return map_pages(start % PML4_SIZE, length, (execute ? 0 : PAGE_NX) | PAGE_USER | (write ? PAGE_WRITE : 0) | PAGE_PRESENT);
+    user_page_map_lock();
+    err_t err = map_charged_pages(start % PML4_SIZE, length, (execute ? 0 : PAGE_NX) | PAGE_USER | (write ? PAGE_WRITE : 0) | PAGE_PRESENT);
+    user_page_map_unlock();
+    return err;
+}
+
+// Reserve the pages in the given range as userspace memory
+// Physical pages are not allocated until the first access to each page, at which point they're cleared.
+err_t reserve_user_pages(u64 start, u64 length, bool write, bool execute) {
+    if (start + length > USER_ADDR_UPPER_BOUND)
+        return ERR_KERNEL_INVALID_ADDRESS;
+    user_page_map_lock();
+    err_t err = map_charged_pages(start % PML4_SIZE, length, (execute ? 0 : PAGE_NX) | PAGE_USER | (write ? PAGE_WRITE : 0) | PAGE_LAZY);
+    user_page_map_unlock();
+    return err;
+}
+
+// Get the page directory entry mapping a given user address in the current page map
+// Page maps above the page directory are allocated if they're not present.
+static err_t get_user_pd_entry(u64 addr, u64 **entry_ptr) {
+    u64 *page_map = PHYS_ADDR(get_pml4());
+    for (u64 page_map_bits = PDPT_BITS; page_map_bits > PT_BITS; page_map_bits -= PAGE_MAP_LEVEL_BITS) {
+        u64 *entry = &page_map[(addr >> page_map_bits) % PAGE_MAP_LEVEL_SIZE];
+        if (!(*entry & PAGE_PRESENT)) {
+            u64 new_page_map = page_map_page_alloc(true);
+            if (new_page_map == 0)
+                return ERR_KERNEL_NO_MEMORY;
+            *entry = new_page_map | PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
+        }
+        page_map = PHYS_ADDR(*entry & PAGE_MASK);
+    }
+    *entry_ptr = &page_map[ADDR_PDE(addr)];
+    return 0;
+}
+
+// Map the pages in the given range as userspace memory using large pages
+// Both the start and length of the range must be multiples of the large page size.
+// If an error occurs, the large pages mapped so far are unmapped, but the page maps allocated for them are kept.
+err_t map_user_large_pages(u64 start, u64 length, bool write, bool execute) {
+    err_t err;
+    if (start % LARGE_PAGE_SIZE != 0 || length % LARGE_PAGE_SIZE != 0)
+        return ERR_KERNEL_INVALID_ARG;
+    if (start + length < start || start + length > USER_ADDR_UPPER_BOUND)
+        return ERR_KERNEL_INVALID_ADDRESS;
+    user_page_map_lock();
+    err = user_pages_charge(length / PAGE_SIZE);
+    if (err) {
+        user_page_map_unlock();
+        return err;
+    }
+    u64 flags = (execute ? 0 : PAGE_NX) | PAGE_USER | (write ? PAGE_WRITE : 0) | PAGE_LARGE | PAGE_PRESENT;
+    for (u64 addr = start; addr < start + length; addr += LARGE_PAGE_SIZE) {
+        u64 *entry;
+        err = get_user_pd_entry(addr, &entry);
+        if (err)
+            goto fail;
+        if (*entry & PAGE_PRESENT) {
+            err = ERR_KERNEL_PAGE_ALREADY_MAPPED;
+            goto fail;
+        }
+        u64 page = page_alloc_block(LARGE_PAGE_ORDER);
+        if (page == 0) {
+            err = ERR_KERNEL_NO_MEMORY;
+            goto fail;
+        }
+        // Clear the page, so that no data from its previous owner is exposed
+        memset(PHYS_ADDR(page), 0, LARGE_PAGE_SIZE);
+        *entry = page | flags;
+        continue;
+fail:
+        // The current thread hasn't accessed the pages since they were mapped, but other threads of the process may have,
+        // so the pages are unmapped and other CPUs flush their TLB entries before the pages are freed.
+        for (u64 mapped_addr = start; mapped_addr < addr; mapped_addr += LARGE_PAGE_SIZE) {
+            get_user_pd_entry(mapped_addr, &entry);
+            *entry &= ~PAGE_PRESENT;
+        }
+        if (addr != start)
+            user_tlb_shootdown();
+        for (u64 mapped_addr = start; mapped_addr < addr; mapped_addr += LARGE_PAGE_SIZE) {
+            get_user_pd_entry(mapped_addr, &entry);
+            page_free_contiguous(*entry & PAGE_MASK, PAGE_MAP_LEVEL_SIZE);
+            *entry = 0;
+        }
+        user_pages_uncharge(length / PAGE_SIZE);
+        user_page_map_unlock();
+        return err;
+    }
+    user_page_map_unlock();
+    return 0;
+}
+
+// Get the page table entry mapping a given user address in the current page map
+// Returns NULL if the page table containing the entry is not present or the address is mapped by a large page.
+static u64 *get_user_page_entry(u64 addr) {
+    if (addr >= USER_ADDR_UPPER_BOUND)
+        return NULL;
+    u64 *page_map = PHYS_ADDR(get_pml4());
+    for (u64 page_map_bits = PDPT_BITS; page_map_bits > PAGE_BITS; page_map_bits -= PAGE_MAP_LEVEL_BITS) {
+        u64 entry = page_map[(addr >> page_map_bits) % PAGE_MAP_LEVEL_SIZE];
+        if (!(entry & PAGE_PRESENT) || (entry & PAGE_LARGE))
+            return NULL;
+        page_map = PHYS_ADDR(entry & PAGE_MASK);
+    }
+    return &page_map[ADDR_PTE(addr)];
+}
+
+// Allocate a cleared page for a page table entry reserved with PAGE_LAZY and mark it as present
+static err_t fill_lazy_page_entry(u64 *entry) {
+    u64 page = page_alloc_clear();
+    if (page == 0)
+        return ERR_KERNEL_NO_MEMORY;
+    *entry = (*entry & ~PAGE_LAZY) | page | PAGE_PRESENT;
+    return 0;
+}
+
+// Replace the shared page mapped by a page table entry marked as copy-on-write with a private writable copy
+static err_t copy_cow_page_entry(u64 *entry, u64 addr) {
+    u64 page = page_alloc();
+    if (page == 0)
+        return ERR_KERNEL_NO_MEMORY;
+    memcpy(PHYS_ADDR(page), PHYS_ADDR(*entry & PAGE_MASK), PAGE_SIZE);
+    *entry = (*entry & ~(PAGE_MASK | PAGE_COW | PAGE_SHARED)) | page | PAGE_WRITE;
+    invalidate_user_page(addr);
+    return 0;
+}
+
+// Handle a page fault caused by accessing a user address
+// Non-present pages reserved to be allocated on first access are allocated, and copy-on-write pages are copied on write.
+// Returns true if the fault was resolved and the access can be retried.
+// Returns false if the fault can't be resolved this way, including when there is no memory for the page.
+// Another thread of the process may have resolved the fault or changed the mapping after the faulting access, in which case
+// the access is retried if the entry allows it now. The TLB entry for the page is invalidated first, as it may be out of date.
+// Must be called with interrupts enabled, so that TLB shootdown IPIs can be received while waiting for the page map lock.
+bool handle_user_page_fault(u64 addr, bool present, bool write) {
+    if (addr >= USER_ADDR_UPPER_BOUND || cpu_local->current_process == NULL)
+        return false;
+    bool resolved = false;
+    user_page_map_lock();
+    u64 *entry = get_user_page_entry(addr);
+    if (entry == NULL) {
+        resolved = false;
+    } else if (!present && (*entry & PAGE_LAZY) && (!write || (*entry & PAGE_WRITE))) {
+        resolved = fill_lazy_page_entry(entry) == 0;
+    } else if (present && write && (*entry & PAGE_COW)) {
+        resolved = copy_cow_page_entry(entry, addr) == 0;
+    } else if ((*entry & PAGE_PRESENT) && (!present || (write && (*entry & PAGE_WRITE)))) {
+        invalidate_page(addr);
+        resolved = true;
+    }
+    user_page_map_unlock();
+    return resolved;
+}
+
+// Map the given physical pages in the range starting at `start` with the given flags
+// The new entries must be marked as shared, so that the pages are not freed when the page map is freed.
+// Copy-on-write pages are charged against the memory limit of the process, since they may be copied later.
+static err_t map_shared_pages(u64 start, size_t pages_num, const u64 *pages, u64 flags) {
+    err_t err;
+    if (pages_num > (USER_ADDR_UPPER_BOUND >> PAGE_BITS) || start + pages_num * PAGE_SIZE > USER_ADDR_UPPER_BOUND)
+        return ERR_KERNEL_INVALID_ADDRESS;
+    user_page_map_lock();
+    // The range is first reserved like lazily allocated memory, which fills the page maps without allocating any pages.
+    // Page faults in the range wait for the page map lock, so other threads of the process can't allocate pages
+    // in it before the entries are replaced with the shared ones.
+    u64 reserve_flags = (flags & ~PAGE_PRESENT) | PAGE_LAZY;
+    if (flags & PAGE_COW)
+        err = map_charged_pages(start, pages_num * PAGE_SIZE, reserve_flags);
+    else
+        err = map_pages(start, pages_num * PAGE_SIZE, reserve_flags);
+    if (err) {
+        user_page_map_unlock();
+        return err;
+    }
+    // Point the reserved entries to the shared pages
+    // The entries weren't present, so there is no need to invalidate them.
+    for (size_t i = 0; i < pages_num; i++) {
+        u64 *entry = get_user_page_entry(start + i * PAGE_SIZE);
+        *entry = pages[i] | flags;
+    }
+    user_page_map_unlock();
+    return 0;
+}
+
+// Map the given physical pages in the range starting at `start` as userspace memory
+// The pages are marked as shared, so they are not freed when the page map is freed.
+err_t map_user_shared_pages(u64 start, size_t pages_num, const u64 *pages, bool write, bool execute) {
+    return map_shared_pages(start, pages_num, pages, (execute ? 0 : PAGE_NX) | PAGE_SHARED | PAGE_USER | (write ? PAGE_WRITE : 0) | PAGE_PRESENT);
+}
+
+// Map the given physical pages in the range starting at `start` as copy-on-write userspace memory
+// The pages are mapped as read-only and shared. Writing to a page replaces it with a private copy.
+err_t map_user_cow_pages(u64 start, size_t pages_num, const u64 *pages, bool execute) {
+    return map_shared_pages(start, pages_num, pages, (execute ? 0 : PAGE_NX) | PAGE_COW | PAGE_SHARED | PAGE_USER | PAGE_PRESENT);
+}
+
+// Split the large page mapping a given user address in the current page map into regular pages, if it's mapped by one
+// The pages of the large page stay allocated and can be freed separately afterwards.
+static err_t split_user_large_page(u64 addr) {
+    u64 *page_map = PHYS_ADDR(get_pml4());
+    for (u64 page_map_bits = PDPT_BITS; page_map_bits > PT_BITS; page_map_bits -= PAGE_MAP_LEVEL_BITS) {
+        u64 entry = page_map[(addr >> page_map_bits) % PAGE_MAP_LEVEL_SIZE];
+        if (!(entry & PAGE_PRESENT))
+            return 0;
+        page_map = PHYS_ADDR(entry & PAGE_MASK);
+    }
+    u64 *entry = &page_map[ADDR_PDE(addr)];
+    if (!(*entry & PAGE_PRESENT) || !(*entry & PAGE_LARGE))
+        return 0;
+    // Every entry of the page table is filled, so it doesn't need to be cleared
+    if (user_pages_charge(1))
+        return ERR_KERNEL_NO_MEMORY;
+    u64 page_table = page_alloc();
+    if (page_table == 0) {
+        user_pages_uncharge(1);
+        return ERR_KERNEL_NO_MEMORY;
+    }
+    u64 *page_table_entries = PHYS_ADDR(page_table);
+    for (size_t i = 0; i < PAGE_MAP_LEVEL_SIZE; i++)
+        page_table_entries[i] = (*entry & ~PAGE_LARGE) + i * PAGE_SIZE;
+    *entry = page_table | PAGE_USER | PAGE_WRITE | PAGE_PRESENT;
+    invalidate_user_page(addr);
+    return 0;
+}
+
+// Check if a page map has no entries left
+static bool page_map_empty(const u64 *page_map) {
+    for (size_t i = 0; i < PAGE_MAP_LEVEL_SIZE; i++)
+        if (page_map[i] != 0)
+            return false;
+    return true;
+}
+
+// Pages unmapped from the current page map are only freed once no CPU can access them through its TLB anymore
+// They're collected in a batch, which is freed after the TLB entries are flushed on every CPU, or earlier if it fills up.
+#define UNMAP_FREE_BATCH_SIZE 16
+
+typedef struct UnmapFreeBatch {
+    size_t length;
+    struct {
+        u64 start;
+        u64 pages_num;
+    } blocks[UNMAP_FREE_BATCH_SIZE];
+} UnmapFreeBatch;
+
+// Flush the TLB entries for the current page map on all CPUs and free the pages in a batch
+static void unmap_free_batch_flush(UnmapFreeBatch *batch) {
+    flush_tlb();
+    user_tlb_shootdown();
+    for (size_t i = 0; i < batch->length; i++)
+        page_free_contiguous(batch->blocks[i].start, batch->blocks[i].pages_num);
+    batch->length = 0;
+}
+
+// Add physically contiguous pages to a batch of unmapped pages to be freed
+static void unmap_free_batch_add(UnmapFreeBatch *batch, u64 start, u64 pages_num) {
+    if (batch->length == UNMAP_FREE_BATCH_SIZE)
+        unmap_free_batch_flush(batch);
+    batch->blocks[batch->length].start = start;
+    batch->blocks[batch->length].pages_num = pages_num;
+    batch->length++;
+}
+
+// Unmap the range from `start` to `end` inclusive within a page map at address `page_map` mapping the range starting at `page_map_start` of length `1 << page_map_bits`
+// Pages that are not marked as shared are added to the batch to be freed, and so are page maps that no longer map anything.
+// Pages charged against the memory limit of the current process are uncharged.
+// Large pages must be entirely contained in the range.
+// If `invalidate` is true, each unmapped page is invalidated on the current CPU. `*page_maps_freed` is set if any page map was freed.
+// Assumes that the page map maps addresses for at least part of the range and that all addresses are truncated to 48 bits.
+static void unmap_page_map_range(u64 start, u64 end, u64 *page_map, u64 page_map_start, u64 page_map_bits, bool invalidate, bool *page_maps_freed, UnmapFreeBatch *batch) {
+    u64 mapping_start_index = get_mapping_start_index(start, page_map_start, page_map_bits);
+    u64 mapping_end_index = get_mapping_end_index(end, page_map_start, page_map_bits);
+    for (u64 i = mapping_start_index; i <= mapping_end_index; i++) {
+        u64 entry_start = page_map_start + (i << page_map_bits);
+        if (page_map_bits == PAGE_BITS || (page_map[i] & PAGE_LARGE)) {
+            u64 entry = page_map[i];
+            page_map[i] = 0;
+            if (user_page_entry_charged(entry))
+                user_pages_uncharge(UINT64_C(1) << (page_map_bits - PAGE_BITS));
+            if ((entry & PAGE_PRESENT) && invalidate)
+                invalidate_page(entry_start);
+            if ((entry & PAGE_PRESENT) && !(entry & PAGE_SHARED))
+                unmap_free_batch_add(batch, entry & PAGE_MASK, UINT64_C(1) << (page_map_bits - PAGE_BITS));
+        } else if (page_map[i] & PAGE_PRESENT) {
+            u64 *next_page_map = PHYS_ADDR(page_map[i] & PAGE_MASK);
+            unmap_page_map_range(start, end, next_page_map, entry_start, page_map_bits - 9, invalidate, page_maps_freed, batch);
+            if (page_map_empty(next_page_map)) {
+                u64 next_page_map_addr = page_map[i] & PAGE_MASK;
+                page_map[i] = 0;
+                *page_maps_freed = true;
+                user_pages_uncharge(1);
+                unmap_free_batch_add(batch, next_page_map_addr, 1);
+            }
+        }
+    }
+}
+
+// Unmap the pages in the given range from the current process address space
+// Pages belonging to shared memory objects and cached ELF images are not freed, only unmapped.
+// Large pages crossing the bounds of the range are split into regular pages first.
+err_t unmap_user_pages(u64 start, u64 length) {
+    err_t err;
+    if (start % PAGE_SIZE != 0 || length % PAGE_SIZE != 0)
+        return ERR_KERNEL_INVALID_ARG;
+    if (start + length < start || start + length > USER_ADDR_UPPER_BOUND)
+        return ERR_KERNEL_INVALID_ADDRESS;
+    if (length == 0)
+        return 0;
+    user_page_map_lock();
+    if (start % LARGE_PAGE_SIZE != 0) {
+        err = split_user_large_page(start);
+        if (err)
+            goto fail;
+    }
+    if ((start + length) % LARGE_PAGE_SIZE != 0) {
+        err = split_user_large_page(start + length);
+        if (err)
+            goto fail;
+    }
+    // Past a certain size, flushing the whole TLB is cheaper than invalidating each page
+    // The TLB also has to be flushed if any page maps were freed, as they may still be cached by the processor.
+    bool invalidate = length <= UNMAP_INVALIDATE_PAGES_MAX * PAGE_SIZE;
+    bool page_maps_freed = false;
+    UnmapFreeBatch batch;
+    batch.length = 0;
+    unmap_page_map_range(start, start + length - PAGE_SIZE, PHYS_ADDR(get_pml4()), 0, PDPT_BITS, invalidate, &page_maps_freed, &batch);
+    if (!invalidate || page_maps_freed)
+        flush_tlb();
+    user_tlb_shootdown();
+    for (size_t i = 0; i < batch.length; i++)
+        page_free_contiguous(batch.blocks[i].start, batch.blocks[i].pages_num);
+    user_page_map_unlock();
+    return 0;
+fail:
+    user_page_map_unlock();
+    return err;
 }
 
 // Free all pages used to allocated a page map of a given level located at a given physical address
+// Pages marked as shared are not freed, as they're owned by their shared memory object.
 static void page_map_free_(u64 page_map_addr, u64 level) {
     if (level > 0) {
         u64 *page_map = PHYS_ADDR(page_map_addr);
-        for (size_t i = 0; i < PAGE_MAP_LEVEL_SIZE; i++)
-            if (page_map[i] & PAGE_PRESENT)
+        for (size_t i = 0; i < PAGE_MAP_LEVEL_SIZE; i++) {
+            if (!(page_map[i] & PAGE_PRESENT))
+                continue;
+            if (level == 2 && (page_map[i] & PAGE_LARGE))
+                page_free_contiguous(page_map[i] & PAGE_MASK, PAGE_MAP_LEVEL_SIZE);
+            else if (!(level == 1 && (page_map[i] & PAGE_SHARED)))
                 page_map_free_(page_map[i] & PAGE_MASK, level - 1);
+        }
     }
     page_free(page_map_addr);
 }
 
+// Count the pages used by a page map of a given level located at a given physical address and the page maps below it
+static size_t page_map_count_(u64 page_map_addr, u64 level) {
+    size_t count = 1;
+    if (level > 1) {
+        u64 *page_map = PHYS_ADDR(page_map_addr);
+        for (size_t i = 0; i < PAGE_MAP_LEVEL_SIZE; i++)
+            if ((page_map[i] & PAGE_PRESENT) && !(level == 2 && (page_map[i] & PAGE_LARGE)))
+                count += page_map_count_(page_map[i] & PAGE_MASK, level - 1);
+    }
+    return count;
+}
+
+// Count the pages used by the userspace part of the page map with PML4 located at a given physical address, including the PML4 itself
+size_t page_map_count_pages(u64 page_map_addr) {
+    size_t count = 1;
+    u64 *page_map = PHYS_ADDR(page_map_addr);
+    for (size_t i = 0; i < 0x100; i++)
+        if (page_map[i] & PAGE_PRESENT)
+            count += page_map_count_(page_map[i] & PAGE_MASK, 3);
+    return count;
+}
+
 // Free all pages used to allocate the userspace page map from the page map with PML4 located at a given physical address
 // Does not free the PML4 itself.
 void page_map_free_contents(u64 page_map_addr) {
@@ -293,17 +1125,29 @@ void page_map_free_contents(u64 page_map_addr) {
 
 // Check if the entire range from `start` to `end` inclusive within a page map at address `page_map` mapping the range starting at `page_map_start` of length `1 << page_map_bits` is mapped
 // If `write` is true, also check if write privileges are enabled for the range.
+// Pages reserved to be allocated on first access are allocated, so that the kernel can access them directly.
+// For the same reason, if `write` is true, copy-on-write pages are replaced with private copies.
 // Assumes that the page map maps addresses for at least part of the range and that all addresses are truncated to 48 bits.
 static err_t verify_page_map_range(u64 start, u64 end, u64 *page_map, u64 page_map_start, u64 page_map_bits, bool write) {
     err_t err;
     u64 mapping_start_index = get_mapping_start_index(start, page_map_start, page_map_bits);
     u64 mapping_end_index = get_mapping_end_index(end, page_map_start, page_map_bits);
     for (u64 i = mapping_start_index; i <= mapping_end_index; i++) {
-        if (!(page_map[i] & PAGE_PRESENT))
+        if (!(page_map[i] & (PAGE_PRESENT | PAGE_LAZY)))
             return ERR_KERNEL_INVALID_ADDRESS;
-        if (write && !(page_map[i] & PAGE_WRITE))
+        if (write && !(page_map[i] & (PAGE_WRITE | PAGE_COW)))
             return ERR_KERNEL_INVALID_ADDRESS;
-        if (page_map_bits > PAGE_BITS) {
+        if (page_map[i] & PAGE_LAZY) {
+            err = fill_lazy_page_entry(&page_map[i]);
+            if (err)
+                return err;
+        }
+        if (write && (page_map[i] & PAGE_COW)) {
+            err = copy_cow_page_entry(&page_map[i], page_map_start + (i << page_map_bits));
+            if (err)
+                return err;
+        }
+        if (page_map_bits > PAGE_BITS && !(page_map[i] & PAGE_LARGE)) {
             err = verify_page_map_range(start, end, PHYS_ADDR(page_map[i] & PAGE_MASK), page_map_start + (i << page_map_bits), page_map_bits - 9, write);
             if (err)
                 return err;
@@ -321,7 +1165,74 @@ err_t verify_user_buffer(const void *start, size_t length, bool write) {
         return ERR_KERNEL_INVALID_ADDRESS;
     if (start_addr + length > USER_ADDR_UPPER_BOUND)
         return ERR_KERNEL_INVALID_ADDRESS;
-    return verify_page_map_range(start_addr, start_addr + length - 1, PHYS_ADDR(get_pml4()), 0, PDPT_BITS, write);
+    user_page_map_lock();
+    err_t err = verify_page_map_range(start_addr, start_addr + length - 1, PHYS_ADDR(get_pml4()), 0, PDPT_BITS, write);
+    user_page_map_unlock();
+    return err;
+}
+
+extern size_t uaccess_copy(void *dest, const void *src, size_t n);
+
+// Check that a user buffer is contained within the user address space
+static bool user_range_valid(u64 start, size_t length) {
+    return start + length >= start && start + length <= USER_ADDR_UPPER_BOUND;
+}
+
+// Copy data from a buffer provided by a process into kernel memory
+// The buffer is validated by the copy itself. Page faults on pages that can't be accessed are caught through the exception table.
+// If an error occurs, part of the data may have already been copied.
+err_t copy_from_user(void *dest, const void *src, size_t length) {
+    if (!user_range_valid((u64)src, length))
+        return ERR_KERNEL_INVALID_ADDRESS;
+    if (uaccess_copy(dest, src, length) != 0)
+        return ERR_KERNEL_INVALID_ADDRESS;
+    return 0;
+}
+
+// Copy data from kernel memory into a buffer provided by a process
+// Writes to read-only pages fault, since write protection is enforced in kernel mode.
+// If an error occurs, part of the data may have already been copied.
+err_t copy_to_user(void *dest, const void *src, size_t length) {
+    if (!user_range_valid((u64)dest, length))
+        return ERR_KERNEL_INVALID_ADDRESS;
+    if (uaccess_copy(dest, src, length) != 0)
+        return ERR_KERNEL_INVALID_ADDRESS;
+    return 0;
+}
+
+// Exchange the physical page mapped at a given page-aligned user address in the current page map with another page
+// On success, `*page` is set to the physical address of the page that was previously mapped.
+// Only writable pages that are not part of a large page or a shared memory object can be exchanged.
+// Copy-on-write pages are not writable until they're copied, so they're never exchanged.
+// Returns false if the page can't be exchanged.
+bool exchange_user_page(u64 addr, u64 *page) {
+    user_page_map_lock();
+    u64 *entry = get_user_page_entry(addr);
+    if (entry == NULL || (*entry & (PAGE_SHARED | PAGE_USER | PAGE_WRITE | PAGE_PRESENT)) != (PAGE_USER | PAGE_WRITE | PAGE_PRESENT)) {
+        user_page_map_unlock();
+        return false;
+    }
+    u64 old_page = *entry & PAGE_MASK;
+    *entry = (*entry & ~PAGE_MASK) | *page;
+    *page = old_page;
+    invalidate_user_page(addr);
+    user_page_map_unlock();
+    return true;
+}
+
+// Get the physical address a user address is mapped to if it's part of a shared memory object mapping
+// Copy-on-write mappings are not considered shared, since their contents may diverge from the object.
+// Returns false if the address isn't mapped to a shared memory object.
+bool get_user_shared_addr(u64 addr, u64 *phys_addr) {
+    user_page_map_lock();
+    u64 *entry = get_user_page_entry(addr);
+    if (entry == NULL || (*entry & (PAGE_COW | PAGE_SHARED | PAGE_USER | PAGE_PRESENT)) != (PAGE_SHARED | PAGE_USER | PAGE_PRESENT)) {
+        user_page_map_unlock();
+        return false;
+    }
+    *phys_addr = (*entry & PAGE_MASK) | (addr & (PAGE_SIZE - 1));
+    user_page_map_unlock();
+    return true;
 }
 
 // Remove the identity mapping present when booting from the idle page map
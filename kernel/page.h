@@ -9,10 +9,22 @@
 #define PAGE_PCD (UINT64_C(1) << 4)
 #define PAGE_LARGE (UINT64_C(1) << 7)
 #define PAGE_GLOBAL (UINT64_C(1) << 8)
+// Ignored by the processor - marks pages belonging to a shared memory object, which are not freed along with the page map
+#define PAGE_SHARED (UINT64_C(1) << 9)
+// Ignored by the processor - marks non-present pages that are allocated on first access
+#define PAGE_LAZY (UINT64_C(1) << 10)
+// Ignored by the processor - marks read-only shared pages that are replaced with a private copy on first write
+#define PAGE_COW (UINT64_C(1) << 11)
 #define PAGE_NX (UINT64_C(1) << 63)
 
 #define PAGE_MASK UINT64_C(0x000FFFFFFFFFF000)
 
+// Flags passed to the map_pages and shm_map syscalls
+#define MAP_PAGES_WRITE (UINT64_C(1) << 0)
+#define MAP_PAGES_EXECUTE (UINT64_C(1) << 1)
+// Only accepted by map_pages
+#define MAP_PAGES_LARGE (UINT64_C(1) << 2)
+
 #define PAGE_BITS 12
 #define LARGE_PAGE_BITS 21
 #define PT_BITS 21
@@ -29,6 +41,17 @@
 #define PML4_SIZE (UINT64_C(1) << PML4_BITS)
 #define PAGE_MAP_LEVEL_SIZE (UINT64_C(1) << PAGE_MAP_LEVEL_BITS)
 
+// Number of block sizes handled by the physical page allocator
+// The largest block is a single large page.
+#define PAGE_ORDERS_NUM (LARGE_PAGE_BITS - PAGE_BITS + 1)
+#define LARGE_PAGE_ORDER (LARGE_PAGE_BITS - PAGE_BITS)
+
+// Number of free pages each CPU can hold in its page cache
+#define PAGE_CACHE_SIZE 64
+
+// Maximum number of pages cleared in advance by idle CPUs
+#define ZEROED_PAGES_MAX 512
+
 // Takes an address and fills its first 16 bits with a sign extension of the lower 48 bits
 #define SIGN_EXTEND_ADDR(x) (((((x) >> 47) & 1) ? UINT64_C(0xFFFF000000000000) : 0) | (x & UINT64_C(0x0000FFFFFFFFFFFF)))
 
@@ -45,12 +68,42 @@
 #define ADDR_PDE(x) (((u64)(x) >> PT_BITS) & 0x1FF)
 #define ADDR_PTE(x) (((u64)(x) >> PAGE_BITS) & 0x1FF)
 
+static inline void invalidate_page(u64 addr) {
+    asm volatile ("invlpg [%0]" : : "r"(addr) : "memory");
+}
+
+// Returns the physical address of the current PML4
+// The PCID stored in the lower bits of CR3 is masked out.
 static inline u64 get_pml4(void) {
     u64 pml4;
     asm ("mov %0, cr3" : "=r"(pml4));
-    return pml4;
+    return pml4 & PAGE_MASK;
 }
 
+// Flush all non-global TLB entries of the current address space
+static inline void flush_tlb(void) {
+    u64 cr3;
+    asm volatile ("mov %0, cr3" : "=r"(cr3));
+    asm volatile ("mov cr3, %0" : : "r"(cr3) : "memory");
+}
+
+// When PCIDs are enabled, setting this bit when writing to CR3 prevents the TLB entries of the new PCID from being flushed
+#define CR3_NOFLUSH (UINT64_C(1) << 63)
+
+// Number of address spaces whose TLB entries each CPU keeps using PCIDs
+// PCID 0 is used by the idle page map, and PCIDs from 1 to PCID_SLOTS_NUM by process page maps.
+#define PCID_SLOTS_NUM 8
+
+// An address space assigned to a PCID on a CPU
+// The generation is the value of the page map generation of the process at the time the address space was last loaded.
+typedef struct PCIDSlot {
+    u64 address_space_id;
+    u64 generation;
+} PCIDSlot;
+
+extern bool pcid_enabled;
+extern u64 idle_page_map_cr3;
+
 #define IDENTITY_MAPPING_PML4E UINT64_C(0x102)
 #define IDENTITY_MAPPING_SIZE PDPT_SIZE
 
@@ -66,11 +119,30 @@ static inline u64 get_pml4(void) {
 
 err_t page_alloc_init(void);
 u64 page_alloc(void);
+err_t page_alloc_n(u64 *pages, size_t n);
 u64 page_alloc_clear(void);
+bool page_zero_idle(void);
+u64 page_alloc_block(u64 order);
+u64 page_alloc_contiguous(size_t n);
 void page_free(u64 page);
+void page_free_n(const u64 *pages, size_t n);
+void page_free_contiguous(u64 start, size_t n);
 size_t get_free_memory_size(void);
 err_t map_kernel_pages(u64 start, u64 length, bool write, bool execute);
 err_t map_user_pages(u64 start, u64 length, bool write, bool execute);
+err_t reserve_user_pages(u64 start, u64 length, bool write, bool execute);
+err_t map_user_large_pages(u64 start, u64 length, bool write, bool execute);
+err_t map_user_shared_pages(u64 start, size_t pages_num, const u64 *pages, bool write, bool execute);
+err_t map_user_cow_pages(u64 start, size_t pages_num, const u64 *pages, bool execute);
+err_t unmap_user_pages(u64 start, u64 length);
 void page_map_free_contents(u64 page_map_addr);
+size_t page_map_count_pages(u64 page_map_addr);
 err_t verify_user_buffer(const void *start, size_t length, bool write);
+err_t copy_from_user(void *dest, const void *src, size_t length);
+err_t copy_to_user(void *dest, const void *src, size_t length);
+bool exchange_user_page(u64 addr, u64 *page);
+bool get_user_shared_addr(u64 addr, u64 *phys_addr);
+bool handle_user_page_fault(u64 addr, bool present, bool write);
+void tlb_shootdown_handle(void);
 void remove_identity_mapping(void);
+void pcid_init(void);
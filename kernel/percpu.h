@@ -3,11 +3,20 @@
 #include "types.h"
 #include "error.h"
 
+#include "page.h"
+#include "slab.h"
 #include "spinlock.h"
 
+#include <zr/syscalls.h>
+
 typedef struct Process Process;
 typedef struct TSS TSS;
 
+typedef struct ProcessQueue {
+    Process *start;
+    Process *end;
+} ProcessQueue;
+
 // Per-CPU data
 // Each CPU has one instance of this structure, which is accesses through the GS segment.
 typedef struct PerCPU {
@@ -56,6 +65,42 @@ typedef struct PerCPU {
     u64 tsc_offset;
     // Used to form the list of idle CPU cores
     struct PerCPU *next_cpu;
+    // Used to form the list of all CPU cores taking part in scheduling
+    // Traversed by idle cores looking for processes to steal.
+    struct PerCPU *next_sched_cpu;
+    // Lock for access to `run_queues`
+    spinlock_t run_queue_lock;
+    // Queues of processes ready to run on this CPU, one for each priority
+    ProcessQueue run_queues[PROCESS_PRIORITIES_NUM];
+    // Priority of the currently running process
+    ProcessPriority current_priority;
+    // Set when a process with higher priority than the current one is added to the queue
+    // The current process is then preempted as soon as preemption is enabled.
+    bool reschedule_pending;
+    // TSC value at which the timeslice donated by the previous process ends
+    // Set by process_switch_to() and used instead of a full timeslice for the next process. Zero if not set.
+    u64 donated_timeslice_end;
+    // Free objects of each slab allocator size class available to this CPU
+    SlabMagazine slab_magazines[SLAB_SIZE_CLASSES_NUM];
+    // Number of pages in `page_cache`
+    u64 page_cache_length;
+    // Free pages available to this CPU without accessing the global page stack
+    u64 page_cache[PAGE_CACHE_SIZE];
+    // Address spaces assigned to each PCID used for process page maps on this CPU
+    PCIDSlot pcid_slots[PCID_SLOTS_NUM];
+    // Index of the slot reassigned when an address space without a PCID on this CPU is loaded
+    u64 pcid_next_slot;
+    // Process whose FPU state is loaded in the FPU registers
+    // The state is only up to date if this CPU is also the `fpu_cpu` of the process.
+    // NULL if the FPU registers were last used by the kernel.
+    Process *fpu_owner;
+    // Address space ID of the page map last loaded by a process running on this CPU
+    // Used to find the CPUs that have to flush their TLB when the page map of a process with multiple threads is changed.
+    u64 loaded_address_space_id;
+    // Number of TLB shootdown requests sent to this CPU
+    _Atomic u64 tlb_shootdown_requests;
+    // Value of `tlb_shootdown_requests` up to which the requests were completed by flushing the TLB
+    _Atomic u64 tlb_shootdown_done;
 } PerCPU;
 
 #define cpu_local ((__seg_gs PerCPU *)0)
@@ -13,6 +13,7 @@
 #include "percpu.h"
 #include "resource.h"
 #include "segment.h"
+#include "slab.h"
 #include "smp.h"
 #include "spinlock.h"
 #include "stack.h"
@@ -35,13 +36,43 @@ typedef struct FXSAVEArea {
     u64 reserved[12];
 } FXSAVEArea;
 
+#define CPUID_XSAVE (1 << 26)
+#define CPUID_AVX (1 << 28)
+#define CPUID_XSAVEOPT (1 << 0)
+#define CR0_TS (UINT64_C(1) << 3)
+#define CR4_OSXSAVE (UINT64_C(1) << 18)
+#define XCR0_X87 (UINT64_C(1) << 0)
+#define XCR0_SSE (UINT64_C(1) << 1)
+#define XCR0_AVX (UINT64_C(1) << 2)
+
+// The FPU state of a process is stored in the FXSAVE format, or the XSAVE format if the CPU supports it along with AVX
+// The legacy part of both formats is the same, and an XSAVE area with a zeroed header represents the initial state
+// of the AVX registers, so both formats are initialized the same way.
+// The XSAVE area used for x87, SSE, and AVX state takes up 832 bytes, which fits in a slab object aligned to 64 bytes.
+static bool xsave_enabled = false;
+static bool xsaveopt_supported = false;
+static size_t fpu_state_size = sizeof(FXSAVEArea);
+
 extern u8 process_start[];
+extern u8 thread_start[];
 
-static spinlock_t scheduler_lock;
+// Each CPU has its own queue of processes ready to run, stored in its per-CPU data.
+// A CPU that runs out of processes in its own queue takes processes from the queues of other CPUs.
 
-static ProcessQueue scheduler_queue;
+// Lock for access to `idle_core_list`
+static spinlock_t idle_core_list_lock;
+// List of CPUs that are halted and waiting for a wakeup IPI
 static PerCPU *idle_core_list;
 
+// Lock for adding CPUs to `sched_cpu_list`
+static spinlock_t sched_cpu_list_lock;
+// List of all CPUs taking part in scheduling
+PerCPU *sched_cpu_list;
+
+// Timeslice length for each priority, in units of a quarter of the base timeslice length
+// Higher priority processes are expected to block quickly, so they get shorter timeslices.
+static const u64 priority_timeslice_quarters[PROCESS_PRIORITIES_NUM] = {1, 2, 4, 8};
+
 // Add a process to the end of a queue
 void process_queue_add(ProcessQueue *queue, Process *process) {
     process->next_process = NULL;
@@ -54,6 +85,14 @@ void process_queue_add(ProcessQueue *queue, Process *process) {
     }
 }
 
+// Add a process to the start of a queue
+void process_queue_add_front(ProcessQueue *queue, Process *process) {
+    process->next_process = queue->start;
+    if (queue->start == NULL)
+        queue->end = process;
+    queue->start = process;
+}
+
 // Remove a process from the start of a queue and return it
 // If the queue is empty, returns NULL.
 Process *process_queue_remove(ProcessQueue *queue) {
@@ -64,63 +103,129 @@ Process *process_queue_remove(ProcessQueue *queue) {
     return process;
 }
 
-// Create a new process
-// The process is not placed in the queue and its stack is not initialized.
-err_t process_create(Process **process_ptr, ResourceList resources) {
+static spinlock_t address_space_id_lock;
+static u64 next_address_space_id = 1;
+
+// Allocate a thread belonging to a given thread group
+// The thread is not counted in the thread group, placed in the queue, or given a stack.
+static err_t thread_alloc(Process **process_ptr, ThreadGroup *group) {
     err_t err;
     // Allocate a process control block
-    Process *process = malloc(sizeof(Process));
+    Process *process = slab_alloc(sizeof(Process));
     if (process == NULL) {
         err = ERR_KERNEL_NO_MEMORY;
         goto fail_process_alloc;
     }
     // Allocate the FXSAVE area and initialize it with default values
-    process->fxsave_area = malloc(sizeof(FXSAVEArea));
+    process->fxsave_area = slab_alloc(fpu_state_size);
     if (process->fxsave_area == NULL) {
         err = ERR_KERNEL_NO_MEMORY;
         goto fail_fxsave_area_alloc;
     }
-    memset(process->fxsave_area, 0, sizeof(FXSAVEArea));
+    memset(process->fxsave_area, 0, fpu_state_size);
+    process->fpu_cpu = NULL;
     process->fxsave_area->fcw = 0x037F;
     process->fxsave_area->mxcsr = 0x00001F80u;
+    // Allocate a kernel stack
+    process->kernel_stack = stack_alloc();
+    if (process->kernel_stack == NULL) {
+        err = ERR_KERNEL_NO_MEMORY;
+        goto fail_stack_alloc;
+    }
+    // Intialize remaining fields
+    process->group = group;
+    process->running_time = 0;
+    process_set_priority(process, PROCESS_PRIORITY_NORMAL);
+    process->in_timeout_queue = false;
+    process->timeout_cpu = NULL;
+    *process_ptr = process;
+    return 0;
+fail_stack_alloc:
+    slab_free(process->fxsave_area, fpu_state_size);
+fail_fxsave_area_alloc:
+    slab_free(process, sizeof(Process));
+fail_process_alloc:
+    return err;
+}
+
+// Create a new process with a single thread
+// The process is not placed in the queue and its stack is not initialized.
+err_t process_create(Process **process_ptr, ResourceList resources) {
+    err_t err;
+    // Allocate the state shared by the threads of the process
+    ThreadGroup *group = slab_alloc(sizeof(ThreadGroup));
+    if (group == NULL) {
+        err = ERR_KERNEL_NO_MEMORY;
+        goto fail_group_alloc;
+    }
     // Allocate a process page map
     u64 page_map = page_alloc_clear();
     if (page_map == 0) {
         err = ERR_KERNEL_NO_MEMORY;
         goto fail_page_map_alloc;
     }
-    process->page_map = page_map;
+    group->page_map = page_map;
     // Copy the kernel mappings
     memcpy((u64 *)PHYS_ADDR(page_map) + 0x100, (u64 *)PHYS_ADDR(get_pml4()) + 0x100, 0x100 * 8);
-    // Allocate a kernel stack
-    process->kernel_stack = stack_alloc();
-    if (process->kernel_stack == NULL) {
-        err = ERR_KERNEL_NO_MEMORY;
-        goto fail_stack_alloc;
-    }
     // Initialize the handle list
-    err = handle_list_init(&process->handles);
+    err = handle_list_init(&group->handles);
     if (err)
         goto fail_handle_list_init;
+    // Allocate the first thread
+    Process *process;
+    err = thread_alloc(&process, group);
+    if (err)
+        goto fail_thread_alloc;
     // Intialize remaining fields
-    process->running_time = 0;
-    process->resources = resources;
-    process->in_timeout_queue = false;
-    process->timeout_cpu = NULL;
+    group->lock = SPINLOCK_FREE;
+    group->threads_num = 1;
+    group->page_map_lock = SPINLOCK_FREE;
+    group->resources = resources;
+    group->shm_mappings = NULL;
+    group->charged_shms = NULL;
+    group->elf_image = NULL;
+    group->max_priority = process->priority;
+    group->contents_freed = false;
+    spinlock_acquire(&address_space_id_lock);
+    group->address_space_id = next_address_space_id++;
+    spinlock_release(&address_space_id_lock);
+    group->page_map_generation = 0;
+    // Set the memory limit if one was passed as a resource
+    group->memory_pages = 0;
+    group->memory_limit = SIZE_MAX;
+    const Message *memory_limit = resource_list_get_message(&group->resources, &resource_name(PROCESS_MEMORY_LIMIT_RESOURCE));
+    if (memory_limit != NULL && memory_limit->data_pages == NULL && memory_limit->data_size == sizeof(size_t))
+        group->memory_limit = *(size_t *)memory_limit->data;
     *process_ptr = process;
     return 0;
+fail_thread_alloc:
+    handle_list_free(&group->handles);
 fail_handle_list_init:
-    stack_free(process->kernel_stack);
-fail_stack_alloc:
-    page_free(process->page_map);
+    page_free(group->page_map);
 fail_page_map_alloc:
-    free(process->fxsave_area);
-fail_fxsave_area_alloc:
-    free(process);
-fail_process_alloc:
+    slab_free(group, sizeof(ThreadGroup));
+fail_group_alloc:
     return err;
 }
 
+// Create a new thread of the current process
+// The thread shares the page map, handles and resources of the process and starts with the same priority as the current thread.
+// The thread is not placed in the queue and its stack is not initialized.
+err_t process_create_thread(Process **process_ptr) {
+    err_t err;
+    ThreadGroup *group = cpu_local->current_process->group;
+    Process *process;
+    err = thread_alloc(&process, group);
+    if (err)
+        return err;
+    process_set_priority(process, cpu_local->current_process->priority);
+    spinlock_acquire(&group->lock);
+    group->threads_num++;
+    spinlock_release(&group->lock);
+    *process_ptr = process;
+    return 0;
+}
+
 // Set up the stack for a user process running a given executable file
 // The message passed, if not NULL, will be freed after the process is loaded.
 void process_set_user_stack(Process *process, const u8 *file, size_t file_length, Message *message) {
@@ -142,6 +247,26 @@ void process_set_user_stack(Process *process, const u8 *file, size_t file_length
     process->rsp = rsp;
 }
 
+// Set up the stack for a new thread of a user process starting at a given entry point
+// The argument is passed to the entry point in RDI, and the user stack pointer is set to `stack`.
+void process_set_thread_stack(Process *process, void *entry_point, void *arg, void *stack) {
+    u64 *rsp = process->kernel_stack;
+    // Arguments to thread_start()
+    *--rsp = (u64)stack;
+    *--rsp = (u64)arg;
+    *--rsp = (u64)entry_point;
+    // Used by process_switch() - same as in process_set_user_stack(), but with a different entry point
+    *--rsp = (u64)thread_start;
+    *--rsp = 0;
+    *--rsp = 0;
+    *--rsp = 0;
+    *--rsp = 0;
+    *--rsp = 0;
+    *--rsp = 0;
+    *--rsp = 1;
+    process->rsp = rsp;
+}
+
 // Set up the stack for a kernel thread with a given entry point
 void process_set_kernel_stack(Process *process, void *entry_point) {
     u64 *rsp = process->kernel_stack;
@@ -157,26 +282,77 @@ void process_set_kernel_stack(Process *process, void *entry_point) {
     process->rsp = rsp;
 }
 
+// Set the priority of a process and the corresponding timeslice length
+// If the process is already running or in a queue, the change takes effect the next time it's scheduled.
+void process_set_priority(Process *process, ProcessPriority priority) {
+    process->priority = priority;
+    process->timeslice_length = timeslice_length * priority_timeslice_quarters[priority] / 4;
+}
+
+// Register the current CPU with the scheduler
+// Must be called after the per-CPU data is initialized and before the scheduler is started on any CPU.
+void sched_cpu_init(void) {
+    spinlock_acquire(&sched_cpu_list_lock);
+    cpu_local->next_sched_cpu = sched_cpu_list;
+    sched_cpu_list = cpu_local->self;
+    spinlock_release(&sched_cpu_list_lock);
+}
+
 // Add a process to the queue of running processes
+// The process is placed in the queue of an idle CPU if there is one, or the queue of the current CPU otherwise.
+// If the process is placed in the queue of the current CPU and has a higher priority than the current process,
+// the current process is preempted as soon as possible.
 void process_enqueue(Process *process) {
-    spinlock_acquire(&scheduler_lock);
-    // Add the process to end of the queue
-    process_queue_add(&scheduler_queue, process);
-    // Wake up an idle core if there is one
+    // Preemption is disabled so that the chosen idle CPU is not left waiting if the current process is preempted
+    preempt_disable();
+    // Take an idle core from the list if there is one
+    // The list is first checked without the lock to avoid contention in the common case where no cores are idle.
+    PerCPU *idle_cpu = NULL;
     if (idle_core_list != NULL) {
-        send_wakeup_ipi(idle_core_list->lapic_id);
-        idle_core_list = idle_core_list->next_cpu;
+        spinlock_acquire(&idle_core_list_lock);
+        idle_cpu = idle_core_list;
+        if (idle_cpu != NULL)
+            idle_core_list = idle_cpu->next_cpu;
+        spinlock_release(&idle_core_list_lock);
     }
-    spinlock_release(&scheduler_lock);
+    // Add the process to end of the queue
+    PerCPU *cpu = idle_cpu != NULL ? idle_cpu : cpu_local->self;
+    spinlock_acquire(&cpu->run_queue_lock);
+    process_queue_add(&cpu->run_queues[process->priority], process);
+    spinlock_release(&cpu->run_queue_lock);
+    if (idle_cpu != NULL) {
+        // Wake up the idle core
+        send_wakeup_ipi(idle_cpu->lapic_id);
+    } else if (process->priority < cpu_local->current_priority) {
+        // Request preemption of the current process
+        // If we're in an interrupt handler or interrupts are disabled, preemption can't happen when it's re-enabled below.
+        // In that case, the wakeup IPI sent to the current CPU will perform the preemption once interrupts are enabled.
+        cpu_local->reschedule_pending = true;
+        send_wakeup_ipi(cpu_local->lapic_id);
+    }
+    preempt_enable();
+}
+
+// Unblock a process that was waiting on the current process and switch to it directly
+// This avoids a full round through the queue when replying to a synchronous call.
+// The current process is placed at the front of the queue and the unblocked process runs for the rest of its timeslice.
+// If the unblocked process has lower priority than the current process, it's added to the queue as usual instead.
+// Must be called with no locks held.
+void process_enqueue_handoff(Process *process) {
+    if (process->priority > cpu_local->current_process->priority) {
+        process_enqueue(process);
+        return;
+    }
+    process_switch_to(process);
 }
 
 // Set up the initial processes
 err_t process_setup(void) {
     err_t err;
-    process_spawn_mqueue = mqueue_alloc();
+    process_spawn_mqueue = mqueue_alloc(MQUEUE_DEFAULT_MAX_LENGTH, MQUEUE_DEFAULT_MAX_DATA_SIZE);
     if (process_spawn_mqueue == NULL)
         return ERR_KERNEL_NO_MEMORY;
-    ahci_main_mqueue = mqueue_alloc();
+    ahci_main_mqueue = mqueue_alloc(MQUEUE_DEFAULT_MAX_LENGTH, MQUEUE_DEFAULT_MAX_DATA_SIZE);
     if (ahci_main_mqueue == NULL)
         return ERR_KERNEL_NO_MEMORY;
     framebuffer_redraw_channel = channel_alloc();
@@ -213,6 +389,8 @@ err_t process_setup(void) {
     err = process_create(&process_spawn_kernel_thread, (ResourceList){0, NULL});
     if (err)
         return err;
+    // The framebuffer thread runs at realtime priority so that frames are presented on time under load
+    process_set_priority(framebuffer_kernel_thread, PROCESS_PRIORITY_REALTIME);
     process_set_kernel_stack(framebuffer_kernel_thread, framebuffer_kernel_thread_main);
     process_set_kernel_stack(ahci_main_kernel_thread, ahci_main_kernel_thread_main);
     process_set_kernel_stack(process_spawn_kernel_thread, process_spawn_kernel_thread_main);
@@ -269,57 +447,322 @@ err_t process_setup(void) {
     return 0;
 }
 
-// Free the current process
+// Enable saving the extended processor state with XSAVE on the current CPU if it's supported, along with AVX
+// Must be called on every CPU before any process is created.
+void fpu_init(void) {
+    u32 cpuid_1_ecx;
+    asm ("mov eax, 1; cpuid" : "=c"(cpuid_1_ecx) : : "eax", "ebx", "edx");
+    if (!(cpuid_1_ecx & CPUID_XSAVE) || !(cpuid_1_ecx & CPUID_AVX))
+        return;
+    u64 cr4;
+    asm volatile ("mov %0, cr4" : "=r"(cr4));
+    asm volatile ("mov cr4, %0" : : "r"(cr4 | CR4_OSXSAVE));
+    u64 xcr0 = XCR0_X87 | XCR0_SSE | XCR0_AVX;
+    asm volatile ("xsetbv" : : "c"(0), "a"((u32)xcr0), "d"((u32)(xcr0 >> 32)));
+    u32 xsave_size, cpuid_d_1_eax;
+    asm ("cpuid" : "=b"(xsave_size) : "a"(0x0D), "c"(0) : "edx");
+    asm ("cpuid" : "=a"(cpuid_d_1_eax) : "a"(0x0D), "c"(1) : "ebx", "edx");
+    xsave_enabled = true;
+    xsaveopt_supported = (cpuid_d_1_eax & CPUID_XSAVEOPT) != 0;
+    fpu_state_size = xsave_size;
+}
+
+static inline u64 cr0_get(void) {
+    u64 cr0;
+    asm volatile ("mov %0, cr0" : "=r"(cr0));
+    return cr0;
+}
+
+// Save the FPU state of the current process if it's loaded
+// Called when the process stops running. The state is saved even though it stays loaded, since the process may run on another CPU next.
+// With XSAVEOPT, components that weren't modified since they were last restored are not written.
+void process_fpu_save(void) {
+    Process *process = cpu_local->current_process;
+    if (cpu_local->fpu_owner != process || (cr0_get() & CR0_TS))
+        return;
+    if (xsaveopt_supported)
+        asm volatile ("xsaveopt64 [%0]" : : "r"(process->fxsave_area), "a"(UINT32_MAX), "d"(UINT32_MAX) : "memory");
+    else if (xsave_enabled)
+        asm volatile ("xsave64 [%0]" : : "r"(process->fxsave_area), "a"(UINT32_MAX), "d"(UINT32_MAX) : "memory");
+    else
+        asm volatile ("fxsave64 [%0]" : : "r"(process->fxsave_area) : "memory");
+}
+
+// Enable or disable the FPU for the process that was switched to
+// If the FPU registers of the current CPU still hold the state of the process, the FPU is enabled right away.
+// Otherwise, the TS flag is set, so that the state is restored by process_fpu_restore() once the process uses the FPU.
+// Processes that never use the FPU then don't have their FPU state saved or restored at all.
+void process_fpu_switch(void) {
+    Process *process = cpu_local->current_process;
+    bool loaded = cpu_local->fpu_owner == process && process->fpu_cpu == cpu_local->self;
+    u64 cr0 = cr0_get();
+    if (loaded && (cr0 & CR0_TS))
+        asm volatile ("clts");
+    else if (!loaded && !(cr0 & CR0_TS))
+        asm volatile ("mov cr0, %0" : : "r"(cr0 | CR0_TS));
+}
+
+// Restore the FPU state of the current process after it tried to use the FPU with the TS flag set
+// Called by the device-not-available exception handler.
+void process_fpu_restore(void) {
+    asm volatile ("clts");
+    Process *process = cpu_local->current_process;
+    PerCPU *self = cpu_local->self;
+    if (process == NULL || (self->fpu_owner == process && process->fpu_cpu == self))
+        return;
+    if (xsave_enabled)
+        asm volatile ("xrstor64 [%0]" : : "r"(process->fxsave_area), "a"(UINT32_MAX), "d"(UINT32_MAX) : "memory");
+    else
+        asm volatile ("fxrstor64 [%0]" : : "r"(process->fxsave_area) : "memory");
+    self->fpu_owner = process;
+    process->fpu_cpu = self;
+}
+
+// Get statistics about the memory used by a process
+// The kernel heap size counts the control blocks and FPU state areas of all threads of the process.
+void process_get_memory_stats(Process *process, ProcessMemoryStats *stats) {
+    ThreadGroup *group = process->group;
+    spinlock_acquire(&group->lock);
+    size_t kernel_heap_size = sizeof(ThreadGroup) + group->threads_num * (sizeof(Process) + fpu_state_size);
+    for (SharedMemoryMapping *mapping = group->shm_mappings; mapping != NULL; mapping = mapping->next_mapping)
+        kernel_heap_size += sizeof(SharedMemoryMapping);
+    spinlock_release(&group->lock);
+    spinlock_acquire(&group->handles.lock);
+    kernel_heap_size += group->handles.length * sizeof(HandleSlot);
+    for (size_t i = 0; i < group->handles.length; i++) {
+        if (group->handles.handles[i].handle.type != HANDLE_TYPE_MESSAGE)
+            continue;
+        const Message *message = group->handles.handles[i].handle.message;
+        kernel_heap_size += sizeof(Message) + message->data_size + message->handles_size * sizeof(AttachedHandle);
+    }
+    size_t handles_num = group->handles.length - group->handles.free_handles;
+    spinlock_release(&group->handles.lock);
+    spinlock_acquire(&group->page_map_lock);
+    size_t page_map_pages = page_map_count_pages(group->page_map);
+    size_t pages = group->memory_pages;
+    spinlock_release(&group->page_map_lock);
+    *stats = (ProcessMemoryStats){
+        .pages = pages,
+        .pages_limit = group->memory_limit,
+        .page_map_pages = page_map_pages,
+        .kernel_heap_size = kernel_heap_size,
+        .handles_num = handles_num,
+    };
+}
+
+// Allow the kernel to use SSE and AVX instructions until kernel_fpu_end() is called
+// The FPU state of the current process is saved first and restored once the process uses the FPU again.
+// Preemption is disabled until kernel_fpu_end(), so the FPU state of the kernel never has to be saved.
+void kernel_fpu_begin(void) {
+    preempt_disable();
+    if (cpu_local->current_process != NULL)
+        process_fpu_save();
+    cpu_local->fpu_owner = NULL;
+    asm volatile ("clts" : : : "memory");
+}
+
+// Stop using the FPU in the kernel
+// The TS flag is set, so that the current process restores its state through a device-not-available exception.
+void kernel_fpu_end(void) {
+    asm volatile ("mov cr0, %0" : : "r"(cr0_get() | CR0_TS) : "memory");
+    preempt_enable();
+}
+
+// Load the page map of the current process
+// If PCIDs are enabled, each CPU assigns PCIDs to the address spaces it ran most recently, so switching back to one of them
+// keeps its TLB entries. They're only flushed if the page map was changed since the CPU last loaded it.
+// Called when switching processes with interrupts disabled.
+void process_load_page_map(void) {
+    ThreadGroup *group = cpu_local->current_process->group;
+    // Record the loaded address space before reading its page map generation
+    // Paired with the barrier in tlb_shootdown(), so that a CPU changing the page map either sees that this CPU has it loaded
+    // and sends it a TLB shootdown IPI, or has already incremented the generation read below.
+    cpu_local->loaded_address_space_id = group->address_space_id;
+    atomic_thread_fence(memory_order_seq_cst);
+    u64 cr3;
+    if (!pcid_enabled) {
+        cr3 = group->page_map;
+    } else {
+        PerCPU *self = cpu_local->self;
+        u64 slot_i;
+        for (slot_i = 0; slot_i < PCID_SLOTS_NUM; slot_i++)
+            if (self->pcid_slots[slot_i].address_space_id == group->address_space_id)
+                break;
+        if (slot_i < PCID_SLOTS_NUM) {
+            bool flush = self->pcid_slots[slot_i].generation != group->page_map_generation;
+            self->pcid_slots[slot_i].generation = group->page_map_generation;
+            cr3 = group->page_map | (slot_i + 1) | (flush ? 0 : CR3_NOFLUSH);
+        } else {
+            // Reassign the least recently assigned PCID and flush its entries
+            slot_i = self->pcid_next_slot;
+            self->pcid_next_slot = (slot_i + 1) % PCID_SLOTS_NUM;
+            self->pcid_slots[slot_i] = (PCIDSlot){group->address_space_id, group->page_map_generation};
+            cr3 = group->page_map | (slot_i + 1);
+        }
+    }
+    asm volatile ("mov cr3, %0" : : "r"(cr3) : "memory");
+}
+
+// Free the page map contents, handles, resources and shared memory mappings of a thread group
+static void thread_group_free_contents(ThreadGroup *group) {
+    page_map_free_contents(group->page_map);
+    shm_mappings_free(group);
+    shm_charges_free(group);
+    if (group->elf_image != NULL)
+        elf_image_del_ref(group->elf_image);
+    handle_list_free(&group->handles);
+    resource_list_free(&group->resources);
+    group->contents_freed = true;
+}
+
+// Free the contents of the current process if the current thread is the only one left
 // Does not free any information that is necessary to switch to the process when it's running in kernel mode,
 // as it needs to be freed separately and with interrupts disabled.
+// If other threads are still running, the contents are instead freed in process_free() by the last thread to exit.
 void process_free_contents(void) {
-    page_map_free_contents(cpu_local->current_process->page_map);
-    handle_list_free(&cpu_local->current_process->handles);
-    resource_list_free(&cpu_local->current_process->resources);
+    ThreadGroup *group = cpu_local->current_process->group;
+    // New threads are only created by threads of the same process, so the count can't change if this is the only thread
+    if (group->threads_num == 1)
+        thread_group_free_contents(group);
+}
+
+// Free the remaining parts of a process control block after its contents were freed
+// If this is the last thread of the process, the state shared by its threads is freed as well.
+// Called with interrupts disabled after switching to the idle stack and page map.
+void process_free(Process *process) {
+    ThreadGroup *group = process->group;
+    spinlock_acquire(&group->lock);
+    bool last_thread = --group->threads_num == 0;
+    spinlock_release(&group->lock);
+    if (last_thread) {
+        if (!group->contents_freed)
+            thread_group_free_contents(group);
+        page_free(group->page_map);
+        slab_free(group, sizeof(ThreadGroup));
+    }
+    slab_free(process->fxsave_area, fpu_state_size);
+    slab_free(process, sizeof(Process));
+}
+
+// Remove the highest priority process from the queues of a CPU and return it
+// Only processes with priority at least as high as `lowest_priority` are considered.
+// Returns NULL if there is no such process.
+// Must be called with the CPU's queue lock held.
+static Process *run_queue_remove(PerCPU *cpu, ProcessPriority lowest_priority) {
+    for (ProcessPriority priority = 0; priority <= lowest_priority; priority++) {
+        Process *process = process_queue_remove(&cpu->run_queues[priority]);
+        if (process != NULL)
+            return process;
+    }
+    return NULL;
+}
+
+// Check if the queues of a CPU are all empty without taking the lock
+// The result may be out of date by the time it's used.
+static bool run_queue_empty(PerCPU *cpu) {
+    for (ProcessPriority priority = 0; priority < PROCESS_PRIORITIES_NUM; priority++)
+        if (cpu->run_queues[priority].start != NULL)
+            return false;
+    return true;
+}
+
+// Take a process from the queue of another CPU
+// Other CPUs are visited in order starting from the one after the current CPU in the list, so that different CPUs
+// don't all try to take processes from the same queue.
+// Returns NULL if there are no processes waiting in the queues of other CPUs.
+static Process *sched_steal_process(void) {
+    PerCPU *self = cpu_local->self;
+    for (PerCPU *cpu = self->next_sched_cpu != NULL ? self->next_sched_cpu : sched_cpu_list; cpu != self;
+            cpu = cpu->next_sched_cpu != NULL ? cpu->next_sched_cpu : sched_cpu_list) {
+        // Skip empty queues without taking the lock
+        if (run_queue_empty(cpu))
+            continue;
+        spinlock_acquire(&cpu->run_queue_lock);
+        Process *process = run_queue_remove(cpu, PROCESS_PRIORITY_LOW);
+        spinlock_release(&cpu->run_queue_lock);
+        if (process != NULL)
+            return process;
+    }
+    return NULL;
 }
 
 // Set `cpu_local->current_process` to the next process in the queue
-// The current process is not returned to the queue.
+// The highest priority process is chosen. The current process is not returned to the queue.
+// If the queue of the current CPU is empty, a process is taken from another CPU.
+// If there are no processes to run, waits until one is added to the queue.
 // Must be called with interrupts disabled.
 void sched_replace_process(void) {
-    spinlock_acquire(&scheduler_lock);
-    // Get a process from the queue
-    // If the queue is empty, wait until it isn't
-    while ((cpu_local->current_process = process_queue_remove(&scheduler_queue)) == NULL) {
-        // If there are no processes in the queue, add the CPU to the idle CPU list
-        cpu_local->next_cpu = idle_core_list;
-        idle_core_list = cpu_local->self;
-        spinlock_release(&scheduler_lock);
+    PerCPU *self = cpu_local->self;
+    while (1) {
+        // Get a process from the queue
+        spinlock_acquire(&self->run_queue_lock);
+        Process *process = run_queue_remove(self, PROCESS_PRIORITY_LOW);
+        spinlock_release(&self->run_queue_lock);
+        // If the queue is empty, try to take a process from another CPU
+        if (process == NULL)
+            process = sched_steal_process();
+        if (process != NULL) {
+            cpu_local->current_process = process;
+            cpu_local->current_priority = process->priority;
+            cpu_local->reschedule_pending = false;
+            return;
+        }
+        // If there are no processes to run, add the CPU to the idle CPU list
+        // Since interrupts are disabled, no process can be added to this CPU's queue until it's in the idle list.
+        spinlock_acquire(&idle_core_list_lock);
+        self->next_cpu = idle_core_list;
+        idle_core_list = self;
         // The idle flag is set and will only be cleared by a wakeup IPI.
         cpu_local->idle = true;
+        spinlock_release(&idle_core_list_lock);
         // Preemption is disabled since interrupts are enabled while waiting but there is no valid process.
         preempt_disable();
         // Wait for a wakeup IPI to occur
+        // While waiting, free pages are cleared in advance one at a time, with pending interrupts handled after each one.
+        // Once there are no more pages to clear, the CPU halts.
         // The HLT instruction has to immediately follow an STI to avoid a race condition where an interrupt occurs before HLT.
         // The effect of STI is always delayed by at least one instruction, so the interrupt can't occur before the HLT.
-        while (cpu_local->idle)
-            asm volatile ("sti; hlt; cli");
+        while (cpu_local->idle) {
+            if (page_zero_idle())
+                asm volatile ("sti; nop; cli");
+            else
+                asm volatile ("sti; hlt; cli");
+        }
         preempt_enable();
-        spinlock_acquire(&scheduler_lock);
     }
-    spinlock_release(&scheduler_lock);
+}
+
+// Return the current process to the front of the queue and set `cpu_local->current_process` to the given process
+// Used by process_switch_to(), so that the current process runs again once the process it switched to stops running.
+void sched_handoff_process(Process *process) {
+    PerCPU *self = cpu_local->self;
+    spinlock_acquire(&self->run_queue_lock);
+    process_queue_add_front(&self->run_queues[cpu_local->current_process->priority], cpu_local->current_process);
+    cpu_local->current_process = process;
+    cpu_local->current_priority = process->priority;
+    spinlock_release(&self->run_queue_lock);
 }
 
 // Return the current process to the end of the queue and set `cpu_local->current_process` to the next process in the queue
-// The current scheduler is a basic round-robin scheduler.
+// Processes are run in round-robin order within each priority. A process is only replaced by one with the same or higher priority.
+// Lower priority processes only run when there are no higher priority processes ready to run.
+// Only the queue of the current CPU is considered, since the current process can continue running if it's empty.
 void sched_switch_process(void) {
-    spinlock_acquire(&scheduler_lock);
+    PerCPU *self = cpu_local->self;
+    spinlock_acquire(&self->run_queue_lock);
+    cpu_local->reschedule_pending = false;
     // Get the next process from the queue
-    Process *next_process = process_queue_remove(&scheduler_queue);
+    Process *next_process = run_queue_remove(self, cpu_local->current_process->priority);
     // If there are no other processes to run, return to the current process
     if (next_process == NULL) {
-        spinlock_release(&scheduler_lock);
+        spinlock_release(&self->run_queue_lock);
         return;
     }
     // Add the current process to the queue and replace it with the new process
-    process_queue_add(&scheduler_queue, cpu_local->current_process);
+    process_queue_add(&self->run_queues[cpu_local->current_process->priority], cpu_local->current_process);
     cpu_local->current_process = next_process;
-    spinlock_release(&scheduler_lock);
+    cpu_local->current_priority = next_process->priority;
+    spinlock_release(&self->run_queue_lock);
 }
 
 Process *process_spawn_kernel_thread;
@@ -345,6 +788,10 @@ _Noreturn void process_spawn_kernel_thread_main(void) {
         Message *message;
         // Get message from user process
         mqueue_receive(process_spawn_mqueue, &message, false, false, TIMEOUT_NONE);
+        if (message_linearize(message)) {
+            err = ERR_NO_MEMORY;
+            goto fail;
+        }
         size_t message_offset = 0;
         if (message->data_size < sizeof(size_t)) {
             err = ERR_INVALID_ARG;
@@ -357,6 +804,13 @@ _Noreturn void process_spawn_kernel_thread_main(void) {
             err = ERR_INVALID_ARG;
             goto fail;
         }
+        // Only channels can be passed as resources
+        for (size_t i = 0; i < message->handles_size; i++) {
+            if (message->handles[i].type == ATTACHED_HANDLE_TYPE_SHARED_MEMORY) {
+                err = ERR_INVALID_ARG;
+                goto fail;
+            }
+        }
         // Create resource list
         ResourceListEntry *resources = malloc(resources_size * sizeof(ResourceListEntry));
         if (resources_size != 0 && resources == NULL) {
@@ -401,6 +855,8 @@ fail_resource_message:
                 channel_add_ref(message->handles[i].channel);
                 resources[resource_message_count + i].resource = (Resource){RESOURCE_TYPE_CHANNEL_RECEIVE, .channel = message->handles[i].channel};
                 break;
+            case ATTACHED_HANDLE_TYPE_SHARED_MEMORY:
+                break;
             }
         }
         // Create the process
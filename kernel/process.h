@@ -3,24 +3,63 @@
 #include "types.h"
 #include "error.h"
 
+#include "elf.h"
 #include "handle.h"
 #include "percpu.h"
 #include "spinlock.h"
 #include "resource.h"
+#include "shm.h"
 
 extern u8 tss[];
 extern u8 tss_end[];
+extern u64 timeslice_length;
 
 typedef struct FXSAVEArea FXSAVEArea;
 
+// State shared by all threads of a process
+typedef struct ThreadGroup {
+    // Lock for access to `threads_num`, `resources` and `shm_mappings`
+    spinlock_t lock;
+    // Number of threads that haven't been freed yet
+    size_t threads_num;
+    u64 page_map; // physical address of the PML4
+    // Lock for changes to the page map and to `memory_pages`
+    spinlock_t page_map_lock;
+    // Unique identifier of the process page map, used to look up its PCID on each CPU
+    u64 address_space_id;
+    // Incremented every time a mapping is removed or changed, so that other CPUs know to flush their TLB entries
+    u64 page_map_generation;
+    // Number of pages charged against the memory limit of the process
+    // These are the pages mapped or reserved by the process, the page maps below the PML4 and shared memory objects it created,
+    // but not pages mapped from shared memory objects or read-only parts of cached ELF images.
+    size_t memory_pages;
+    // Maximum value of `memory_pages`, past which mapping pages fails
+    size_t memory_limit;
+    // Priority the process was spawned with, which its threads can't raise their priority above
+    ProcessPriority max_priority;
+    HandleList handles;
+    ResourceList resources;
+    SharedMemoryMapping *shm_mappings;
+    // Shared memory objects created by the process, whose pages are charged against its memory limit
+    SharedMemory *charged_shms;
+    // Cached image of the ELF file the process was loaded from, which holds the pages mapped from the file
+    ELFImage *elf_image;
+    // Set once the page map contents, handles, resources and shared memory mappings are freed
+    bool contents_freed;
+} ThreadGroup;
+
+// A thread of a process, which is the unit of scheduling
+// Kernel threads are processes with a single thread that never enters user mode.
 typedef struct Process {
     void *rsp;
     void *kernel_stack;
-    u64 page_map; // physical address of the PML4
     FXSAVEArea *fxsave_area;
     u64 running_time;
-    HandleList handles;
-    ResourceList resources;
+    u64 timeslice_length; // in TSC ticks
+    ProcessPriority priority;
+    ThreadGroup *group;
+    // CPU whose FPU registers were last loaded with the FPU state of the process
+    PerCPU *fpu_cpu;
     i64 timeout;
     PerCPU *timeout_cpu;
     bool timed_out;
@@ -29,25 +68,34 @@ typedef struct Process {
     struct Process *next_process;
 } Process;
 
-typedef struct ProcessQueue {
-    Process *start;
-    Process *end;
-} ProcessQueue;
-
+extern PerCPU *sched_cpu_list;
 extern Process *process_spawn_kernel_thread;
 extern Channel *process_spawn_channel;
 extern MessageQueue *process_spawn_mqueue;
 
 void process_queue_add(ProcessQueue *queue, Process *process);
+void process_queue_add_front(ProcessQueue *queue, Process *process);
 Process *process_queue_remove(ProcessQueue *queue);
 err_t process_create(Process **process_ptr, ResourceList resources);
+err_t process_create_thread(Process **process_ptr);
 void process_set_user_stack(Process *process, const u8 *file, size_t file_length, Message *message);
+void process_set_thread_stack(Process *process, void *entry_point, void *arg, void *stack);
 void process_set_kernel_stack(Process *process, void *entry_point);
 void userspace_init(void);
+void process_set_priority(Process *process, ProcessPriority priority);
+void process_load_page_map(void);
+void process_get_memory_stats(Process *process, ProcessMemoryStats *stats);
+void fpu_init(void);
+void process_fpu_restore(void);
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
 void process_enqueue(Process *process);
+void process_enqueue_handoff(Process *process);
+void sched_cpu_init(void);
 err_t process_setup(void);
 _Noreturn void process_exit(void);
 void process_switch(void);
+void process_switch_to(Process *process);
 void sched_start(void);
 void process_block(spinlock_t *spinlock);
 u64 process_time_get(void);
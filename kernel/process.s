@@ -5,10 +5,12 @@ global tss
 global tss_end
 global userspace_init
 global process_switch
+global process_switch_to
 global sched_start
 global process_block
 global process_exit
 global process_start
+global thread_start
 global process_time_get
 global cpu_haltable_num
 global cpu_halted
@@ -19,13 +21,15 @@ extern syscalls
 extern spinlock_release
 extern sched_replace_process
 extern sched_switch_process
+extern sched_handoff_process
 extern process_free
 extern load_elf_file
 extern process_free_contents
-extern page_free
-extern free
 extern stack_free
-extern idle_page_map
+extern idle_page_map_cr3
+extern process_load_page_map
+extern process_fpu_save
+extern process_fpu_switch
 extern message_alloc_copy
 extern message_reply
 extern message_reply_error
@@ -38,9 +42,9 @@ extern panic
 struc Process
   .rsp: resq 1
   .kernel_stack: resq 1
-  .page_map: resq 1
   .fxsave_area: resq 1
   .running_time: resq 1
+  .timeslice_length: resq 1
 endstruc
 
 SEGMENT_KERNEL_CODE equ 0x08
@@ -67,7 +71,7 @@ PAGE_WRITE equ 1 << 1
 PAGE_GLOBAL equ 1 << 8
 PAGE_NX equ 1 << 63
 
-SYSCALLS_NUM equ 22
+SYSCALLS_NUM equ 34
 
 ERR_INVALID_SYSCALL_NUMBER equ 0xFFFFFFFFFFFF0001
 
@@ -180,8 +184,20 @@ timeslice_start:
   or rdi, rdx
   ; Set start of timeslice
   mov gs:[PerCPU.timeslice_start], rdi
+  ; If the previous process donated the rest of its timeslice, end this timeslice at the same time
+  ; If the donated timeslice has already ended, a full timeslice is used instead.
+  mov rax, gs:[PerCPU.donated_timeslice_end]
+  mov qword gs:[PerCPU.donated_timeslice_end], 0
+  cmp rax, rdi
+  jbe .full_timeslice
+  mov rdi, rax
+  jmp .schedule
+.full_timeslice:
   ; Set interrupt timer to go off after timeslice ends
-  add rdi, [timeslice_length]
+  ; The timeslice length depends on the priority of the process.
+  mov rax, gs:[PerCPU.current_process]
+  add rdi, [rax + Process.timeslice_length]
+.schedule:
   call schedule_timeslice_interrupt
   ret
 
@@ -255,12 +271,15 @@ process_block:
   push r14
   push r15
   push qword gs:[PerCPU.interrupt_disable]
-  mov rcx, [rax + Process.fxsave_area]
-  o64 fxsave [rcx]
+  ; Save the FPU state, keeping the spinlock argument in a saved register
+  mov rbx, rdi
+  call process_fpu_save
+  mov rdi, rbx
+  mov rax, gs:[PerCPU.current_process]
   mov [rax + Process.rsp], rsp
   ; Switch to the idle stack and page map
   mov rsp, gs:[PerCPU.idle_stack]
-  mov rdx, idle_page_map
+  mov rdx, [idle_page_map_cr3]
   mov cr3, rdx
   ; Release the spinlock
   test rdi, rdi
@@ -273,7 +292,8 @@ process_block:
   call sched_replace_process
   jmp process_switch.from_no_process
 
-; Ends the current process
+; Ends the current thread
+; The process is ended once its last thread exits.
 ; Must be called with no locks held.
 process_exit:
   cmp qword gs:[PerCPU.preempt_disable], 0
@@ -293,17 +313,15 @@ process_exit:
   call timeslice_end
   ; Switch to the idle stack and page map
   mov rsp, gs:[PerCPU.idle_stack]
-  mov rdx, idle_page_map
+  mov rdx, [idle_page_map_cr3]
   mov cr3, rdx
-  ; Free the PML4
-  mov rdi, [rbx + Process.page_map]
-  call page_free
   ; Free the process kernel stack
   mov rdi, [rbx + Process.kernel_stack]
   call stack_free
   ; Free the process control block
+  ; If this is the last thread of the process, this also frees the process page map.
   mov rdi, rbx
-  call free
+  call process_free
   ; Get the next process to run
   call sched_replace_process
   ; Skip the part of process_switch where current process state is saved, since there is no process now
@@ -332,8 +350,8 @@ process_switch:
   push r14
   push r15
   push qword gs:[PerCPU.interrupt_disable]
-  mov rcx, [rax + Process.fxsave_area]
-  o64 fxsave [rcx]
+  call process_fpu_save
+  mov rax, gs:[PerCPU.current_process]
   mov [rax + Process.rsp], rsp
   ; Switch to the idle stack
   mov rsp, gs:[PerCPU.idle_stack]
@@ -348,8 +366,8 @@ process_switch:
   mov rcx, [rax + Process.kernel_stack]
   mov [rdx + TSS.rsp0], rcx
   ; Restore process state
-  mov rcx, [rax + Process.fxsave_area]
-  o64 fxrstor [rcx]
+  ; The FPU state is only restored once the process uses the FPU, unless it's still loaded.
+  call process_fpu_switch
   pop qword gs:[PerCPU.interrupt_disable]
   pop r15
   pop r14
@@ -358,8 +376,9 @@ process_switch:
   pop rbp
   pop rbx
   ; Load process page map
-  mov rdx, [rax + Process.page_map]
-  mov cr3, rdx
+  sub rsp, 8
+  call process_load_page_map
+  add rsp, 8
   ; Start timeslice
   call timeslice_start
   ; Re-enable interrupts
@@ -367,6 +386,50 @@ process_switch:
   ; Return to the process
   ret
 
+; Switch directly to a given process that is ready to run, bypassing the queue
+; The current process is placed at the front of the queue and the rest of its timeslice is donated to the new process.
+; Must be called with no locks held.
+process_switch_to:
+  cmp qword gs:[PerCPU.preempt_disable], 0
+  je .no_locks_held
+  mov rdi, process_switch_panic_msg
+  call panic
+.no_locks_held:
+  ; Save the argument, keeping the stack aligned
+  push rdi
+  sub rsp, 8
+  ; Disable interrupts
+  call interrupt_disable
+  ; Donate the rest of the timeslice
+  mov rax, gs:[PerCPU.current_process]
+  mov rdx, [rax + Process.timeslice_length]
+  add rdx, gs:[PerCPU.timeslice_start]
+  mov gs:[PerCPU.donated_timeslice_end], rdx
+  ; End the timeslice
+  call timeslice_end
+  add rsp, 8
+  pop rdi
+  mov rax, gs:[PerCPU.current_process]
+  ; Save process state on the stack, same as in process_switch
+  push rbx
+  push rbp
+  push r12
+  push r13
+  push r14
+  push r15
+  push qword gs:[PerCPU.interrupt_disable]
+  ; Save the FPU state, keeping the argument in a saved register
+  mov rbx, rdi
+  call process_fpu_save
+  mov rdi, rbx
+  mov rax, gs:[PerCPU.current_process]
+  mov [rax + Process.rsp], rsp
+  ; Switch to the idle stack
+  mov rsp, gs:[PerCPU.idle_stack]
+  ; Set current_process to the given process and return the current one to the queue
+  call sched_handoff_process
+  jmp process_switch.from_no_process
+
 ERR_NO_MEMORY equ 0x3
 ERR_KERNEL_NO_MEMORY equ 0xFFFFFFFFFFFF0003
 
@@ -435,3 +498,33 @@ process_start:
   call message_free
 .fail_no_message:
   call process_exit
+
+; Enter a newly created thread
+; When a thread is created, its instruction pointer is set to the start of this function,
+; which jumps to the thread entry point in user mode.
+; Takes the following arguments from the stack (listed top to bottom):
+; void *entry_point, void *arg, void *stack
+thread_start:
+  pop rax
+  pop rdi
+  pop rdx
+  ; Set up the kernel stack for an IRET
+  push SEGMENT_USER_DATA | SEGMENT_RING_3
+  push rdx ; set RSP to the stack provided by the creating thread
+  push RFLAGS_IF ; keep interrupts enabled
+  push SEGMENT_USER_CODE | SEGMENT_RING_3
+  push rax ; set RIP to the thread entry point
+  ; Initialize all scratch registers other than RDI, which holds the argument, to zero
+  xor rax, rax
+  xor rcx, rcx
+  xor rdx, rdx
+  xor rsi, rsi
+  xor r8, r8
+  xor r9, r9
+  xor r10, r10
+  xor r11, r11
+  ; Disable interrupts to avoid an interrupt occurring after SWAPGS
+  cli
+  swapgs
+  ; Jump to the thread using an IRET
+  iretq
@@ -43,6 +43,17 @@ static err_t resource_list_get(ResourceList *list, const ResourceName *name, siz
     return ERR_KERNEL_INVALID_RESOURCE;
 }
 
+// Get a message resource from a resource list by its name
+// Returns NULL if there is no such resource or it isn't a message.
+const Message *resource_list_get_message(ResourceList *list, const ResourceName *name) {
+    size_t i;
+    if (resource_list_get(list, name, &i))
+        return NULL;
+    if (list->entries[i].resource.type != RESOURCE_TYPE_MESSAGE)
+        return NULL;
+    return list->entries[i].resource.message;
+}
+
 // Get a sending channel resource and bind it to a handle
 err_t syscall_resource_get(const ResourceName *name, ResourceType type, handle_t *handle_i_ptr) {
     err_t err;
@@ -54,37 +65,46 @@ err_t syscall_resource_get(const ResourceName *name, ResourceType type, handle_t
     if (err)
         return err;
     // Get the resource
-    ResourceList *resources = &cpu_local->current_process->resources;
+    // The resource list is shared by all threads of the process, so it's locked until the resource is removed.
+    ThreadGroup *group = cpu_local->current_process->group;
+    spinlock_acquire(&group->lock);
     size_t channel_i;
-    err = resource_list_get(resources, name, &channel_i);
+    err = resource_list_get(&group->resources, name, &channel_i);
     if (err)
-        return err;
-    Resource *channel_resource = &resources->entries[channel_i].resource;
-    if (channel_resource->type != type)
-        return ERR_KERNEL_WRONG_RESOURCE_TYPE;
+        goto fail;
+    Resource *channel_resource = &group->resources.entries[channel_i].resource;
+    if (channel_resource->type != type) {
+        err = ERR_KERNEL_WRONG_RESOURCE_TYPE;
+        goto fail;
+    }
     // Add the handle
     switch (type) {
     case RESOURCE_TYPE_EMPTY:
-        return ERR_KERNEL_WRONG_RESOURCE_TYPE;
+        err = ERR_KERNEL_WRONG_RESOURCE_TYPE;
+        goto fail;
     case RESOURCE_TYPE_CHANNEL_SEND:
-        err = handle_add(&cpu_local->current_process->handles, (Handle){HANDLE_TYPE_CHANNEL_SEND, {.channel = channel_resource->channel}}, handle_i_ptr);
+        err = handle_add(&group->handles, (Handle){HANDLE_TYPE_CHANNEL_SEND, {.channel = channel_resource->channel}}, handle_i_ptr);
         if (err)
-            return err;
+            goto fail;
         break;
     case RESOURCE_TYPE_CHANNEL_RECEIVE:
-        err = handle_add(&cpu_local->current_process->handles, (Handle){HANDLE_TYPE_CHANNEL_RECEIVE, {.channel = channel_resource->channel}}, handle_i_ptr);
+        err = handle_add(&group->handles, (Handle){HANDLE_TYPE_CHANNEL_RECEIVE, {.channel = channel_resource->channel}}, handle_i_ptr);
         if (err)
-            return err;
+            goto fail;
         break;
     case RESOURCE_TYPE_MESSAGE:
-        err = handle_add(&cpu_local->current_process->handles, (Handle){HANDLE_TYPE_MESSAGE, {.message = channel_resource->message}}, handle_i_ptr);
+        err = handle_add(&group->handles, (Handle){HANDLE_TYPE_MESSAGE, {.message = channel_resource->message}}, handle_i_ptr);
         if (err)
-            return err;
+            goto fail;
         break;
     }
     // Remove the resource
     channel_resource->type = RESOURCE_TYPE_EMPTY;
+    spinlock_release(&group->lock);
     return 0;
+fail:
+    spinlock_release(&group->lock);
+    return err;
 }
 
 // Get a receiving channel resource and add it to a message queue
@@ -96,27 +116,38 @@ err_t syscall_mqueue_add_channel_resource(handle_t mqueue_i, const ResourceName
         return err;
     // Get the message queue handle
     Handle mqueue_handle;
-    err = handle_get(&cpu_local->current_process->handles, mqueue_i, &mqueue_handle);
+    ThreadGroup *group = cpu_local->current_process->group;
+    err = handle_get(&group->handles, mqueue_i, &mqueue_handle);
     if (err)
         return err;
-    if (mqueue_handle.type != HANDLE_TYPE_MESSAGE_QUEUE)
+    if (mqueue_handle.type != HANDLE_TYPE_MESSAGE_QUEUE) {
+        handle_put(&group->handles, mqueue_i, mqueue_handle);
         return ERR_KERNEL_WRONG_HANDLE_TYPE;
+    }
     // Get the channel resource
-    ResourceList *resources = &cpu_local->current_process->resources;
+    spinlock_acquire(&group->lock);
     size_t channel_i;
-    err = resource_list_get(resources, channel_name, &channel_i);
+    err = resource_list_get(&group->resources, channel_name, &channel_i);
     if (err)
-        return err;
-    Resource *channel_resource = &resources->entries[channel_i].resource;
-    if (channel_resource->type != RESOURCE_TYPE_CHANNEL_RECEIVE)
-        return ERR_KERNEL_WRONG_RESOURCE_TYPE;
+        goto fail;
+    Resource *channel_resource = &group->resources.entries[channel_i].resource;
+    if (channel_resource->type != RESOURCE_TYPE_CHANNEL_RECEIVE) {
+        err = ERR_KERNEL_WRONG_RESOURCE_TYPE;
+        goto fail;
+    }
     // Add the channel to the message queue
     err = channel_set_mqueue(channel_resource->channel, mqueue_handle.mqueue, tag);
     if (err)
-        return err;
+        goto fail;
     // Remove the resource
     channel_resource->type = RESOURCE_TYPE_EMPTY;
+    spinlock_release(&group->lock);
+    handle_put(&group->handles, mqueue_i, mqueue_handle);
     return 0;
+fail:
+    spinlock_release(&group->lock);
+    handle_put(&group->handles, mqueue_i, mqueue_handle);
+    return err;
 }
 
 // Read the contents of a message resource
@@ -133,28 +164,38 @@ err_t syscall_message_resource_read(const ResourceName *message_name, size_t dat
     if (err)
         return err;
     // Get message from the resource
-    ResourceList *resources = &cpu_local->current_process->resources;
+    // The resource list stays locked while the message is read, so that another thread can't free it in the meantime.
+    ThreadGroup *group = cpu_local->current_process->group;
+    spinlock_acquire(&group->lock);
     size_t message_i;
-    err = resource_list_get(resources, message_name, &message_i);
+    err = resource_list_get(&group->resources, message_name, &message_i);
     if (err)
-        return err;
-    Resource *message_resource = &resources->entries[message_i].resource;
-    if (message_resource->type != RESOURCE_TYPE_MESSAGE)
-        return ERR_KERNEL_WRONG_RESOURCE_TYPE;
+        goto fail;
+    Resource *message_resource = &group->resources.entries[message_i].resource;
+    if (message_resource->type != RESOURCE_TYPE_MESSAGE) {
+        err = ERR_KERNEL_WRONG_RESOURCE_TYPE;
+        goto fail;
+    }
     Message *message = message_resource->message;
     // Perform bounds check
     if (min_data_length == SIZE_MAX)
         min_data_length = data_length;
-    if (message->data_size < min_data_length)
-        return ERR_KERNEL_MESSAGE_DATA_TOO_SHORT;
-    if (message->data_size > data_length && !(flags & FLAG_ALLOW_PARTIAL_DATA_READ))
-        return ERR_KERNEL_MESSAGE_DATA_TOO_LONG;
+    if (message->data_size < min_data_length) {
+        err = ERR_KERNEL_MESSAGE_DATA_TOO_SHORT;
+        goto fail;
+    }
+    if (message->data_size > data_length && !(flags & FLAG_ALLOW_PARTIAL_DATA_READ)) {
+        err = ERR_KERNEL_MESSAGE_DATA_TOO_LONG;
+        goto fail;
+    }
     // Copy the message data
-    err = message_read_user(message, &(ReceiveMessage){data_length, data, 0, NULL}, &(MessageLength){0, 0}, true);
+    err = message_read_user(message, &(ReceiveMessage){data_length, data, 0, NULL}, &(MessageLength){0, 0}, true, false);
     // Remove the resource if requested
     if (flags & FLAG_FREE_MESSAGE) {
         message_free(message);
         message_resource->type = RESOURCE_TYPE_EMPTY;
     }
+fail:
+    spinlock_release(&group->lock);
     return err;
 }
@@ -0,0 +1,209 @@
+#include "types.h"
+#include "shm.h"
+
+#include "alloc.h"
+#include "handle.h"
+#include "page.h"
+#include "percpu.h"
+#include "process.h"
+#include "string.h"
+
+// Protects the charged process of every shared memory object and the lists of objects charged against each process
+// It's acquired before the page map lock of the charged process.
+static spinlock_t shm_charge_lock;
+
+// Allocate a shared memory object consisting of a given number of cleared pages
+// The object starts with a reference count of 1 and isn't charged against the memory limit of any process.
+// Returns NULL on failure.
+SharedMemory *shm_alloc(size_t pages_num) {
+    if (pages_num > (SIZE_MAX - sizeof(SharedMemory)) / sizeof(u64))
+        return NULL;
+    SharedMemory *shm = malloc(sizeof(SharedMemory) + pages_num * sizeof(u64));
+    if (shm == NULL)
+        return NULL;
+    if (page_alloc_n(shm->pages, pages_num)) {
+        free(shm);
+        return NULL;
+    }
+    for (size_t i = 0; i < pages_num; i++)
+        memset(PHYS_ADDR(shm->pages[i]), 0, PAGE_SIZE);
+    shm->lock = 0;
+    shm->refcount = 1;
+    shm->charged_group = NULL;
+    shm->prev_charged = NULL;
+    shm->next_charged = NULL;
+    shm->pages_num = pages_num;
+    return shm;
+}
+
+// Charge the pages of a shared memory object against the memory limit of the current process
+// The pages stay charged until the object is freed or the process exits, even if the object is passed to other processes.
+static err_t shm_charge(SharedMemory *shm) {
+    ThreadGroup *group = cpu_local->current_process->group;
+    spinlock_acquire(&shm_charge_lock);
+    spinlock_acquire(&group->page_map_lock);
+    if (shm->pages_num > group->memory_limit - group->memory_pages) {
+        spinlock_release(&group->page_map_lock);
+        spinlock_release(&shm_charge_lock);
+        return ERR_KERNEL_NO_MEMORY;
+    }
+    group->memory_pages += shm->pages_num;
+    spinlock_release(&group->page_map_lock);
+    shm->charged_group = group;
+    shm->next_charged = group->charged_shms;
+    if (group->charged_shms != NULL)
+        group->charged_shms->prev_charged = shm;
+    group->charged_shms = shm;
+    spinlock_release(&shm_charge_lock);
+    return 0;
+}
+
+// Return the pages of a shared memory object charged against the memory limit of a process
+static void shm_uncharge(SharedMemory *shm) {
+    spinlock_acquire(&shm_charge_lock);
+    ThreadGroup *group = shm->charged_group;
+    if (group != NULL) {
+        spinlock_acquire(&group->page_map_lock);
+        group->memory_pages -= shm->pages_num;
+        spinlock_release(&group->page_map_lock);
+        if (shm->prev_charged != NULL)
+            shm->prev_charged->next_charged = shm->next_charged;
+        else
+            group->charged_shms = shm->next_charged;
+        if (shm->next_charged != NULL)
+            shm->next_charged->prev_charged = shm->prev_charged;
+        shm->charged_group = NULL;
+    }
+    spinlock_release(&shm_charge_lock);
+}
+
+// Increment the shared memory object reference count
+void shm_add_ref(SharedMemory *shm) {
+    spinlock_acquire(&shm->lock);
+    shm->refcount += 1;
+    spinlock_release(&shm->lock);
+}
+
+// Decrement the shared memory object reference count and free it along with its pages if there are no remaining references
+void shm_del_ref(SharedMemory *shm) {
+    spinlock_acquire(&shm->lock);
+    shm->refcount -= 1;
+    if (shm->refcount == 0) {
+        spinlock_release(&shm->lock);
+        shm_uncharge(shm);
+        page_free_n(shm->pages, shm->pages_num);
+        free(shm);
+    } else {
+        spinlock_release(&shm->lock);
+    }
+}
+
+// Release the references held by the shared memory mappings of a process
+// Must be called after the page map of the process is freed.
+void shm_mappings_free(ThreadGroup *group) {
+    for (SharedMemoryMapping *mapping = group->shm_mappings; mapping != NULL; ) {
+        SharedMemoryMapping *next_mapping = mapping->next_mapping;
+        shm_del_ref(mapping->shm);
+        free(mapping);
+        mapping = next_mapping;
+    }
+    group->shm_mappings = NULL;
+}
+
+// Stop charging shared memory objects against the memory limit of an exiting process
+// Objects still used by other processes stay allocated without being charged against any process.
+void shm_charges_free(ThreadGroup *group) {
+    spinlock_acquire(&shm_charge_lock);
+    for (SharedMemory *shm = group->charged_shms; shm != NULL; ) {
+        SharedMemory *next_charged = shm->next_charged;
+        shm->charged_group = NULL;
+        shm->prev_charged = NULL;
+        shm->next_charged = NULL;
+        shm = next_charged;
+    }
+    group->charged_shms = NULL;
+    spinlock_release(&shm_charge_lock);
+}
+
+// Create a shared memory object of a given length rounded up to a multiple of the page size
+// The contents of the object are initially zero. Its pages are charged against the memory limit of the current process.
+err_t syscall_shm_create(size_t length, handle_t *handle_i_ptr) {
+    err_t err;
+    err = verify_user_buffer(handle_i_ptr, sizeof(handle_t), true);
+    if (err)
+        return err;
+    if (length == 0 || length > SIZE_MAX - (PAGE_SIZE - 1))
+        return ERR_KERNEL_INVALID_ARG;
+    err = handles_reserve(&cpu_local->current_process->group->handles, 1);
+    if (err)
+        return err;
+    SharedMemory *shm = shm_alloc((length + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (shm == NULL)
+        return ERR_KERNEL_NO_MEMORY;
+    err = shm_charge(shm);
+    if (err) {
+        shm_del_ref(shm);
+        return err;
+    }
+    err = handle_add(&cpu_local->current_process->group->handles, (Handle){HANDLE_TYPE_SHARED_MEMORY, {.shm = shm}}, handle_i_ptr);
+    if (err) {
+        shm_del_ref(shm);
+        return err;
+    }
+    return 0;
+}
+
+// Map a shared memory object in the address space of the current process starting at a given address
+// The flags are the same as in map_pages(). The object stays mapped until the process exits.
+err_t syscall_shm_map(handle_t shm_i, u64 start, u64 flags) {
+    err_t err;
+    if (flags & ~(MAP_PAGES_WRITE | MAP_PAGES_EXECUTE))
+        return ERR_KERNEL_INVALID_ARG;
+    Handle handle;
+    err = handle_get(&cpu_local->current_process->group->handles, shm_i, &handle);
+    if (err)
+        return err;
+    if (handle.type != HANDLE_TYPE_SHARED_MEMORY) {
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+        goto fail_mapping_alloc;
+    }
+    SharedMemoryMapping *mapping = malloc(sizeof(SharedMemoryMapping));
+    if (mapping == NULL) {
+        err = ERR_KERNEL_NO_MEMORY;
+        goto fail_mapping_alloc;
+    }
+    err = map_user_shared_pages(start, handle.shm->pages_num, handle.shm->pages, flags & MAP_PAGES_WRITE, flags & MAP_PAGES_EXECUTE);
+    if (err)
+        goto fail_map;
+    // The reference taken by handle_get() is kept by the mapping
+    mapping->shm = handle.shm;
+    ThreadGroup *group = cpu_local->current_process->group;
+    spinlock_acquire(&group->lock);
+    mapping->next_mapping = group->shm_mappings;
+    group->shm_mappings = mapping;
+    spinlock_release(&group->lock);
+    return 0;
+fail_map:
+    free(mapping);
+fail_mapping_alloc:
+    handle_put(&cpu_local->current_process->group->handles, shm_i, handle);
+    return err;
+}
+
+// Get the length of a shared memory object in bytes
+err_t syscall_shm_get_length(handle_t shm_i, size_t *length_ptr) {
+    err_t err;
+    err = verify_user_buffer(length_ptr, sizeof(size_t), true);
+    if (err)
+        return err;
+    Handle handle;
+    err = handle_get(&cpu_local->current_process->group->handles, shm_i, &handle);
+    if (err)
+        return err;
+    if (handle.type == HANDLE_TYPE_SHARED_MEMORY)
+        *length_ptr = handle.shm->pages_num * PAGE_SIZE;
+    else
+        err = ERR_KERNEL_WRONG_HANDLE_TYPE;
+    handle_put(&cpu_local->current_process->group->handles, shm_i, handle);
+    return err;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "types.h"
+#include "error.h"
+
+#include "spinlock.h"
+
+typedef struct ThreadGroup ThreadGroup;
+
+// A set of physical pages that can be mapped into the address spaces of multiple processes
+typedef struct SharedMemory {
+    spinlock_t lock;
+    size_t refcount;
+    // Process whose memory limit the pages are charged against, or NULL if it has exited
+    ThreadGroup *charged_group;
+    // List of the objects charged against the memory limit of the same process
+    struct SharedMemory *prev_charged;
+    struct SharedMemory *next_charged;
+    size_t pages_num;
+    u64 pages[];
+} SharedMemory;
+
+// Shared memory objects mapped by a process
+// Each mapping holds a reference to its object, so that its pages stay allocated while they're mapped.
+typedef struct SharedMemoryMapping {
+    SharedMemory *shm;
+    struct SharedMemoryMapping *next_mapping;
+} SharedMemoryMapping;
+
+SharedMemory *shm_alloc(size_t pages_num);
+void shm_add_ref(SharedMemory *shm);
+void shm_del_ref(SharedMemory *shm);
+void shm_mappings_free(ThreadGroup *group);
+void shm_charges_free(ThreadGroup *group);
+err_t syscall_shm_create(size_t length, handle_t *handle_i_ptr);
+err_t syscall_shm_map(handle_t shm_i, u64 start, u64 flags);
+err_t syscall_shm_get_length(handle_t shm_i, size_t *length_ptr);
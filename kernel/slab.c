@@ -0,0 +1,105 @@
+#include "types.h"
+#include "slab.h"
+
+#include "alloc.h"
+#include "page.h"
+#include "percpu.h"
+#include "spinlock.h"
+
+// The slab allocator is used for small fixed-size objects that are frequently allocated and freed, such as messages.
+// Each CPU has a magazine of free objects for every size class, which is accessed with only preemption disabled.
+// When a magazine becomes empty or full, half of its capacity is moved from or to the depot,
+// which holds the free objects of a size class shared by all CPUs.
+// The depot is filled by splitting whole pages into objects. Pages are never returned to the page allocator.
+
+// Free objects of a single size class not held by any magazine
+// The objects form a linked list, with each one holding a pointer to the next one in its first 8 bytes.
+typedef struct SlabDepot {
+    spinlock_t lock;
+    void *free_list;
+} SlabDepot;
+
+static SlabDepot slab_depots[SLAB_SIZE_CLASSES_NUM];
+
+// Get the index of the smallest size class that fits an object of a given size
+static size_t slab_size_class(size_t size) {
+    if (size <= (UINT64_C(1) << SLAB_MIN_SIZE_BITS))
+        return 0;
+    return 64 - __builtin_clzll(size - 1) - SLAB_MIN_SIZE_BITS;
+}
+
+// Move objects from the depot into an empty magazine
+// If the depot is empty, it's first filled with objects from a newly allocated page.
+// Returns false if no memory is available.
+static bool slab_magazine_refill(SlabMagazine *magazine, size_t size_class) {
+    SlabDepot *depot = &slab_depots[size_class];
+    spinlock_acquire(&depot->lock);
+    if (depot->free_list == NULL) {
+        u64 page = page_alloc();
+        if (page == 0) {
+            spinlock_release(&depot->lock);
+            return false;
+        }
+        size_t object_size = UINT64_C(1) << (size_class + SLAB_MIN_SIZE_BITS);
+        for (size_t offset = 0; offset < PAGE_SIZE; offset += object_size) {
+            void **object = PHYS_ADDR(page) + offset;
+            *object = depot->free_list;
+            depot->free_list = object;
+        }
+    }
+    while (magazine->length < SLAB_MAGAZINE_SIZE / 2 && depot->free_list != NULL) {
+        void **object = depot->free_list;
+        depot->free_list = *object;
+        magazine->objects[magazine->length++] = object;
+    }
+    spinlock_release(&depot->lock);
+    return true;
+}
+
+// Move half of the objects from a full magazine into the depot
+static void slab_magazine_flush(SlabMagazine *magazine, size_t size_class) {
+    SlabDepot *depot = &slab_depots[size_class];
+    spinlock_acquire(&depot->lock);
+    while (magazine->length > SLAB_MAGAZINE_SIZE / 2) {
+        void **object = magazine->objects[--magazine->length];
+        *object = depot->free_list;
+        depot->free_list = object;
+    }
+    spinlock_release(&depot->lock);
+}
+
+// Allocate an object of a given size
+// Objects are aligned to their size class. Sizes larger than the largest size class are allocated with malloc().
+// Returns NULL on failure.
+void *slab_alloc(size_t size) {
+    if (size > (UINT64_C(1) << SLAB_MAX_SIZE_BITS))
+        return malloc(size);
+    size_t size_class = slab_size_class(size);
+    preempt_disable();
+    SlabMagazine *magazine = &cpu_local->self->slab_magazines[size_class];
+    if (magazine->length == 0 && !slab_magazine_refill(magazine, size_class)) {
+        preempt_enable();
+        return NULL;
+    }
+    void *p = magazine->objects[--magazine->length];
+    preempt_enable();
+    return p;
+}
+
+// Free an object allocated with slab_alloc()
+// The size must be the same as the one used to allocate the object.
+void slab_free(void *p, size_t size) {
+    if (p == NULL)
+        return;
+    if (size > (UINT64_C(1) << SLAB_MAX_SIZE_BITS)) {
+        free(p);
+        return;
+    }
+    size_t size_class = slab_size_class(size);
+    preempt_disable();
+    SlabMagazine *magazine = &cpu_local->self->slab_magazines[size_class];
+    if (magazine->length == SLAB_MAGAZINE_SIZE)
+        slab_magazine_flush(magazine, size_class);
+    magazine->objects[magazine->length++] = p;
+    preempt_enable();
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "types.h"
+
+// Objects are allocated in power-of-two size classes from 16 to 2048 bytes
+#define SLAB_MIN_SIZE_BITS 4
+#define SLAB_MAX_SIZE_BITS 11
+#define SLAB_SIZE_CLASSES_NUM (SLAB_MAX_SIZE_BITS - SLAB_MIN_SIZE_BITS + 1)
+
+#define SLAB_MAGAZINE_SIZE 16
+
+// Per-CPU stack of free objects of a single size class
+typedef struct SlabMagazine {
+    size_t length;
+    void *objects[SLAB_MAGAZINE_SIZE];
+} SlabMagazine;
+
+void *slab_alloc(size_t size);
+void slab_free(void *p, size_t size);
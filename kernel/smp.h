@@ -8,6 +8,7 @@ void smp_init_sync(bool bsp);
 void apic_eoi(void);
 void send_wakeup_ipi(u32);
 void send_halt_ipi(void);
+void send_tlb_shootdown_ipi(u32);
 
 extern u8 cpus[];
 extern size_t cpu_num;
@@ -8,6 +8,8 @@ global send_wakeup_ipi
 global wakeup_ipi_handler
 global send_halt_ipi
 global halt_ipi_handler
+global send_tlb_shootdown_ipi
+global tlb_shootdown_ipi_handler
 
 extern cpus
 extern cpu_num
@@ -16,7 +18,9 @@ extern cpu_halted
 extern cpu_haltable_num
 
 extern pit_wait
+extern process_switch
 extern time_from_tsc
+extern tlb_shootdown_handle
 
 LAPIC_ID_REGISTER equ 0x020
 LAPIC_EOI_REGISTER equ 0x0B0
@@ -44,6 +48,7 @@ ICR_SIPI equ 6 << 8
 SIPI_VECTOR equ 0x08
 
 LAPIC_TIMER_VECTOR equ 0x20
+INT_VECTOR_TLB_SHOOTDOWN_IPI equ 0x2C
 INT_VECTOR_WAKEUP_IPI equ 0x2D
 INT_VECTOR_HALT_IPI equ 0x2E
 SPURIOUS_INTERRUPT_VECTOR equ 0x2F
@@ -171,6 +176,29 @@ wakeup_ipi_handler:
   ; Reset the idle flag
   mov byte gs:[PerCPU.idle], 0
   call apic_eoi
+  ; If a higher priority process was added to the queue, preempt the current process
+  ; If preemption is disabled, this will instead be done once it's enabled again.
+  cmp byte gs:[PerCPU.reschedule_pending], 0
+  je .no_preempt
+  cmp qword gs:[PerCPU.preempt_disable], 0
+  jne .no_preempt
+  mov byte gs:[PerCPU.reschedule_pending], 0
+  call process_switch
+.no_preempt:
+  ret
+
+; Send a TLB shootdown IPI to a given CPU
+; Must be called with interrupts disabled, so that no other IPI is sent between the two writes to the interrupt command register.
+send_tlb_shootdown_ipi:
+  mov rax, [lapic]
+  mov dword [rax + LAPIC_INTERRUPT_COMMAND_REGISTER_HIGH], edi
+  mov dword [rax + LAPIC_INTERRUPT_COMMAND_REGISTER_LOW], ICR_ASSERT | ICR_FIXED | INT_VECTOR_TLB_SHOOTDOWN_IPI
+  ret
+
+tlb_shootdown_ipi_handler:
+  ; Flush the TLB and mark the pending shootdown requests as completed
+  call tlb_shootdown_handle
+  call apic_eoi
   ret
 
 send_halt_ipi:
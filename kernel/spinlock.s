@@ -7,6 +7,7 @@ global spinlock_release
 
 extern delayed_timer_interrupt_handle
 extern interrupt_disable
+extern process_switch
 extern send_input_events
 extern send_input_delayed
 
@@ -28,11 +29,19 @@ preempt_enable:
 .no_input:
   ; If there's a pending preemption, preempt the current thread
   cmp byte gs:[PerCPU.timer_interrupt_delayed], 0
-  je .no_preempt
+  je .no_timer
   sub qword gs:[PerCPU.preempt_disable], 1
   mov byte gs:[PerCPU.timer_interrupt_delayed], 0
   call delayed_timer_interrupt_handle
   ret
+.no_timer:
+  ; If a higher priority process was added to the queue, switch to it
+  cmp byte gs:[PerCPU.reschedule_pending], 0
+  je .no_preempt
+  sub qword gs:[PerCPU.preempt_disable], 1
+  mov byte gs:[PerCPU.reschedule_pending], 0
+  call process_switch
+  ret
   ; Otherwise just decrement the preempt disable counter
 .no_preempt:
   sub qword gs:[PerCPU.preempt_disable], 1
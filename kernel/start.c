@@ -40,6 +40,9 @@ void kernel_start(void *stack) {
     _string_init();
     interrupt_init(bsp_prealloc.idt, &bsp_prealloc.idtr);
     percpu_init(&bsp_prealloc.percpu, stack);
+    pcid_init();
+    fpu_init();
+    sched_cpu_init();
     err = page_alloc_init();
     if (err)
         goto fail;
@@ -100,6 +103,9 @@ void kernel_start_ap(u64 ap_id, void *stack) {
     err_t err;
     interrupt_init(ap_prealloc[ap_id].idt, &ap_prealloc[ap_id].idtr);
     percpu_init(&ap_prealloc[ap_id].percpu, stack);
+    pcid_init();
+    fpu_init();
+    sched_cpu_init();
     err = gdt_init();
     if (err)
         goto fail;
@@ -1,6 +1,9 @@
 #include "types.h"
 #include "string.h"
 
+#include "memcpy.h"
+#include "process.h"
+
 int memcmp(const void *p1, const void *p2, size_t n) {
     const u8 *s1 = p1;
     const u8 *s2 = p2;
@@ -12,3 +15,16 @@ int memcmp(const void *p1, const void *p2, size_t n) {
     }
     return 0;
 }
+
+// Copy a buffer that may be large
+// Large copies use non-temporal stores, so that they don't evict the rest of the cache.
+// Preemption is disabled during the copy, since it's done with the FPU enabled. Page faults can't be handled
+// with preemption disabled, so the destination and source must both be kernel memory.
+void *memcpy_large(void * restrict dest, const void * restrict src, size_t n) {
+    if (n < MEMCPY_NONTEMPORAL_MIN)
+        return memcpy(dest, src, n);
+    kernel_fpu_begin();
+    memcpy_nontemporal(dest, src, n);
+    kernel_fpu_end();
+    return dest;
+}
@@ -3,19 +3,28 @@
 #include "channel.h"
 #include "error.h"
 #include "framebuffer.h"
+#include "futex.h"
 #include "interrupt.h"
 #include "page.h"
 #include "percpu.h"
 #include "process.h"
+#include "shm.h"
 #include "time.h"
 
-#define MAP_PAGES_WRITE (UINT64_C(1) << 0)
-#define MAP_PAGES_EXECUTE (UINT64_C(1) << 1)
-
+// Map pages in the given range of the current process address space
+// The pages are allocated on first access, unless MAP_PAGES_LARGE is set.
+// In that case the range is mapped with large pages right away and must be aligned to the large page size.
 err_t syscall_map_pages(u64 start, u64 length, u64 flags) {
-    if (flags & ~(MAP_PAGES_WRITE | MAP_PAGES_EXECUTE))
+    if (flags & ~(MAP_PAGES_WRITE | MAP_PAGES_EXECUTE | MAP_PAGES_LARGE))
         return ERR_KERNEL_INVALID_ARG;
-    return map_user_pages(start, length, flags & MAP_PAGES_WRITE, flags & MAP_PAGES_EXECUTE);
+    if (flags & MAP_PAGES_LARGE)
+        return map_user_large_pages(start, length, flags & MAP_PAGES_WRITE, flags & MAP_PAGES_EXECUTE);
+    return reserve_user_pages(start, length, flags & MAP_PAGES_WRITE, flags & MAP_PAGES_EXECUTE);
+}
+
+// Unmap pages in the given range of the current process address space
+err_t syscall_unmap_pages(u64 start, u64 length) {
+    return unmap_user_pages(start, length);
 }
 
 err_t syscall_process_exit(void) {
@@ -28,7 +37,7 @@ err_t syscall_process_yield(void) {
 }
 
 err_t syscall_handle_free(handle_t i) {
-    handle_clear(&cpu_local->current_process->handles, i, true);
+    handle_clear(&cpu_local->current_process->group->handles, i, true);
     return 0;
 }
 
@@ -50,6 +59,46 @@ err_t syscall_process_time_get(i64 *time_ptr) {
     return 0;
 }
 
+err_t syscall_process_get_memory_stats(ProcessMemoryStats *stats_ptr) {
+    ProcessMemoryStats stats;
+    process_get_memory_stats(cpu_local->current_process, &stats);
+    return copy_to_user(stats_ptr, &stats, sizeof(ProcessMemoryStats));
+}
+
+// Create a new thread in the current process
+// The thread starts at the given entry point with the argument passed in RDI and the stack pointer set to `stack`.
+// The stack must be allocated by the caller.
+err_t syscall_thread_create(void *entry_point, void *arg, void *stack) {
+    err_t err;
+    if ((u64)entry_point >= USER_ADDR_UPPER_BOUND || (u64)stack > USER_ADDR_UPPER_BOUND)
+        return ERR_KERNEL_INVALID_ADDRESS;
+    Process *thread;
+    err = process_create_thread(&thread);
+    if (err)
+        return err;
+    process_set_thread_stack(thread, entry_point, arg, stack);
+    process_enqueue(thread);
+    return 0;
+}
+
+// Set the priority of the current thread
+// The priority can't be higher than the one the process was spawned with, so a process can't take CPU time from higher priority ones.
+err_t syscall_process_set_priority(ProcessPriority priority) {
+    if (priority >= PROCESS_PRIORITIES_NUM)
+        return ERR_KERNEL_INVALID_ARG;
+    if (priority < cpu_local->current_process->group->max_priority)
+        return ERR_KERNEL_INVALID_ARG;
+    preempt_disable();
+    bool lowered = priority > cpu_local->current_process->priority;
+    process_set_priority(cpu_local->current_process, priority);
+    cpu_local->current_priority = priority;
+    preempt_enable();
+    // If the priority was lowered, give any higher priority processes waiting in the queue a chance to run
+    if (lowered)
+        process_switch();
+    return 0;
+}
+
 const void * const syscalls[] = {
     syscall_map_pages,
     syscall_process_exit,
@@ -73,4 +122,16 @@ const void * const syscalls[] = {
     syscall_process_time_get,
     syscall_process_wait,
     syscall_channel_call_async,
+    syscall_process_set_priority,
+    syscall_message_reply_receive,
+    syscall_shm_create,
+    syscall_shm_map,
+    syscall_shm_get_length,
+    syscall_unmap_pages,
+    syscall_process_get_memory_stats,
+    syscall_thread_create,
+    syscall_futex_wait,
+    syscall_futex_wake,
+    syscall_channel_send_batch,
+    syscall_mqueue_receive_batch,
 };
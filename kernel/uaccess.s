@@ -0,0 +1,47 @@
+global uaccess_copy
+global uaccess_fixup
+
+section .rodata
+
+; Table of instructions that may fault when accessing user memory
+; Each entry consists of the address of the faulting instruction and the address execution should resume at.
+uaccess_exception_table:
+  dq uaccess_copy.copy, uaccess_copy.fault
+uaccess_exception_table_end:
+
+section .text
+
+; Copy memory between the kernel and a process address space
+; The caller must check that the user buffer is located below USER_ADDR_UPPER_BOUND.
+; If a page fault that can't be resolved occurs during the copy, it stops and the number of bytes that weren't copied is returned.
+; rdi - void *dest
+; rsi - const void *src
+; rdx - size_t n
+; Returns the number of bytes not copied
+uaccess_copy:
+  mov rcx, rdx
+.copy:
+  rep movsb
+.fault:
+  mov rax, rcx
+  ret
+
+; Find the fixup address for a faulting instruction in the exception table
+; rdi - u64 rip
+; Returns the address to resume execution at, or 0 if the instruction isn't in the table
+uaccess_fixup:
+  mov rdx, uaccess_exception_table
+  mov rcx, uaccess_exception_table_end
+.loop:
+  cmp rdx, rcx
+  je .not_found
+  cmp [rdx], rdi
+  je .found
+  add rdx, 16
+  jmp .loop
+.found:
+  mov rax, [rdx + 8]
+  ret
+.not_found:
+  xor eax, eax
+  ret
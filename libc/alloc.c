@@ -35,9 +35,21 @@ static void panic(const char *str) {
 
 #ifndef _KERNEL
 #define PAGE_SIZE (UINT64_C(1) << 12)
+#define LARGE_PAGE_SIZE (UINT64_C(1) << 21)
+// Free space at the end of the heap past this size is returned to the system
+#define HEAP_TRIM_THRESHOLD (UINT64_C(4) << 20)
+// Free regions at least this large have the pages they contain returned to the system
+#define HEAP_RELEASE_MIN_SIZE (UINT64_C(1) << 20)
+// Pages of free regions are only returned once this much memory has been freed before the end of the heap since the last time
+// This keeps programs that repeatedly allocate and free large buffers from releasing and faulting in the same pages every time.
+#define HEAP_RELEASE_THRESHOLD (UINT64_C(16) << 20)
 #endif
 
 static u64 heap_end = HEAP_START;
+#ifndef _KERNEL
+// Memory freed before the end of the heap since the pages of free regions were last returned to the system
+static size_t heap_unreleased_size = 0;
+#endif
 
 // Extend the heap by at least `increment` bytes.
 // Returns true on success, false on failure.
@@ -56,6 +68,24 @@ static err_t heap_extend(size_t increment) {
 #ifdef _KERNEL
     err = map_kernel_pages(heap_end, increment, true, false);
 #else
+    // Large extensions are mapped with large pages where possible to reduce TLB pressure.
+    // The part before the first large page boundary is mapped with regular pages, and the rest is rounded up to a whole number of large pages.
+    // If the large pages can't be mapped, the rest is mapped with regular pages instead.
+    if (increment >= LARGE_PAGE_SIZE) {
+        u64 large_start = (heap_end + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE;
+        u64 large_end = (heap_end + increment + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE * LARGE_PAGE_SIZE;
+        if (large_end <= HEAP_END_MAX) {
+            err = map_pages(heap_end, large_start - heap_end, MAP_PAGES_WRITE);
+            if (err)
+                return err;
+            increment -= large_start - heap_end;
+            heap_end = large_start;
+            if (map_pages(large_start, large_end - large_start, MAP_PAGES_WRITE | MAP_PAGES_LARGE) == 0) {
+                heap_end = large_end;
+                return 0;
+            }
+        }
+    }
     err = map_pages(heap_end, increment, MAP_PAGES_WRITE);
 #endif
     if (err)
@@ -159,6 +189,52 @@ static size_t dummy_region_size(void) {
     return (char *)heap_end - (char *)dummy_region - sizeof(MemoryRegion);
 }
 
+#ifndef _KERNEL
+
+// Return the free part at the end of the heap to the system if it's grown larger than HEAP_TRIM_THRESHOLD
+// MIN_HEAP_EXTEND_SIZE bytes of it are kept, so that the heap doesn't have to be extended again right away.
+static void heap_trim(void) {
+    if (dummy_region_size() <= HEAP_TRIM_THRESHOLD)
+        return;
+    u64 new_heap_end = ((u64)dummy_region + sizeof(FreeMemoryRegion) + MIN_HEAP_EXTEND_SIZE + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    if (unmap_pages(new_heap_end, heap_end - new_heap_end) == 0)
+        heap_end = new_heap_end;
+}
+
+// Return the whole pages contained in a large free region to the system
+// The pages are mapped again right away. Since they're allocated on first access, they don't take up memory until they're reused.
+// Room for a region header is kept on both sides of the pages, so that they can be cut out of the region if they can't be mapped again.
+static void region_release_pages(FreeMemoryRegion *region) {
+    if (region_size((MemoryRegion *)region) < HEAP_RELEASE_MIN_SIZE)
+        return;
+    u64 start = ((u64)region + sizeof(FreeMemoryRegion) + sizeof(MemoryRegion) + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    u64 end = ((u64)region->header.next_region - sizeof(FreeMemoryRegion)) / PAGE_SIZE * PAGE_SIZE;
+    if (start >= end)
+        return;
+    if (unmap_pages(start, end - start) != 0)
+        return;
+    if (map_pages(start, end - start, MAP_PAGES_WRITE) == 0)
+        return;
+    // The pages are unmapped and can't be used anymore, so they're kept in an allocated region that's never freed
+    MemoryRegion *unmapped_region = (MemoryRegion *)(start - sizeof(MemoryRegion));
+    unmapped_region->allocated = REGION_ALLOCATED;
+    insert_into_region_list(unmapped_region, (MemoryRegion *)region);
+    FreeMemoryRegion *new_region = (FreeMemoryRegion *)end;
+    new_region->header.allocated = REGION_FREE;
+    insert_into_region_list((MemoryRegion *)new_region, unmapped_region);
+    insert_into_free_region_list(new_region);
+}
+
+// Return the pages of all large free regions before the end of the heap to the system
+// Pages released before and not used since are released again, which only costs the system calls since they aren't allocated.
+static void heap_release_pages(void) {
+    for (FreeMemoryRegion *region = dummy_region->next_free_region; region != dummy_region; region = region->next_free_region)
+        region_release_pages(region);
+    heap_unreleased_size = 0;
+}
+
+#endif
+
 // Allocates the given amount of memory within the specified region.
 // If there is enough space left over, a new region will be created from it.
 // No bound check of any kind is performed.
@@ -247,6 +323,9 @@ void free(void *p) {
         panic("Heap corruption detected");
     region->header.allocated = REGION_FREE;
     insert_into_free_region_list(region);
+#ifndef _KERNEL
+    size_t freed_size = region_size((MemoryRegion *)region);
+#endif
     // If the next region is free, coalesce with it
     if (region->header.next_region->allocated == REGION_FREE) {
         // If we're coalescing with the dummy region, update the dummy region
@@ -264,9 +343,20 @@ void free(void *p) {
             dummy_region = (FreeMemoryRegion *)region->header.prev_region;
         remove_from_free_region_list(region);
         remove_from_region_list((MemoryRegion *)region);
+        region = (FreeMemoryRegion *)region->header.prev_region;
     } else if (region->header.prev_region->allocated != REGION_ALLOCATED) {
         panic("Heap corruption detected");
     }
+#ifndef _KERNEL
+    // Return unused memory to the system
+    if (region == dummy_region) {
+        heap_trim();
+    } else {
+        heap_unreleased_size += freed_size;
+        if (heap_unreleased_size >= HEAP_RELEASE_THRESHOLD)
+            heap_release_pages();
+    }
+#endif
     alloc_lock_release();
 }
 
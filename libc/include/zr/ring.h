@@ -0,0 +1,38 @@
+#pragma once
+
+#include <zr/types.h>
+#include <zr/error.h>
+
+// Size of the ring header placed in the first page of the shared memory object
+#define RING_HEADER_SIZE 0x1000
+
+// Header of a single-producer single-consumer ring located in a shared memory object
+// The ring data follows the header. Records are stored in it as a 32-bit length followed by the record data.
+// Positions are counted in bytes written since the ring was created, so the ring is empty when they're equal.
+// The waiting flags are used as futexes - a side that finds the ring full or empty sets its flag before sleeping,
+// and the other side only enters the kernel to wake it if the flag is set.
+typedef struct RingHeader {
+    // Written by the producer
+    _Atomic u64 head;
+    _Atomic u32 producer_waiting;
+    u8 reserved1[52];
+    // Written by the consumer
+    _Atomic u64 tail;
+    _Atomic u32 consumer_waiting;
+    u8 reserved2[52];
+} RingHeader;
+
+// One end of a ring mapped in the address space of the current process
+// Each end must be used by only one thread at a time.
+typedef struct Ring {
+    RingHeader *header;
+    u8 *data;
+    size_t capacity;
+    // Position of the other end as last read from the header
+    u64 other_pos;
+} Ring;
+
+err_t ring_create(size_t capacity, handle_t *shm_i_ptr);
+err_t ring_map(handle_t shm_i, void *addr, Ring *ring);
+err_t ring_send(Ring *ring, const void *data, size_t length, u64 flags);
+err_t ring_receive(Ring *ring, void *data, size_t max_length, size_t *length_ptr, i64 timeout, u64 flags);
@@ -5,12 +5,14 @@
 
 #define MAP_PAGES_WRITE (UINT64_C(1) << 0)
 #define MAP_PAGES_EXECUTE (UINT64_C(1) << 1)
+#define MAP_PAGES_LARGE (UINT64_C(1) << 2)
 #define FLAG_NONBLOCK (UINT64_C(1) << 0)
 #define FLAG_ALLOW_PARTIAL_DATA_READ (UINT64_C(1) << 1)
 #define FLAG_ALLOW_PARTIAL_HANDLES_READ (UINT64_C(1) << 2)
 #define FLAG_FREE_MESSAGE (UINT64_C(1) << 3)
 #define FLAG_PRIORITIZE_TIMEOUT (UINT64_C(1) << 4)
 #define FLAG_REPLY_ON_FAILURE (UINT64_C(1) << 5)
+#define FLAG_MOVE_PAGES (UINT64_C(1) << 6)
 
 typedef struct MessageTag {
     uintptr_t data[2];
@@ -19,6 +21,7 @@ typedef struct MessageTag {
 typedef enum AttachedHandleType : uintptr_t {
     ATTACHED_HANDLE_TYPE_CHANNEL_SEND,
     ATTACHED_HANDLE_TYPE_CHANNEL_RECEIVE,
+    ATTACHED_HANDLE_TYPE_SHARED_MEMORY,
 } AttachedHandleType;
 
 typedef enum ResourceType : uintptr_t {
@@ -69,6 +72,16 @@ typedef struct ReceiveMessage {
     ReceiveAttachedHandle *handles;
 } ReceiveMessage;
 
+typedef enum ProcessPriority : uintptr_t {
+    // Reserved for kernel threads
+    PROCESS_PRIORITY_REALTIME,
+    PROCESS_PRIORITY_HIGH,
+    PROCESS_PRIORITY_NORMAL,
+    PROCESS_PRIORITY_LOW,
+} ProcessPriority;
+
+#define PROCESS_PRIORITIES_NUM 4
+
 #define RESOURCE_NAME_MAX 32
 
 typedef struct ResourceName {
@@ -91,6 +104,36 @@ static inline ResourceName resource_name(const char *str) {
 
 #define TIMEOUT_NONE INT64_MAX
 
+// Maximum number of messages sent by channel_send_batch() or received by mqueue_receive_batch() in a single call
+#define MESSAGE_BATCH_MAX 16
+
+// Default limits for message queues
+// Senders block once a queue holds this many messages or this many bytes of message data.
+#define MQUEUE_DEFAULT_MAX_LENGTH 16
+#define MQUEUE_DEFAULT_MAX_DATA_SIZE (UINT64_C(16) << 20)
+// Largest limits a message queue can be created with
+#define MQUEUE_MAX_LENGTH 4096
+#define MQUEUE_MAX_DATA_SIZE (UINT64_C(1) << 30)
+
+// Name of a message resource setting the memory limit of a spawned process
+// The message contains a single size_t holding the maximum number of pages the process can map.
+#define PROCESS_MEMORY_LIMIT_RESOURCE "process/memory_limit"
+
+typedef struct ProcessMemoryStats {
+    // Pages charged against the memory limit of the process: pages mapped or reserved by it, pages of its page map
+    // other than the top level, and shared memory objects it created, but not shared memory created by other processes
+    // or read-only parts of executables
+    size_t pages;
+    // Maximum value of `pages`, or SIZE_MAX if the process has no memory limit
+    size_t pages_limit;
+    // Pages used by the page map of the process
+    size_t page_map_pages;
+    // Bytes of kernel memory used by the process control block, the handle list, and the messages held by the process
+    size_t kernel_heap_size;
+    // Number of handles the process has open
+    size_t handles_num;
+} ProcessMemoryStats;
+
 #ifndef _KERNEL
 
 err_t map_pages(u64 start, u64 length, u64 flags);
@@ -105,7 +148,7 @@ void handle_free(handle_t i);
 err_t message_reply_error(handle_t message_i, err_t error, u64 flags);
 err_t channel_call_read(handle_t channel_i, const SendMessage *message, ReceiveMessage *reply, const MessageLength *min_length);
 err_t resource_get(const ResourceName *name, ResourceType type, handle_t *handle_i);
-err_t mqueue_create(handle_t *handle_i_ptr);
+err_t mqueue_create(handle_t *handle_i_ptr, size_t max_length, size_t max_data_size);
 err_t mqueue_add_channel(handle_t mqueue_i, handle_t channel_i, MessageTag tag);
 err_t mqueue_add_channel_resource(handle_t mqueue_i, const ResourceName *channel_name, MessageTag tag);
 err_t channel_create(handle_t *channel_send_i, handle_t *channel_receive_i);
@@ -115,5 +158,17 @@ err_t message_resource_read(const ResourceName *name, size_t data_length, void *
 void process_time_get(i64 *time_ptr);
 void process_wait(i64 time);
 err_t channel_call_async(handle_t channel_i, const SendMessage *message, handle_t mqueue_i, MessageTag tag, u64 flags);
+err_t process_set_priority(ProcessPriority priority);
+err_t message_reply_receive(handle_t message_i, const SendMessage *reply, handle_t mqueue_i, MessageTag *tag, handle_t *message_i_ptr, u64 flags);
+err_t shm_create(size_t length, handle_t *handle_i_ptr);
+err_t shm_map(handle_t shm_i, u64 start, u64 flags);
+err_t shm_get_length(handle_t shm_i, size_t *length_ptr);
+err_t unmap_pages(u64 start, u64 length);
+err_t process_get_memory_stats(ProcessMemoryStats *stats);
+err_t thread_create(void (*entry_point)(void *), void *arg, void *stack);
+err_t futex_wait(const u32 *addr, u32 expected, i64 timeout);
+err_t futex_wake(const u32 *addr, size_t n);
+err_t channel_send_batch(handle_t channel_i, const SendMessage *messages, size_t n, size_t *sent_ptr, u64 flags);
+err_t mqueue_receive_batch(handle_t mqueue_i, MessageTag *tags, handle_t *message_is, size_t *length_ptr, i64 timeout, u64 flags);
 
 #endif
@@ -0,0 +1,135 @@
+#include <zr/ring.h>
+
+#include <string.h>
+
+#include <zr/syscalls.h>
+
+// Create a shared memory object holding an empty ring able to hold `capacity` bytes of records
+// The capacity is rounded up to a power of two that's at least the page size.
+err_t ring_create(size_t capacity, handle_t *shm_i_ptr) {
+    size_t rounded_capacity = RING_HEADER_SIZE;
+    while (rounded_capacity < capacity) {
+        if (rounded_capacity > (SIZE_MAX - RING_HEADER_SIZE) / 2)
+            return ERR_INVALID_ARG;
+        rounded_capacity *= 2;
+    }
+    return shm_create(RING_HEADER_SIZE + rounded_capacity, shm_i_ptr);
+}
+
+// Map a ring created with ring_create() starting at a given address and set up a ring end to access it
+// The same shared memory object should be mapped by the producer and the consumer.
+err_t ring_map(handle_t shm_i, void *addr, Ring *ring) {
+    err_t err;
+    size_t length;
+    err = shm_get_length(shm_i, &length);
+    if (err)
+        return err;
+    size_t capacity = length - RING_HEADER_SIZE;
+    if (length <= RING_HEADER_SIZE || (capacity & (capacity - 1)) != 0)
+        return ERR_INVALID_ARG;
+    err = shm_map(shm_i, (u64)addr, MAP_PAGES_WRITE);
+    if (err)
+        return err;
+    ring->header = addr;
+    ring->data = (u8 *)addr + RING_HEADER_SIZE;
+    ring->capacity = capacity;
+    ring->other_pos = 0;
+    return 0;
+}
+
+// Copy data into the ring starting at a given position, wrapping around at the end of the ring
+static void ring_write(Ring *ring, u64 pos, const void *data, size_t length) {
+    size_t offset = pos & (ring->capacity - 1);
+    size_t first_length = length < ring->capacity - offset ? length : ring->capacity - offset;
+    memcpy(ring->data + offset, data, first_length);
+    memcpy(ring->data, (const u8 *)data + first_length, length - first_length);
+}
+
+// Copy data out of the ring starting at a given position, wrapping around at the end of the ring
+static void ring_read(Ring *ring, u64 pos, void *data, size_t length) {
+    size_t offset = pos & (ring->capacity - 1);
+    size_t first_length = length < ring->capacity - offset ? length : ring->capacity - offset;
+    memcpy(data, ring->data + offset, first_length);
+    memcpy((u8 *)data + first_length, ring->data, length - first_length);
+}
+
+// Sleep until the other end moves its position away from `old_pos`
+// The waiting flag is set before the position is checked again, so the other end either sees the flag and wakes this one,
+// or it moved its position before the check.
+static err_t ring_wait(_Atomic u32 *waiting, _Atomic u64 *pos, u64 old_pos, i64 timeout) {
+    err_t err = 0;
+    atomic_store(waiting, 1);
+    if (atomic_load(pos) == old_pos) {
+        // If the flag was cleared in the meantime, the futex wait returns immediately
+        err = futex_wait((const u32 *)waiting, 1, timeout);
+        if (err != ERR_KERNEL_TIMEOUT)
+            err = 0;
+    }
+    atomic_store(waiting, 0);
+    return err;
+}
+
+// Wake the other end if it's waiting for this end to move its position
+// This is the only point at which a ring end enters the kernel when the other end keeps up.
+static void ring_notify(_Atomic u32 *waiting) {
+    if (atomic_load(waiting) != 0 && atomic_exchange(waiting, 0) != 0)
+        futex_wake((const u32 *)waiting, 1);
+}
+
+// Write a record to the ring
+// If there is not enough space in the ring, blocks until the consumer frees it, unless FLAG_NONBLOCK is set.
+err_t ring_send(Ring *ring, const void *data, size_t length, u64 flags) {
+    err_t err;
+    RingHeader *header = ring->header;
+    if (length > UINT32_MAX || length > ring->capacity - sizeof(u32))
+        return ERR_INVALID_ARG;
+    size_t record_length = sizeof(u32) + length;
+    u64 head = atomic_load_explicit(&header->head, memory_order_relaxed);
+    // The position of the consumer is only read again when the cached one shows that there's not enough space
+    while (head + record_length - ring->other_pos > ring->capacity) {
+        ring->other_pos = atomic_load_explicit(&header->tail, memory_order_acquire);
+        if (head + record_length - ring->other_pos <= ring->capacity)
+            break;
+        if (flags & FLAG_NONBLOCK)
+            return ERR_KERNEL_MQUEUE_FULL;
+        err = ring_wait(&header->producer_waiting, &header->tail, ring->other_pos, TIMEOUT_NONE);
+        if (err)
+            return err;
+    }
+    u32 record_header = length;
+    ring_write(ring, head, &record_header, sizeof(u32));
+    ring_write(ring, head + sizeof(u32), data, length);
+    atomic_store(&header->head, head + record_length);
+    ring_notify(&header->consumer_waiting);
+    return 0;
+}
+
+// Read a record from the ring
+// If the ring is empty, blocks until a record is written or the timeout passes, unless FLAG_NONBLOCK is set.
+// If the record is longer than `max_length`, it's left in the ring and ERR_KERNEL_MESSAGE_DATA_TOO_LONG is returned.
+// The length of the record is written to `length_ptr` in both cases.
+err_t ring_receive(Ring *ring, void *data, size_t max_length, size_t *length_ptr, i64 timeout, u64 flags) {
+    err_t err;
+    RingHeader *header = ring->header;
+    u64 tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+    // The position of the producer is only read again once all records up to the cached one were received
+    while (ring->other_pos == tail) {
+        ring->other_pos = atomic_load_explicit(&header->head, memory_order_acquire);
+        if (ring->other_pos != tail)
+            break;
+        if (flags & FLAG_NONBLOCK)
+            return ERR_KERNEL_MQUEUE_EMPTY;
+        err = ring_wait(&header->consumer_waiting, &header->head, tail, timeout);
+        if (err)
+            return err;
+    }
+    u32 length;
+    ring_read(ring, tail, &length, sizeof(u32));
+    *length_ptr = length;
+    if (length > max_length)
+        return ERR_KERNEL_MESSAGE_DATA_TOO_LONG;
+    ring_read(ring, tail + sizeof(u32), data, length);
+    atomic_store(&header->tail, tail + sizeof(u32) + length);
+    ring_notify(&header->producer_waiting);
+    return 0;
+}
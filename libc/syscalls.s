@@ -20,6 +20,18 @@ global message_resource_read
 global process_time_get
 global process_wait
 global channel_call_async
+global process_set_priority
+global message_reply_receive
+global shm_create
+global shm_map
+global shm_get_length
+global unmap_pages
+global process_get_memory_stats
+global thread_create
+global futex_wait
+global futex_wake
+global channel_send_batch
+global mqueue_receive_batch
 
 ; This file implements the C interface for system calls
 
@@ -138,3 +150,66 @@ channel_call_async:
   mov r10, rcx
   syscall
   ret
+
+process_set_priority:
+  mov rax, 22
+  syscall
+  ret
+
+message_reply_receive:
+  mov rax, 23
+  mov r10, rcx
+  syscall
+  ret
+
+shm_create:
+  mov rax, 24
+  syscall
+  ret
+
+shm_map:
+  mov rax, 25
+  syscall
+  ret
+
+shm_get_length:
+  mov rax, 26
+  syscall
+  ret
+
+unmap_pages:
+  mov rax, 27
+  syscall
+  ret
+
+process_get_memory_stats:
+  mov rax, 28
+  syscall
+  ret
+
+thread_create:
+  mov rax, 29
+  syscall
+  ret
+
+futex_wait:
+  mov rax, 30
+  syscall
+  ret
+
+futex_wake:
+  mov rax, 31
+  syscall
+  ret
+
+channel_send_batch:
+  mov rax, 32
+  mov r10, rcx
+  syscall
+  ret
+
+mqueue_receive_batch:
+  mov rax, 33
+  mov r10, rcx
+  syscall
+  ret
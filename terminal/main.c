@@ -298,7 +298,7 @@ typedef enum ModKeys : u32 {
 void main(void) {
     err_t err;
     handle_t event_mqueue;
-    err = mqueue_create(&event_mqueue);
+    err = mqueue_create(&event_mqueue, MQUEUE_DEFAULT_MAX_LENGTH, MQUEUE_DEFAULT_MAX_DATA_SIZE);
     if (err)
         return;
     err = mqueue_add_channel_resource(event_mqueue, &resource_name("video/redraw"), (MessageTag){EVENT_REDRAW, 0});
@@ -341,11 +341,24 @@ void main(void) {
     if (input_buffer == NULL)
         return;
     ModKeys mod_keys_held = 0;
+    // Events are received in batches and handled one at a time
+    MessageTag batch_tags[MESSAGE_BATCH_MAX];
+    handle_t batch_msgs[MESSAGE_BATCH_MAX];
+    size_t batch_length = 0;
+    size_t batch_i = 0;
     while (1) {
-        MessageTag tag;
-        err = mqueue_receive(event_mqueue, &tag, &msg, TIMEOUT_NONE, 0);
-        if (err)
-            continue;
+        if (batch_i == batch_length) {
+            batch_i = 0;
+            batch_length = MESSAGE_BATCH_MAX;
+            err = mqueue_receive_batch(event_mqueue, batch_tags, batch_msgs, &batch_length, TIMEOUT_NONE, 0);
+            if (err) {
+                batch_length = 0;
+                continue;
+            }
+        }
+        MessageTag tag = batch_tags[batch_i];
+        msg = batch_msgs[batch_i];
+        batch_i++;
         EventSource event_source = (EventSource)tag.data[0];
         switch (event_source) {
         case EVENT_KEYBOARD: {
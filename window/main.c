@@ -1092,7 +1092,7 @@ void main(void) {
     if (drive_info_length != 0 && drive_info_data == NULL)
         return;
     message_read(drive_info_msg, &(ReceiveMessage){drive_info_length, drive_info_data, 0, NULL}, NULL, NULL, 0, FLAG_FREE_MESSAGE);
-    err = mqueue_create(&event_queue);
+    err = mqueue_create(&event_queue, MQUEUE_DEFAULT_MAX_LENGTH, MQUEUE_DEFAULT_MAX_DATA_SIZE);
     if (err)
         return;
     // Handle first redraw to get resolution
@@ -1124,17 +1124,30 @@ void main(void) {
     if (err)
         return;
     ModKeys mod_keys_held = 0;
+    // Events are received in batches and handled one at a time
+    MessageTag batch_tags[MESSAGE_BATCH_MAX];
+    handle_t batch_msgs[MESSAGE_BATCH_MAX];
+    size_t batch_length = 0;
+    size_t batch_i = 0;
     while (1) {
         MessageTag tag;
-        i64 t;
-        time_get(&t);
-        err = mqueue_receive(event_queue, &tag, &msg, (t / 10000000 + 1) * 10000000, FLAG_PRIORITIZE_TIMEOUT);
-        if (err) {
-            // Timeout at the start of each second so that timer in status bar can be redrawn
-            if (err == ERR_KERNEL_TIMEOUT)
-                screen_changed = true;
-            continue;
+        if (batch_i == batch_length) {
+            i64 t;
+            time_get(&t);
+            batch_i = 0;
+            batch_length = MESSAGE_BATCH_MAX;
+            err = mqueue_receive_batch(event_queue, batch_tags, batch_msgs, &batch_length, (t / 10000000 + 1) * 10000000, FLAG_PRIORITIZE_TIMEOUT);
+            if (err) {
+                batch_length = 0;
+                // Timeout at the start of each second so that timer in status bar can be redrawn
+                if (err == ERR_KERNEL_TIMEOUT)
+                    screen_changed = true;
+                continue;
+            }
         }
+        tag = batch_tags[batch_i];
+        msg = batch_msgs[batch_i];
+        batch_i++;
         switch ((EventSource)tag.data[0]) {
         case EVENT_KEYBOARD_KEY: {
             // Read key event